@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdalign.h>
+#include <utils/utils.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN                    (alignof(max_align_t))
+#define ARENA_ROUND_UP(x)              (((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk_s {
+    arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) uint8_t data[];
+};
+
+static arena_chunk_t *arena_chunk_new(arena_t *a, size_t min_size)
+{
+    arena_chunk_t *c;
+    size_t size = a->chunk_size;
+
+    if (min_size > size)
+        size = min_size;
+
+    c = safe_malloc(sizeof(arena_chunk_t) + size);
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+void arena_init(arena_t *a, size_t chunk_size)
+{
+    a->head = NULL;
+    a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE_DEFAULT;
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+    void *p;
+    arena_chunk_t *c;
+
+    size = ARENA_ROUND_UP(size ? size : 1);
+    c = a->head;
+    if (c == NULL || c->size - c->used < size) {
+        c = arena_chunk_new(a, size);
+        if (a->head && size > a->chunk_size / 2) {
+            /**
+             * Large requests get a chunk of their own, kept behind the
+             * head so the space left in the current chunk isn't wasted.
+             */
+            c->next = a->head->next;
+            a->head->next = c;
+        } else {
+            c->next = a->head;
+            a->head = c;
+        }
+    }
+    p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void *arena_calloc(arena_t *a, size_t count, size_t size)
+{
+    void *p;
+
+    p = arena_alloc(a, count * size);
+    memset(p, 0, count * size);
+    return p;
+}
+
+char *arena_strndup(arena_t *a, const char *s, size_t len)
+{
+    char *p;
+
+    p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* Release everything but keep the most recent chunk around for reuse */
+void arena_reset(arena_t *a)
+{
+    arena_chunk_t *c, *next;
+
+    if (a->head == NULL)
+        return;
+
+    c = a->head->next;
+    while (c) {
+        next = c->next;
+        safe_free(c);
+        c = next;
+    }
+    a->head->next = NULL;
+    a->head->used = 0;
+}
+
+void arena_destroy(arena_t *a)
+{
+    arena_chunk_t *c, *next;
+
+    c = a->head;
+    while (c) {
+        next = c->next;
+        safe_free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
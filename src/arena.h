@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE_DEFAULT       (64 * 1024)
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+/**
+ * @brief A bump allocator. Memory handed out by an arena cannot be free-ed
+ * individually; it is all released at once in arena_destroy().
+ */
+typedef struct {
+    arena_chunk_t *head;
+    size_t chunk_size;
+} arena_t;
+
+void arena_init(arena_t *a, size_t chunk_size);
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_calloc(arena_t *a, size_t count, size_t size);
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+
+#endif /* _ARENA_H_ */
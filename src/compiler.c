@@ -0,0 +1,1521 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <utils/logger.h>
+
+#include "vm.h"
+
+LOGGER_MODULE_EXTERN(fluid, compiler);
+
+#define COMPILER_POOL_INITIAL          16
+#define COMPILER_UNROLL_MAX            256
+
+/* Names of locals (or counters) and their slots */
+typedef struct {
+    lexer_span_t *names;
+    uint32_t count;
+    uint32_t capacity;
+} compiler_symtab_t;
+
+/**
+ * A value known at compile time. Containers can't be constants, so they
+ * also carry their path from the globals (segs[first_seg ..]) to be
+ * loaded from at render time.
+ */
+typedef struct {
+    fobject_t *value;         /* new reference; NULL if only known at runtime */
+    uint32_t first_seg;
+    uint32_t num_segs;
+} compiler_static_t;
+
+enum compiler_skip {
+    COMPILER_SKIP_NONE,
+    COMPILER_SKIP_CONTINUE,   /* rest of this iteration is dead code */
+    COMPILER_SKIP_BREAK,      /* rest of the loop is dead code */
+};
+
+typedef struct compiler_loop_s compiler_loop_t;
+
+struct compiler_loop_s {
+    uint32_t top;             /* FOR_ITER of this loop; VM_NONE if unrolled */
+    uint32_t breaks;          /* chain of JUMPs to be patched to the end */
+    uint32_t continues;       /* unrolled; JUMPs to the next iteration */
+    uint32_t captures;        /* capture nesting outside the loop */
+    uint32_t dynamic;         /* c->dynamic at the start of the body */
+    uint32_t taint;           /* added to c->dynamic by runtime break/continue */
+    enum compiler_skip skip;
+    compiler_loop_t *outer;
+};
+
+/* A path key in strtab; see compiler_intern() */
+typedef struct {
+    vm_str_t str;
+    uint32_t hash;
+    uint32_t used;
+} compiler_intern_t;
+
+typedef struct {
+    parser_t *p;
+    vm_program_t *prog;
+    fobject_t *config;
+    uint32_t code_cap;
+    uint32_t strtab_cap;
+    uint32_t spans_cap;
+    uint32_t consts_cap;
+    uint32_t paths_cap;
+    uint32_t segs_cap;
+    uint32_t filters_cap;
+    uint32_t reg;             /* next free register */
+    uint32_t label;           /* code_len at the last jump target */
+    uint32_t captures;        /* current capture nesting */
+    uint32_t *capture_slots;  /* locals of the open captures */
+    uint32_t capture_slots_cap;
+    uint32_t dynamic;         /* > 0 if the code may not run exactly once */
+    compiler_intern_t *interned;  /* open addressed, by hash */
+    uint32_t interned_cap;    /* power of 2 */
+    uint32_t num_interned;
+    uint32_t interned_end;    /* strtab_len after the last new key */
+    compiler_symtab_t locals;
+    compiler_symtab_t counters;
+    uint32_t *decls;          /* per local; number of assigns/loops naming it */
+    compiler_static_t *bound; /* per local; value when known at compile time */
+    compiler_loop_t *loop;
+} compiler_t;
+
+static void *compiler_grow(void *arr, uint32_t *cap, uint32_t count,
+                           size_t size)
+{
+    if (count < *cap)
+        return arr;
+    *cap = *cap ? *cap * 2 : COMPILER_POOL_INITIAL;
+    return safe_realloc(arr, *cap * size);
+}
+
+#define COMPILER_PUSH(c, pool, count, cap)                                   \
+    ((c)->prog->pool = compiler_grow((c)->prog->pool, &(c)->cap,             \
+                                     (c)->prog->count,                       \
+                                     sizeof(*(c)->prog->pool)),              \
+     &(c)->prog->pool[(c)->prog->count++])
+
+static uint32_t compiler_emit(compiler_t *c, enum vm_opcode op,
+                              uint8_t a, uint8_t b, uint8_t x, uint32_t imm)
+{
+    vm_insn_t *insn;
+
+    insn = COMPILER_PUSH(c, code, code_len, code_cap);
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = x;
+    insn->imm = imm;
+    return c->prog->code_len - 1;
+}
+
+/* The next instruction is a jump target */
+static uint32_t compiler_label(compiler_t *c)
+{
+    c->label = c->prog->code_len;
+    return c->label;
+}
+
+/**
+ * Forward jumps to the same target are chained through their imm fields
+ * (VM_NONE ends the chain) and patched at once when the target is known.
+ */
+static uint32_t compiler_emit_jump(compiler_t *c, enum vm_opcode op,
+                                   uint8_t a, uint32_t *chain)
+{
+    uint32_t pc;
+
+    pc = compiler_emit(c, op, a, 0, 0, *chain);
+    *chain = pc;
+    return pc;
+}
+
+static void compiler_patch(compiler_t *c, uint32_t chain)
+{
+    uint32_t next, target;
+
+    if (chain == VM_NONE)
+        return;
+    target = compiler_label(c);
+    while (chain != VM_NONE) {
+        next = c->prog->code[chain].imm;
+        c->prog->code[chain].imm = target;
+        chain = next;
+    }
+}
+
+static void compiler_strtab_reserve(compiler_t *c, size_t len)
+{
+    vm_program_t *prog = c->prog;
+
+    while (prog->strtab_len + len + 1 > c->strtab_cap) {
+        c->strtab_cap = c->strtab_cap ? c->strtab_cap * 2 : 1024;
+        prog->strtab = safe_realloc(prog->strtab, c->strtab_cap);
+    }
+}
+
+static vm_str_t compiler_str(compiler_t *c, const char *buf, size_t len)
+{
+    vm_str_t s;
+    vm_program_t *prog = c->prog;
+
+    compiler_strtab_reserve(c, len);
+    memcpy(prog->strtab + prog->strtab_len, buf, len);
+    prog->strtab[prog->strtab_len + len] = '\0';
+    s.off = prog->strtab_len;
+    s.len = len;
+    prog->strtab_len += len + 1;
+    return s;
+}
+
+/* Emit text; runs of text with no jump target between them are merged */
+static void compiler_text(compiler_t *c, const char *buf, size_t len)
+{
+    vm_str_t *span, s;
+    vm_program_t *prog = c->prog;
+    vm_insn_t *last = prog->code_len ? &prog->code[prog->code_len - 1] : NULL;
+
+    if (len == 0)
+        return;
+    if (last && last->op == VM_OP_EMIT_SPAN && c->label < prog->code_len) {
+        span = &prog->spans[last->imm];
+        if (span->off + span->len + 1 == prog->strtab_len) {
+            /* drop the '\0' of the last span and extend it */
+            prog->strtab_len -= 1;
+            s = compiler_str(c, buf, len);
+            span->len += s.len;
+            return;
+        }
+    }
+    span = COMPILER_PUSH(c, spans, num_spans, spans_cap);
+    *span = compiler_str(c, buf, len);
+    compiler_emit(c, VM_OP_EMIT_SPAN, 0, 0, 0, prog->num_spans - 1);
+}
+
+static uint32_t compiler_symbol(compiler_symtab_t *t, lexer_span_t *name,
+                                bool add)
+{
+    uint32_t i;
+
+    for (i = 0; i < t->count; i++) {
+        if (t->names[i].len == name->len &&
+            memcmp(t->names[i].buf, name->buf, name->len) == 0)
+            return i;
+    }
+    if (!add)
+        return VM_NONE;
+    t->names = compiler_grow(t->names, &t->capacity, t->count,
+                             sizeof(lexer_span_t));
+    t->names[t->count] = *name;
+    return t->count++;
+}
+
+static int compiler_alloc_regs(compiler_t *c, uint32_t n, uint8_t *base)
+{
+    if (c->reg + n > VM_MAX_REGS) {
+        LOG_ERR("expression too complex; out of registers");
+        return -1;
+    }
+    *base = c->reg;
+    c->reg += n;
+    if (c->reg > c->prog->num_regs)
+        c->prog->num_regs = c->reg;
+    return 0;
+}
+
+static uint32_t compiler_add_const(compiler_t *c, vm_const_t *k)
+{
+    *COMPILER_PUSH(c, consts, num_consts, consts_cap) = *k;
+    return c->prog->num_consts - 1;
+}
+
+static int compiler_const(compiler_t *c, vm_const_t *k, uint8_t reg)
+{
+    compiler_emit(c, VM_OP_LOAD_CONST, reg, 0, 0, compiler_add_const(c, k));
+    return 0;
+}
+
+/**
+ * Re-insert the interned keys that lie below strtab offset `limit` into a
+ * table of `cap` slots, dropping the rest (their strings were rewound).
+ */
+static void compiler_intern_rebuild(compiler_t *c, uint32_t cap,
+                                    uint32_t limit)
+{
+    uint32_t i, j, old_cap = c->interned_cap;
+    compiler_intern_t *old = c->interned;
+
+    c->interned = safe_calloc(cap, sizeof(compiler_intern_t));
+    c->interned_cap = cap;
+    c->num_interned = 0;
+    for (i = 0; i < old_cap; i++) {
+        if (!old[i].used || old[i].str.off + old[i].str.len >= limit)
+            continue;
+        for (j = old[i].hash & (cap - 1); c->interned[j].used;
+             j = (j + 1) & (cap - 1))
+            ;
+        c->interned[j] = old[i];
+        c->num_interned++;
+    }
+    safe_free(old);
+}
+
+/* Paths through the same names share one copy of each key */
+static vm_str_t compiler_intern(compiler_t *c, const char *buf, size_t len,
+                                uint32_t hash)
+{
+    uint32_t i, mask;
+    compiler_intern_t *e;
+    vm_program_t *prog = c->prog;
+
+    if (2 * (c->num_interned + 1) > c->interned_cap)
+        compiler_intern_rebuild(c, c->interned_cap ? c->interned_cap * 2 :
+                                   COMPILER_POOL_INITIAL, prog->strtab_len);
+    mask = c->interned_cap - 1;
+    for (i = hash & mask; c->interned[i].used; i = (i + 1) & mask) {
+        e = &c->interned[i];
+        if (e->hash == hash && e->str.len == len &&
+            memcmp(prog->strtab + e->str.off, buf, len) == 0)
+            return e->str;
+    }
+    e = &c->interned[i];
+    e->str = compiler_str(c, buf, len);
+    e->hash = hash;
+    e->used = 1;
+    c->num_interned++;
+    c->interned_end = prog->strtab_len;
+    return e->str;
+}
+
+static void compiler_seg_key(compiler_t *c, vm_seg_t *seg, const char *buf,
+                             size_t len)
+{
+    static const struct {
+        const char *name;
+        enum vm_seg_kind kind;
+    } names[] = {
+        { "first", VM_SEG_FIRST },
+        { "last",  VM_SEG_LAST },
+        { "size",  VM_SEG_SIZE },
+    };
+    size_t i;
+
+    seg->hash = fdict_hash(buf, len);
+    seg->key = compiler_intern(c, buf, len, seg->hash);
+    seg->kind = VM_SEG_KEY;
+    seg->index = 0;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == len &&
+            memcmp(names[i].name, buf, len) == 0)
+            seg->kind = names[i].kind;
+    }
+}
+
+static void compiler_push_seg(compiler_t *c, vm_seg_t *seg)
+{
+    *COMPILER_PUSH(c, segs, num_segs, segs_cap) = *seg;
+}
+
+/**
+ * The index of `[n]`, with p just past the '['. Only plain digits that fit
+ * an index are taken, so `[+1]`, `[-1]` and `[1x]` are not indices.
+ * Returns the position after the ']', or NULL.
+ */
+static const char *compiler_path_index(const char *p, const char *stop,
+                                       uint32_t *index)
+{
+    const char *start = p;
+    uint64_t n = 0;
+
+    for (; p < stop && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (*p - '0');
+        if (n > UINT32_MAX)
+            return NULL;
+    }
+    if (p == start || p >= stop || *p != ']')
+        return NULL;
+    *index = n;
+    return p + 1;
+}
+
+/* Split `name`, `name.key`, `name[2]`, `name.list[0].key` ... into segs */
+static int compiler_path_segs(compiler_t *c, lexer_span_t *span,
+                              uint32_t *first)
+{
+    vm_seg_t seg;
+    const char *p = span->buf, *stop = span->buf + span->len, *start;
+
+    *first = c->prog->num_segs;
+    while (p < stop) {
+        start = p;
+        while (p < stop && *p != '.' && *p != '[')
+            p++;
+        if (p == start && (p == span->buf || p[-1] != ']'))
+            return -1;
+        if (p > start) {
+            compiler_seg_key(c, &seg, start, p - start);
+            compiler_push_seg(c, &seg);
+        }
+        if (p < stop && *p == '[') {
+            compiler_seg_key(c, &seg, "", 0);
+            seg.kind = VM_SEG_INDEX;
+            p = compiler_path_index(p + 1, stop, &seg.index);
+            if (p == NULL)
+                return -1;
+            compiler_push_seg(c, &seg);
+        }
+        if (p < stop && *p == '.') {
+            p++;
+            if (p == stop)
+                return -1;
+        }
+    }
+    if (*first == c->prog->num_segs ||
+        c->prog->segs[*first].kind == VM_SEG_INDEX)
+        return -1;
+    return 0;
+}
+
+static uint32_t compiler_path_local(compiler_t *c, uint32_t first)
+{
+    lexer_span_t name;
+
+    name.buf = c->prog->strtab + c->prog->segs[first].key.off;
+    name.len = c->prog->segs[first].key.len;
+    return compiler_symbol(&c->locals, &name, false);
+}
+
+static int compiler_path(compiler_t *c, lexer_span_t *span, uint8_t reg)
+{
+    uint32_t first;
+    vm_path_t *path;
+
+    if (compiler_path_segs(c, span, &first) != 0) {
+        LOG_ERR("bad variable '%.*s'", (int)span->len, span->buf);
+        return -1;
+    }
+    path = COMPILER_PUSH(c, paths, num_paths, paths_cap);
+    path->first_seg = first;
+    path->num_segs = c->prog->num_segs - first;
+    path->local = compiler_path_local(c, first);
+    compiler_emit(c, VM_OP_LOAD_PATH, reg, 0, 0, c->prog->num_paths - 1);
+    return 0;
+}
+
+static bool compiler_word_is(lexer_tok_t *t, const char *word)
+{
+    size_t len = strlen(word);
+
+    return t->span.len == len && memcmp(t->span.buf, word, len) == 0;
+}
+
+/* --- Compile time evaluation --- */
+
+static bool compiler_is_scalar(fobject_t *v)
+{
+    return v->type != FTYPE_LIST && v->type != FTYPE_DICT;
+}
+
+static void compiler_static_clear(compiler_static_t *s)
+{
+    DEC_REF(s->value);
+    memset(s, 0, sizeof(compiler_static_t));
+}
+
+/* Evaluation may add path segments; drop them once they aren't needed */
+typedef struct {
+    uint32_t num_segs;
+    uint32_t strtab_len;
+} compiler_mark_t;
+
+static void compiler_mark(compiler_t *c, compiler_mark_t *m)
+{
+    m->num_segs = c->prog->num_segs;
+    m->strtab_len = c->prog->strtab_len;
+}
+
+static void compiler_rewind(compiler_t *c, compiler_mark_t *m)
+{
+    c->prog->num_segs = m->num_segs;
+    if (c->prog->strtab_len == m->strtab_len)
+        return;
+    c->prog->strtab_len = m->strtab_len;
+    /* forget the keys interned since the mark */
+    if (c->interned_end > m->strtab_len) {
+        compiler_intern_rebuild(c, c->interned_cap, m->strtab_len);
+        c->interned_end = m->strtab_len;
+    }
+}
+
+/**
+ * Resolve a path against the config and the locals bound so far. Only
+ * values that are actually there count; anything missing is left for
+ * the render time globals to provide.
+ */
+static void compiler_eval_path(compiler_t *c, lexer_span_t *span,
+                               compiler_static_t *out)
+{
+    vm_seg_t *seg, *tmp;
+    compiler_static_t *bound = NULL;
+    fobject_t *cur = NULL, *next;
+    uint32_t i, first, slot, num_segs, nb = 0;
+    compiler_mark_t mark;
+
+    compiler_mark(c, &mark);
+    memset(out, 0, sizeof(compiler_static_t));
+    if (compiler_path_segs(c, span, &first) != 0)
+        goto dynamic;
+    num_segs = c->prog->num_segs - first;
+
+    slot = compiler_path_local(c, first);
+    if (slot != VM_NONE) {
+        bound = &c->bound[slot];
+        cur = INC_REF(bound->value);
+        nb = bound->num_segs;
+    }
+    else if (c->config) {
+        cur = vm_path_step(c->config, &c->prog->segs[first],
+                           c->prog->strtab + c->prog->segs[first].key.off,
+                           num_segs == 1);
+        nb = 1;
+    }
+    for (i = 1; cur && i < num_segs; i++) {
+        seg = &c->prog->segs[first + i];
+        next = vm_path_step(cur, seg, c->prog->strtab + seg->key.off,
+                            i + 1 == num_segs);
+        DEC_REF(cur);
+        cur = next;
+    }
+    if (cur == NULL)
+        goto dynamic;
+
+    out->value = cur;
+    if (compiler_is_scalar(cur)) {
+        compiler_rewind(c, &mark);
+        return;
+    }
+    if (bound) {
+        /* bound prefix, then the rest of this path */
+        tmp = safe_malloc((nb + num_segs - 1) * sizeof(vm_seg_t));
+        memcpy(tmp, c->prog->segs + bound->first_seg, nb * sizeof(vm_seg_t));
+        memcpy(tmp + nb, c->prog->segs + first + 1,
+               (num_segs - 1) * sizeof(vm_seg_t));
+        c->prog->num_segs = first;
+        for (i = 0; i < nb + num_segs - 1; i++)
+            compiler_push_seg(c, &tmp[i]);
+        safe_free(tmp);
+    }
+    out->first_seg = first;
+    out->num_segs = c->prog->num_segs - first;
+    return;
+dynamic:
+    compiler_rewind(c, &mark);
+}
+
+static void compiler_eval(compiler_t *c, lexer_tok_t *t, compiler_static_t *out)
+{
+    char buf[64];
+
+    memset(out, 0, sizeof(compiler_static_t));
+    switch (t->type) {
+    case LEXER_TOK_STRING:
+        out->value = fobj_from_string(t->span.buf, t->span.len);
+        break;
+    case LEXER_TOK_NUMBER:
+        if (t->span.len >= sizeof(buf))
+            break;
+        memcpy(buf, t->span.buf, t->span.len);
+        buf[t->span.len] = '\0';
+        out->value = fobj_from_double(strtod(buf, NULL));
+        break;
+    case LEXER_TOK_WORD:
+        if (compiler_word_is(t, "true") || compiler_word_is(t, "false"))
+            out->value = fobj_from_bool(compiler_word_is(t, "true"));
+        else if (compiler_word_is(t, "nil") || compiler_word_is(t, "null"))
+            out->value = __fobj_new(FTYPE_NIL);
+        else
+            compiler_eval_path(c, &t->span, out);
+        break;
+    default:
+        break;
+    }
+}
+
+/* 1/0 if compare node `idx` is known to be true/false; -1 otherwise */
+static int compiler_eval_condition(compiler_t *c, uint32_t idx)
+{
+    int l, r, ret = -1;
+    compiler_mark_t mark;
+    compiler_static_t lhs, rhs;
+    struct pt_node_compare *cmp = &c->p->nodes[idx].compare;
+
+    compiler_mark(c, &mark);
+
+    switch (cmp->operator) {
+    case LIQ_OP_LOGIC_AND:
+    case LIQ_OP_LOGIC_OR:
+        /* conditions have no side effects; either side can decide */
+        l = compiler_eval_condition(c, cmp->left);
+        r = compiler_eval_condition(c, cmp->right);
+        if (cmp->operator == LIQ_OP_LOGIC_AND)
+            return (l == 0 || r == 0) ? 0 : ((l == 1 && r == 1) ? 1 : -1);
+        return (l == 1 || r == 1) ? 1 : ((l == 0 && r == 0) ? 0 : -1);
+    case LIQ_OP_SENTINEL:
+        compiler_eval(c, &cmp->lhs, &lhs);
+        if (lhs.value)
+            ret = vm_truthy(lhs.value);
+        compiler_static_clear(&lhs);
+        compiler_rewind(c, &mark);
+        return ret;
+    default:
+        compiler_eval(c, &cmp->lhs, &lhs);
+        compiler_eval(c, &cmp->rhs, &rhs);
+        if (lhs.value && rhs.value)
+            ret = vm_compare(cmp->operator, lhs.value, rhs.value);
+        compiler_static_clear(&lhs);
+        compiler_static_clear(&rhs);
+        compiler_rewind(c, &mark);
+        return ret;
+    }
+}
+
+/* The constant for a scalar known at compile time */
+static void compiler_scalar_const(compiler_t *c, fobject_t *v, vm_const_t *k)
+{
+    memset(k, 0, sizeof(vm_const_t));
+    switch (v->type) {
+    case FTYPE_NUMBER:
+        k->type = VM_CONST_NUMBER;
+        k->number = v->number.data;
+        break;
+    case FTYPE_STRING:
+        k->type = VM_CONST_STRING;
+        k->string = compiler_str(c, v->string.data, v->string.length);
+        break;
+    case FTYPE_BOOLEAN:
+        k->type = VM_CONST_BOOLEAN;
+        k->boolean = v->boolean.data;
+        break;
+    default:
+        k->type = VM_CONST_NIL;
+        break;
+    }
+}
+
+static int compiler_load_static(compiler_t *c, compiler_static_t *s,
+                                uint8_t reg)
+{
+    vm_path_t *path;
+    vm_const_t k;
+
+    if (compiler_is_scalar(s->value)) {
+        compiler_scalar_const(c, s->value, &k);
+        return compiler_const(c, &k, reg);
+    }
+    path = COMPILER_PUSH(c, paths, num_paths, paths_cap);
+    path->first_seg = s->first_seg;
+    path->num_segs = s->num_segs;
+    path->local = VM_NONE;
+    compiler_emit(c, VM_OP_LOAD_PATH, reg, 0, 0, c->prog->num_paths - 1);
+    return 0;
+}
+
+/* --- Code generation --- */
+
+/* Load a literal or variable into reg */
+static int compiler_operand(compiler_t *c, lexer_tok_t *t, uint8_t reg)
+{
+    int ret;
+    compiler_static_t s;
+
+    compiler_eval(c, t, &s);
+    if (s.value) {
+        ret = compiler_load_static(c, &s, reg);
+        compiler_static_clear(&s);
+        return ret;
+    }
+    if (t->type == LEXER_TOK_WORD)
+        return compiler_path(c, &t->span, reg);
+    LOG_ERR("bad operand '%.*s'", (int)t->span.len, t->span.buf);
+    return -1;
+}
+
+static int compiler_filter(compiler_t *c, liq_filter_t *f, uint8_t reg)
+{
+    liq_filter_t *dst;
+
+    dst = COMPILER_PUSH(c, filters, num_filters, filters_cap);
+    *dst = *f;
+    compiler_emit(c, VM_OP_FILTER, reg, 0, 0, c->prog->num_filters - 1);
+    return 0;
+}
+
+/* Evaluate compare node `idx` into reg; reg + 1 is scratch */
+static enum liq_operators compiler_mirror(enum liq_operators op)
+{
+    switch (op) {
+    case LIQ_OP_LESS:        return LIQ_OP_GREAT;
+    case LIQ_OP_GREAT:       return LIQ_OP_LESS;
+    case LIQ_OP_LESS_EQUAL:  return LIQ_OP_GREAT_EQUAL;
+    case LIQ_OP_GREAT_EQUAL: return LIQ_OP_LESS_EQUAL;
+    case LIQ_OP_CONTAINS:    return LIQ_OP_SENTINEL;
+    default:                 return op;
+    }
+}
+
+/**
+ * `x <op> literal` (or `literal <op> x`, mirrored) compares x against the
+ * constant in place, so the VM can pick a typed comparison up front. 1 if
+ * done, 0 if neither side is a known scalar, -1 on error.
+ */
+static int compiler_compare_const(compiler_t *c, struct pt_node_compare *cmp,
+                                  uint8_t reg)
+{
+    vm_const_t k;
+    compiler_mark_t mark;
+    compiler_static_t s;
+    lexer_tok_t *var = &cmp->lhs;
+    enum liq_operators op = cmp->operator;
+
+    compiler_mark(c, &mark);
+    compiler_eval(c, &cmp->rhs, &s);
+    if (s.value == NULL && compiler_mirror(op) != LIQ_OP_SENTINEL) {
+        compiler_eval(c, &cmp->lhs, &s);
+        var = &cmp->rhs;
+        op = compiler_mirror(op);
+    }
+    if (s.value == NULL || !compiler_is_scalar(s.value)) {
+        compiler_static_clear(&s);
+        compiler_rewind(c, &mark);
+        return 0;
+    }
+    compiler_scalar_const(c, s.value, &k);
+    compiler_static_clear(&s);
+    if (compiler_operand(c, var, reg))
+        return -1;
+    compiler_emit(c, VM_OP_CMP_CONST, reg, reg, op, compiler_add_const(c, &k));
+    return 1;
+}
+
+static int compiler_condition(compiler_t *c, uint32_t idx, uint8_t reg)
+{
+    int truth, ret;
+    uint32_t skip = VM_NONE;
+    vm_const_t k = { 0 };
+    struct pt_node_compare cmp = c->p->nodes[idx].compare;
+
+    truth = compiler_eval_condition(c, idx);
+    if (truth >= 0) {
+        k.type = VM_CONST_BOOLEAN;
+        k.boolean = truth;
+        return compiler_const(c, &k, reg);
+    }
+
+    switch (cmp.operator) {
+    case LIQ_OP_LOGIC_AND:
+    case LIQ_OP_LOGIC_OR:
+        if (compiler_condition(c, cmp.left, reg))
+            return -1;
+        compiler_emit_jump(c, cmp.operator == LIQ_OP_LOGIC_AND ?
+                           VM_OP_JUMP_IFNOT : VM_OP_JUMP_IF, reg, &skip);
+        if (compiler_condition(c, cmp.right, reg))
+            return -1;
+        compiler_patch(c, skip);
+        return 0;
+    case LIQ_OP_SENTINEL:
+        return compiler_operand(c, &cmp.lhs, reg);
+    default:
+        ret = compiler_compare_const(c, &cmp, reg);
+        if (ret != 0)
+            return ret < 0 ? -1 : 0;
+        if (compiler_operand(c, &cmp.lhs, reg) ||
+            compiler_operand(c, &cmp.rhs, reg + 1))
+            return -1;
+        compiler_emit(c, VM_OP_CMP, reg, reg, reg + 1, cmp.operator);
+        return 0;
+    }
+}
+
+static int compiler_node(compiler_t *c, uint32_t idx);
+
+static int compiler_children(compiler_t *c, uint32_t idx)
+{
+    uint32_t child = c->p->nodes[idx].first_child;
+
+    while (child != PT_IDX_NONE) {
+        if (compiler_node(c, child))
+            return -1;
+        if (c->loop && c->loop->skip != COMPILER_SKIP_NONE)
+            break; /* after an unconditional break/continue */
+        child = c->p->nodes[child].next_sibling;
+    }
+    return 0;
+}
+
+/**
+ * Arms whose condition is known are dropped, or (if true) end the chain
+ * like an else would.
+ */
+static int compiler_branch(compiler_t *c, uint32_t idx)
+{
+    int truth;
+    uint8_t reg;
+    uint32_t arm, skip, done = VM_NONE, dynamic = 0;
+    struct pt_node_branch *br;
+
+    for (arm = idx; arm != PT_IDX_NONE; arm = br->alternate) {
+        br = &c->p->nodes[arm].branch;
+        if (br->keyword == LIQ_KW_CASE)
+            continue; /* a case only holds the when/else arms */
+        skip = VM_NONE;
+        truth = 1;
+        if (br->condition != PT_IDX_NONE) {
+            truth = compiler_eval_condition(c, br->condition);
+            if (truth >= 0 && br->keyword == LIQ_KW_UNLESS)
+                truth = !truth;
+        }
+        if (truth == 0)
+            continue;
+        if (truth < 0) {
+            if (compiler_alloc_regs(c, 2, &reg) ||
+                compiler_condition(c, br->condition, reg))
+                return -1;
+            compiler_emit_jump(c, br->keyword == LIQ_KW_UNLESS ?
+                               VM_OP_JUMP_IF : VM_OP_JUMP_IFNOT, reg, &skip);
+            c->reg -= 2;
+            dynamic = 1;
+        }
+        c->dynamic += dynamic;
+        if (compiler_children(c, arm))
+            return -1;
+        c->dynamic -= dynamic;
+        if (truth == 1)
+            break;
+        if (br->alternate != PT_IDX_NONE)
+            compiler_emit_jump(c, VM_OP_JUMP, 0, &done);
+        compiler_patch(c, skip);
+    }
+    compiler_patch(c, done);
+    return 0;
+}
+
+static void compiler_loop_enter(compiler_t *c, compiler_loop_t *ctx)
+{
+    memset(ctx, 0, sizeof(compiler_loop_t));
+    ctx->top = VM_NONE;
+    ctx->breaks = VM_NONE;
+    ctx->continues = VM_NONE;
+    ctx->captures = c->captures;
+    ctx->dynamic = c->dynamic;
+    ctx->outer = c->loop;
+    c->loop = ctx;
+}
+
+static void compiler_loop_leave(compiler_t *c, compiler_loop_t *ctx)
+{
+    c->dynamic -= ctx->taint;
+    c->loop = ctx->outer;
+}
+
+/**
+ * Expand a loop over a list (or range) that is known at compile time into
+ * one copy of the body per item, with the loop variable bound to it.
+ * Returns 1 if the loop was unrolled and 0 if it has to run at render time.
+ */
+static int compiler_unroll(compiler_t *c, uint32_t idx)
+{
+    int i, ret = 0;
+    vm_seg_t seg;
+    long long start, first, last, k;
+    uint32_t j, var;
+    uint8_t flags = 0;
+    fobject_t *regs[4];
+    compiler_static_t s[4];
+    compiler_loop_t ctx;
+    compiler_static_t *bound;
+    struct pt_node_loop *loop = &c->p->nodes[idx].loop;
+
+    var = compiler_symbol(&c->locals, &loop->variable.span, false);
+    if (c->decls[var] != 1)
+        return 0; /* assigned elsewhere too; can't bind it */
+
+    memset(s, 0, sizeof(s));
+    if (loop->is_range) {
+        flags |= VM_FOR_RANGE;
+        compiler_eval(c, &loop->range_start, &s[0]);
+        compiler_eval(c, &loop->range_end, &s[1]);
+    }
+    else {
+        compiler_eval(c, &loop->collection, &s[0]);
+    }
+    if (loop->limit.span.buf) {
+        flags |= VM_FOR_LIMIT;
+        compiler_eval(c, &loop->limit, &s[2]);
+    }
+    if (loop->offset.span.buf) {
+        flags |= VM_FOR_OFFSET;
+        compiler_eval(c, &loop->offset, &s[3]);
+    }
+    for (i = 0; i < 4; i++) {
+        regs[i] = s[i].value;
+        if ((i == 0 || (i == 1 && loop->is_range) ||
+             (i == 2 && (flags & VM_FOR_LIMIT)) ||
+             (i == 3 && (flags & VM_FOR_OFFSET))) && regs[i] == NULL)
+            goto out;
+    }
+    vm_loop_bounds(regs, flags, &start, &first, &last);
+    if (last - first > COMPILER_UNROLL_MAX)
+        goto out;
+
+    ret = 1;
+    bound = &c->bound[var];
+    compiler_loop_enter(c, &ctx);
+    for (i = 0; i < last - first; i++) {
+        k = loop->reversed ? last - 1 - i : first + i;
+        if (loop->is_range) {
+            bound->value = fobj_from_double(start + k);
+        }
+        else {
+            bound->value = INC_REF(regs[0]->list.items[k]);
+        }
+        if (!compiler_is_scalar(bound->value)) {
+            /* the item's path from the globals; `collection[k]` */
+            bound->first_seg = c->prog->num_segs;
+            bound->num_segs = s[0].num_segs + 1;
+            for (j = 0; j < s[0].num_segs; j++) {
+                seg = c->prog->segs[s[0].first_seg + j];
+                compiler_push_seg(c, &seg);
+            }
+            compiler_seg_key(c, &seg, "", 0);
+            seg.kind = VM_SEG_INDEX;
+            seg.index = k;
+            compiler_push_seg(c, &seg);
+        }
+        ret = compiler_children(c, idx) ? -1 : 1;
+        compiler_static_clear(bound);
+        if (ret < 0 || ctx.skip == COMPILER_SKIP_BREAK)
+            break;
+        ctx.skip = COMPILER_SKIP_NONE;
+        compiler_patch(c, ctx.continues);
+        ctx.continues = VM_NONE;
+    }
+    compiler_loop_leave(c, &ctx);
+    if (ret > 0 && last == first && loop->alternate != PT_IDX_NONE &&
+        compiler_children(c, loop->alternate))
+        ret = -1;
+    compiler_patch(c, ctx.breaks);
+out:
+    for (i = 0; i < 4; i++)
+        compiler_static_clear(&s[i]);
+    return ret;
+}
+
+static int compiler_loop(compiler_t *c, uint32_t idx)
+{
+    int ret;
+    uint8_t base, reg, flags = 0;
+    uint32_t init = VM_NONE, exit = VM_NONE, iter, var;
+    struct pt_node_loop loop = c->p->nodes[idx].loop;
+    compiler_loop_t ctx;
+
+    ret = compiler_unroll(c, idx);
+    if (ret != 0)
+        return ret < 0 ? -1 : 0;
+
+    if (c->prog->num_loops >= UINT8_MAX) {
+        LOG_ERR("too many loops");
+        return -1;
+    }
+    iter = c->prog->num_loops++;
+
+    if (compiler_alloc_regs(c, 4, &base))
+        return -1;
+    if (loop.is_range) {
+        flags |= VM_FOR_RANGE;
+        if (compiler_operand(c, &loop.range_start, base) ||
+            compiler_operand(c, &loop.range_end, base + 1))
+            return -1;
+    }
+    else if (compiler_operand(c, &loop.collection, base)) {
+        return -1;
+    }
+    if (loop.limit.span.buf) {
+        flags |= VM_FOR_LIMIT;
+        if (compiler_operand(c, &loop.limit, base + 2))
+            return -1;
+    }
+    if (loop.offset.span.buf) {
+        flags |= VM_FOR_OFFSET;
+        if (compiler_operand(c, &loop.offset, base + 3))
+            return -1;
+    }
+    if (loop.reversed)
+        flags |= VM_FOR_REVERSED;
+    compiler_emit(c, VM_OP_FOR_INIT, iter, base, flags, VM_NONE);
+    init = c->prog->code_len - 1;
+    c->reg -= 4;
+
+    var = compiler_symbol(&c->locals, &loop.variable.span, true);
+    if (compiler_alloc_regs(c, 1, &reg))
+        return -1;
+    c->dynamic += 1;
+    compiler_loop_enter(c, &ctx);
+    ctx.top = compiler_label(c);
+    compiler_emit(c, VM_OP_FOR_ITER, iter, reg, 0, VM_NONE);
+    exit = c->prog->code_len - 1;
+    compiler_emit(c, VM_OP_STORE, reg, 0, 0, var);
+    c->reg -= 1;
+
+    if (compiler_children(c, idx))
+        return -1;
+    compiler_emit(c, VM_OP_JUMP, 0, 0, 0, ctx.top);
+    compiler_loop_leave(c, &ctx);
+
+    compiler_patch(c, init);
+    if (loop.alternate != PT_IDX_NONE && compiler_children(c, loop.alternate))
+        return -1;
+    c->dynamic -= 1;
+    compiler_patch(c, exit);
+    compiler_patch(c, ctx.breaks);
+    return 0;
+}
+
+static int compiler_stmt(compiler_t *c, uint32_t idx)
+{
+    uint32_t slot;
+    compiler_loop_t *loop = c->loop;
+    struct pt_node_statement stmt = c->p->nodes[idx].stmt;
+
+    switch (stmt.keyword) {
+    case LIQ_KW_BREAK:
+    case LIQ_KW_CONTINUE:
+        /* leaving captures opened inside the loop ends them */
+        for (slot = c->captures; slot > loop->captures; slot--)
+            compiler_emit(c, VM_OP_CAPTURE_END, 0, 0, 0,
+                          c->capture_slots[slot - 1]);
+        if (stmt.keyword == LIQ_KW_BREAK)
+            compiler_emit_jump(c, VM_OP_JUMP, 0, &loop->breaks);
+        else if (loop->top == VM_NONE)
+            compiler_emit_jump(c, VM_OP_JUMP, 0, &loop->continues);
+        else
+            compiler_emit(c, VM_OP_JUMP, 0, 0, 0, loop->top);
+        if (c->dynamic == loop->dynamic) {
+            /* always taken; what follows is dead */
+            loop->skip = stmt.keyword == LIQ_KW_BREAK ?
+                         COMPILER_SKIP_BREAK : COMPILER_SKIP_CONTINUE;
+        }
+        else if (loop->taint == 0) {
+            /* code after this point may or may not run */
+            loop->taint = 1;
+            c->dynamic += 1;
+        }
+        return 0;
+    case LIQ_KW_INCREMENT:
+    case LIQ_KW_DECREMENT:
+        if (stmt.num_tokens != 1 || stmt.tokens[0].type != LEXER_TOK_WORD) {
+            LOG_ERR("increment/decrement needs a variable name");
+            return -1;
+        }
+        slot = compiler_symbol(&c->counters, &stmt.tokens[0].span, true);
+        compiler_emit(c, stmt.keyword == LIQ_KW_INCREMENT ?
+                      VM_OP_INCREMENT : VM_OP_DECREMENT, 0, 0, 0, slot);
+        c->prog->num_counters = c->counters.count;
+        return 0;
+    default:
+        LOG_ERR("unsupported statement");
+        return -1;
+    }
+}
+
+/* `{{ x | f }}` with x known at compile time becomes text */
+static int compiler_fold_object(compiler_t *c, pt_node_t *n)
+{
+    int i;
+    size_t len;
+    sink_t tmp;
+    const char *data;
+    fobject_t *val;
+    compiler_mark_t mark;
+    compiler_static_t s;
+
+    compiler_mark(c, &mark);
+    compiler_eval(c, &n->object.identifier, &s);
+    for (i = 0; s.value && i < n->object.num_filters; i++) {
+        val = vm_apply_filter(&n->object.filters[i], s.value);
+        DEC_REF(s.value);
+        s.value = val;
+    }
+    compiler_rewind(c, &mark);
+    if (s.value == NULL)
+        return 0; /* left to the VM, which also reports filter errors */
+
+    sink_open_mem(&tmp);
+    vm_write_value(&tmp, s.value);
+    data = sink_mem_data(&tmp, &len);
+    compiler_text(c, data, len);
+    sink_close(&tmp);
+    compiler_static_clear(&s);
+    return 1;
+}
+
+/**
+ * Assignments always store at render time. If the value is known and the
+ * assign runs exactly once, later uses are also resolved at compile time.
+ */
+static int compiler_assign(compiler_t *c, uint32_t idx, uint32_t slot)
+{
+    uint8_t reg;
+    fobject_t *val;
+    compiler_static_t s;
+    pt_node_t *n = &c->p->nodes[idx];
+
+    compiler_static_clear(&c->bound[slot]);
+    compiler_eval(c, &n->assign.value, &s);
+    if (s.value && n->assign.filter.id != LIQ_FILTER_NONE) {
+        val = vm_apply_filter(&n->assign.filter, s.value);
+        compiler_static_clear(&s);
+        s.value = val;
+    }
+    if (s.value && c->dynamic == 0 && c->decls[slot] == 1) {
+        if (compiler_alloc_regs(c, 1, &reg) ||
+            compiler_load_static(c, &s, reg))
+            return -1;
+        compiler_emit(c, VM_OP_STORE, reg, 0, 0, slot);
+        c->reg -= 1;
+        c->bound[slot] = s;
+        return 0;
+    }
+    compiler_static_clear(&s);
+
+    if (compiler_alloc_regs(c, 1, &reg) ||
+        compiler_operand(c, &n->assign.value, reg))
+        return -1;
+    if (n->assign.filter.id != LIQ_FILTER_NONE)
+        compiler_filter(c, &n->assign.filter, reg);
+    compiler_emit(c, VM_OP_STORE, reg, 0, 0, slot);
+    c->reg -= 1;
+    return 0;
+}
+
+/**
+ * A capture whose body came out as plain text (at most one span, since
+ * runs of text are merged) is a string assign, and is bound like one.
+ */
+static int compiler_capture(compiler_t *c, uint32_t idx, uint32_t slot)
+{
+    uint8_t reg;
+    uint32_t begin;
+    vm_insn_t *insn;
+    vm_str_t *span;
+    compiler_static_t s = { 0 };
+
+    compiler_static_clear(&c->bound[slot]);
+    c->capture_slots = compiler_grow(c->capture_slots, &c->capture_slots_cap,
+                                     c->captures, sizeof(uint32_t));
+    c->capture_slots[c->captures++] = slot;
+    if (c->captures > c->prog->max_captures)
+        c->prog->max_captures = c->captures;
+    begin = compiler_emit(c, VM_OP_CAPTURE_BEGIN, 0, 0, 0, 0);
+    if (compiler_children(c, idx))
+        return -1;
+    c->captures -= 1;
+
+    /* an unconditional break/continue already closed it */
+    if (c->loop && c->loop->skip != COMPILER_SKIP_NONE)
+        return 0;
+
+    insn = &c->prog->code[c->prog->code_len - 1];
+    if (c->dynamic == 0 && c->decls[slot] == 1 && c->label <= begin &&
+        (insn->op == VM_OP_CAPTURE_BEGIN ||
+         (insn->op == VM_OP_EMIT_SPAN && c->prog->code_len == begin + 2))) {
+        span = (insn->op == VM_OP_EMIT_SPAN) ? &c->prog->spans[insn->imm] :
+                                              NULL;
+        s.value = span ? fobj_from_string(c->prog->strtab + span->off,
+                                          span->len) :
+                         fobj_from_string("", 0);
+        c->prog->code_len = begin;
+        if (compiler_alloc_regs(c, 1, &reg) ||
+            compiler_load_static(c, &s, reg)) {
+            compiler_static_clear(&s);
+            return -1;
+        }
+        compiler_emit(c, VM_OP_STORE, reg, 0, 0, slot);
+        c->reg -= 1;
+        c->bound[slot] = s;
+        return 0;
+    }
+    compiler_emit(c, VM_OP_CAPTURE_END, 0, 0, 0, slot);
+    return 0;
+}
+
+static int compiler_node(compiler_t *c, uint32_t idx)
+{
+    int i, num_segs;
+    uint8_t reg;
+    uint32_t slot;
+    lexer_span_t *segs;
+    pt_node_t *n = &c->p->nodes[idx];
+
+    switch (n->type) {
+    case PT_NODE_TEXT:
+        num_segs = pt_text_segments(n, &segs);
+        for (i = 0; i < num_segs; i++)
+            compiler_text(c, segs[i].buf, segs[i].len);
+        return 0;
+    case PT_NODE_OBJECT:
+        if (compiler_fold_object(c, n))
+            return 0;
+        if (compiler_alloc_regs(c, 1, &reg) ||
+            compiler_operand(c, &n->object.identifier, reg))
+            return -1;
+        for (i = 0; i < n->object.num_filters; i++)
+            compiler_filter(c, &n->object.filters[i], reg);
+        compiler_emit(c, VM_OP_EMIT, reg, 0, 0, 0);
+        c->reg -= 1;
+        return 0;
+    case PT_NODE_ASSIGN:
+        slot = compiler_symbol(&c->locals, &n->assign.identifier.span, true);
+        if (!n->assign.capture)
+            return compiler_assign(c, idx, slot);
+        return compiler_capture(c, idx, slot);
+    case PT_NODE_BRANCH:
+        return compiler_branch(c, idx);
+    case PT_NODE_LOOP:
+        return compiler_loop(c, idx);
+    case PT_NODE_STMT:
+        return compiler_stmt(c, idx);
+    case PT_NODE_ROOT:
+        return compiler_children(c, idx);
+    default:
+        LOG_ERR("unexpected node type %d", n->type);
+        return -1;
+    }
+}
+
+/**
+ * Every assigned name is a local, even where used before the assignment.
+ * Count the assigns (and loops) of each; only a name set in one place can
+ * be bound to a value at compile time.
+ */
+static void compiler_declare_locals(compiler_t *c)
+{
+    uint32_t i, slot;
+    pt_node_t *n;
+
+    for (i = 0; i < c->p->count; i++) {
+        n = &c->p->nodes[i];
+        if (n->type == PT_NODE_ASSIGN)
+            compiler_symbol(&c->locals, &n->assign.identifier.span, true);
+        else if (n->type == PT_NODE_LOOP)
+            compiler_symbol(&c->locals, &n->loop.variable.span, true);
+    }
+    c->decls = safe_calloc(c->locals.count + 1, sizeof(uint32_t));
+    c->bound = safe_calloc(c->locals.count + 1, sizeof(compiler_static_t));
+    for (i = 0; i < c->p->count; i++) {
+        n = &c->p->nodes[i];
+        slot = VM_NONE;
+        if (n->type == PT_NODE_ASSIGN)
+            slot = compiler_symbol(&c->locals, &n->assign.identifier.span,
+                                   false);
+        else if (n->type == PT_NODE_LOOP)
+            slot = compiler_symbol(&c->locals, &n->loop.variable.span, false);
+        if (slot != VM_NONE)
+            c->decls[slot] += 1;
+    }
+}
+
+static bool compiler_is_jump(vm_insn_t *insn)
+{
+    switch (insn->op) {
+    case VM_OP_JUMP:
+    case VM_OP_JUMP_IF:
+    case VM_OP_JUMP_IFNOT:
+    case VM_OP_FOR_INIT:
+    case VM_OP_FOR_ITER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Append span `b` to `a`; either may be anywhere in strtab */
+static void compiler_span_append(compiler_t *c, vm_str_t *a, vm_str_t *b)
+{
+    vm_program_t *prog = c->prog;
+
+    compiler_strtab_reserve(c, a->len + b->len);
+    if (a->off + a->len + 1 != prog->strtab_len) {
+        memmove(prog->strtab + prog->strtab_len, prog->strtab + a->off,
+                a->len);
+        a->off = prog->strtab_len;
+        prog->strtab_len += a->len + 1;
+    }
+    memmove(prog->strtab + a->off + a->len, prog->strtab + b->off, b->len);
+    a->len += b->len;
+    prog->strtab[a->off + a->len] = '\0';
+    prog->strtab_len = a->off + a->len + 1;
+}
+
+/**
+ * Once everything is compiled, a STORE to a local that no path ever reads
+ * (because every use was resolved at compile time) is dead. Drop it along
+ * with the load and filters feeding it, then merge the text runs that it
+ * separated. Jump targets are remapped to the compacted code.
+ */
+static void compiler_strip_stores(compiler_t *c)
+{
+    bool *read, *target, *dead;
+    uint32_t i, j, out, *remap;
+    vm_insn_t *insn, *last = NULL;
+    vm_program_t *prog = c->prog;
+
+    read = safe_calloc(prog->num_locals + 1, sizeof(bool));
+    target = safe_calloc(prog->code_len + 1, sizeof(bool));
+    dead = safe_calloc(prog->code_len, sizeof(bool));
+    remap = safe_malloc((prog->code_len + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < prog->num_paths; i++) {
+        if (prog->paths[i].local != VM_NONE)
+            read[prog->paths[i].local] = true;
+    }
+    for (i = 0; i < prog->code_len; i++) {
+        insn = &prog->code[i];
+        if (compiler_is_jump(insn))
+            target[insn->imm] = true;
+        if (insn->op != VM_OP_STORE || read[insn->imm])
+            continue;
+        dead[i] = true;
+        for (j = i; j > 0 && prog->code[j - 1].a == insn->a; j--) {
+            if (prog->code[j - 1].op == VM_OP_FILTER) {
+                dead[j - 1] = true;
+                continue;
+            }
+            if (prog->code[j - 1].op == VM_OP_LOAD_CONST ||
+                prog->code[j - 1].op == VM_OP_LOAD_PATH)
+                dead[j - 1] = true;
+            break;
+        }
+    }
+
+    for (i = 0, out = 0; i < prog->code_len; i++) {
+        remap[i] = out;
+        insn = &prog->code[i];
+        if (dead[i]) {
+            /* jumps to it now land on the next live instruction */
+            target[i + 1] |= target[i];
+            continue;
+        }
+        if (insn->op == VM_OP_EMIT_SPAN && last &&
+            last->op == VM_OP_EMIT_SPAN && !target[i]) {
+            compiler_span_append(c, &prog->spans[last->imm],
+                                 &prog->spans[insn->imm]);
+            continue;
+        }
+        prog->code[out] = *insn;
+        last = &prog->code[out++];
+    }
+    remap[prog->code_len] = out;
+    prog->code_len = out;
+    for (i = 0; i < prog->code_len; i++) {
+        if (compiler_is_jump(&prog->code[i]))
+            prog->code[i].imm = remap[prog->code[i].imm];
+    }
+    safe_free(remap);
+    safe_free(dead);
+    safe_free(target);
+    safe_free(read);
+}
+
+/* --- Config paths --- */
+
+static bool compiler_is_seg_name(const char *p, const char *stop)
+{
+    static const char *names[] = { "first", "last", "size" };
+    const char *end = p;
+    size_t i;
+
+    while (end < stop && *end != '.' && *end != '[')
+        end++;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == (size_t)(end - p) &&
+            memcmp(names[i], p, end - p) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void compiler_want_key(fobject_t *want, const char *key, size_t len,
+                              fobject_t *item)
+{
+    char *copy = safe_malloc(len + 1);
+
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+    fdict_insert_owned(want, copy, len, item);
+    DEC_REF(item);
+}
+
+/**
+ * Add `a.b.c` to the tree of wanted keys. The last key is wanted whole,
+ * as is one followed by `.first`, `.last` or `.size`. For `list[2].key`,
+ * `key` is wanted from every item of the list.
+ */
+static void compiler_want_path(fobject_t *want, lexer_tok_t *t)
+{
+    const char *p = t->span.buf, *stop = p + t->span.len, *start, *rest;
+    size_t len;
+    fobject_t *next;
+
+    if (t->type != LEXER_TOK_WORD || t->span.len == 0 ||
+        compiler_word_is(t, "true") || compiler_word_is(t, "false") ||
+        compiler_word_is(t, "nil") || compiler_word_is(t, "null"))
+        return;
+    while (p < stop) {
+        start = p;
+        while (p < stop && *p != '.' && *p != '[')
+            p++;
+        len = p - start;
+        if (len == 0)
+            return;
+        next = fdict_lookup(want, start, len, fdict_hash(start, len));
+        if (next != NULL && next->type != FTYPE_DICT)
+            return; /* already wanted whole */
+
+        rest = NULL;
+        if (p < stop && *p == '.') {
+            rest = p + 1;
+        }
+        else if (p < stop) {
+            p = memchr(p, ']', stop - p);
+            if (p != NULL && p + 1 < stop && p[1] == '.')
+                rest = p + 2;
+        }
+        if (rest == NULL || compiler_is_seg_name(rest, stop)) {
+            compiler_want_key(want, start, len, __fobj_new(FTYPE_NIL));
+            return;
+        }
+        if (next == NULL) {
+            next = fdict_new();
+            compiler_want_key(want, start, len, next);
+        }
+        want = next;
+        p = rest;
+    }
+}
+
+/* Add the wanted keys of `src` to `dst`; see compiler_want_path() */
+static void compiler_want_merge(fobject_t *dst, fobject_t *src)
+{
+    size_t pos = 0;
+    const char *key;
+    fobject_t *item, *have;
+
+    while (fdict_next(src, &pos, &key, &item)) {
+        have = fdict_get_item(dst, key);
+        if (have == NULL || item->type != FTYPE_DICT)
+            fdict_insert_item(dst, key, item);
+        else if (have->type == FTYPE_DICT)
+            compiler_want_merge(have, item);
+    }
+}
+
+fobject_t *vm_config_paths(parser_t *p)
+{
+    uint32_t i;
+    pt_node_t *n;
+    fobject_t *want = fdict_new(), *config;
+
+    for (i = 0; i < p->count; i++) {
+        n = &p->nodes[i];
+        switch (n->type) {
+        case PT_NODE_OBJECT:
+            compiler_want_path(want, &n->object.identifier);
+            break;
+        case PT_NODE_ASSIGN:
+            if (!n->assign.capture)
+                compiler_want_path(want, &n->assign.value);
+            break;
+        case PT_NODE_COMPARE:
+            if (n->compare.operator == LIQ_OP_LOGIC_AND ||
+                n->compare.operator == LIQ_OP_LOGIC_OR)
+                break;
+            compiler_want_path(want, &n->compare.lhs);
+            if (n->compare.operator != LIQ_OP_SENTINEL)
+                compiler_want_path(want, &n->compare.rhs);
+            break;
+        case PT_NODE_LOOP:
+            if (!n->loop.is_range)
+                compiler_want_path(want, &n->loop.collection);
+            compiler_want_path(want, &n->loop.range_start);
+            compiler_want_path(want, &n->loop.range_end);
+            compiler_want_path(want, &n->loop.limit);
+            compiler_want_path(want, &n->loop.offset);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* config.a is the same key as a; see vm_globals() */
+    config = fdict_get_item(want, "config");
+    if (config != NULL && config->type != FTYPE_DICT) {
+        DEC_REF(want);
+        return NULL;
+    }
+    if (config != NULL) {
+        /* config.config replaces it in want */
+        INC_REF(config);
+        compiler_want_merge(want, config);
+        DEC_REF(config);
+    }
+    return want;
+}
+
+vm_program_t *vm_compile(parser_t *p, fobject_t *config)
+{
+    uint32_t i;
+    compiler_t c;
+
+    if (p->count == 0) {
+        LOG_ERR("nothing to compile");
+        return NULL;
+    }
+
+    memset(&c, 0, sizeof(compiler_t));
+    c.p = p;
+    c.config = config;
+    c.prog = safe_calloc(1, sizeof(vm_program_t));
+    compiler_declare_locals(&c);
+
+    if (compiler_node(&c, 0) != 0) {
+        vm_program_free(c.prog);
+        c.prog = NULL;
+    } else {
+        compiler_emit(&c, VM_OP_HALT, 0, 0, 0, 0);
+        c.prog->num_locals = c.locals.count;
+        compiler_strip_stores(&c);
+    }
+    if (c.prog && (c.prog->num_locals > VM_MAX_SLOTS ||
+                   c.prog->num_counters > VM_MAX_SLOTS ||
+                   c.prog->max_captures > VM_MAX_SLOTS)) {
+        LOG_ERR("too many variables or nested captures");
+        vm_program_free(c.prog);
+        c.prog = NULL;
+    }
+    for (i = 0; i < c.locals.count; i++)
+        compiler_static_clear(&c.bound[i]);
+    safe_free(c.bound);
+    safe_free(c.decls);
+    safe_free(c.locals.names);
+    safe_free(c.counters.names);
+    safe_free(c.capture_slots);
+    safe_free(c.interned);
+    return c.prog;
+}
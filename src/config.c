@@ -6,115 +6,494 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
 #include <yaml.h>
-#include <utils/file.h>
-#include <utils/stack.h>
 
-#include "fobjects.h"
-#include "ferrors.h"
+#include "config.h"
+#include "source.h"
+#include "snapshot.h"
 
 /**
  * LibYAML Grammer:
  *
  *    stream ::= STREAM-START document* STREAM-END
- *    document ::= DOCUMENT-START section* DOCUMENT-END
- *    section ::= MAPPING-START (key list) MAPPING-END
- *    list ::= SEQUENCE-START values* SEQUENCE-END
- *    values ::= MAPPING-START (key value)* MAPPING-END
+ *    document ::= DOCUMENT-START node DOCUMENT-END
+ *    node ::= ALIAS | SCALAR | sequence | mapping
+ *    sequence ::= SEQUENCE-START node* SEQUENCE-END
+ *    mapping ::= MAPPING-START (key node)* MAPPING-END
  *    key = SCALAR
- *    value = SCALAR
+ *
+ * The config is the first document of the stream and must be a mapping.
+ * Objects are built straight from the events, with an explicit stack of
+ * the open sequences and mappings; there is no intermediate tree.
+ *
+ * Given a tree of wanted keys (see vm_config_paths()), values of other
+ * keys are skipped without creating any objects, except for anchored
+ * nodes, which are always built whole since an alias may want them. The
+ * rest of the stream is still parsed to its end, so what is built never
+ * changes which configs are accepted.
  */
 
-enum yaml_reader_state_e {
-    YRS_START,
-    YRS_OBJ_NEW,
-    YRS_OBJ_KEY,
-    YRS_OBJ_VAL,
-    YRS_STOP
-};
+#define CONFIG_MERGE_KEY               "<<"
 
 typedef struct {
-    int state;
-    int level;
-
-    struct {
-        uint32_t in_list       :1;
-    } flags;
+    fobject_t *obj;           /* list or dict being filled; NULL if skipped */
+    fobject_t *want;          /* keys to keep; NULL for all */
+    fobject_t *value_want;    /* mapping; keys to keep in the next value */
+    char *key;                /* mapping; key of the next value */
+    size_t key_len;
+    bool mapping;
+    bool has_key;             /* mapping; a key was read, its value is next */
+    bool skip;                /* mapping; ... and that value isn't wanted */
+} config_frame_t;
 
+typedef struct {
+    config_frame_t *stack;
+    size_t depth;
+    size_t capacity;
+    fobject_t *anchors;       /* dict of anchor name -> object */
+    fobject_t *only;          /* wanted keys of the root; NULL for all */
     fobject_t *root;
-} yaml_reader_t;
+    bool done;
+} config_reader_t;
+
+static bool config_is_one_of(const char *val, size_t len, const char **words)
+{
+    for (; *words; words++) {
+        if (strlen(*words) == len && memcmp(*words, val, len) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool config_is_number(const char *val, size_t len, double *num)
+{
+    char *end;
+
+    if (!(isdigit((unsigned char)val[0]) ||
+          ((val[0] == '-' || val[0] == '+' || val[0] == '.') && len > 1 &&
+           (isdigit((unsigned char)val[1]) || val[1] == '.'))))
+        return false;
+    *num = strtod(val, &end);
+    return end == val + len;
+}
+
+/**
+ * Plain scalars are resolved as in the YAML core schema; anything quoted
+ * or tagged is a string. libyaml hands out a fresh copy of every scalar,
+ * so rather than copy it again, the string object takes it over.
+ */
+static fobject_t *config_scalar(yaml_event_t *event)
+{
+    static const char *nulls[] = { "~", "null", "Null", "NULL", NULL };
+    static const char *trues[] = { "true", "True", "TRUE", NULL };
+    static const char *falses[] = { "false", "False", "FALSE", NULL };
+    char *val = (char *)event->data.scalar.value;
+    size_t len = event->data.scalar.length;
+    double num;
+
+    if (event->data.scalar.plain_implicit) {
+        if (len == 0 || config_is_one_of(val, len, nulls))
+            return __fobj_new(FTYPE_NIL);
+        if (config_is_one_of(val, len, trues))
+            return fobj_from_bool(true);
+        if (config_is_one_of(val, len, falses))
+            return fobj_from_bool(false);
+        if (config_is_number(val, len, &num))
+            return fobj_from_double(num);
+    }
+    event->data.scalar.value = NULL;
+    return fobj_from_owned_string(val, len);
+}
+
+static config_frame_t *config_top(config_reader_t *r)
+{
+    return r->depth ? &r->stack[r->depth - 1] : NULL;
+}
+
+static bool config_expects_key(config_reader_t *r)
+{
+    config_frame_t *top = config_top(r);
+
+    return top && top->mapping && !top->has_key;
+}
+
+/* The next node is not wanted */
+static bool config_is_skipping(config_reader_t *r)
+{
+    config_frame_t *top = config_top(r);
+
+    return top && (top->obj == NULL || top->skip);
+}
+
+/* Keys to keep in the next node */
+static fobject_t *config_want(config_reader_t *r)
+{
+    config_frame_t *top = config_top(r);
+
+    if (top == NULL)
+        return r->only;
+    return top->mapping ? top->value_want : top->want;
+}
+
+static bool config_is_merge_key(const char *key, size_t len)
+{
+    return len == strlen(CONFIG_MERGE_KEY) &&
+           memcmp(key, CONFIG_MERGE_KEY, len) == 0;
+}
+
+static bool config_is_open(config_reader_t *r, fobject_t *obj)
+{
+    size_t i;
+
+    for (i = 0; i < r->depth; i++) {
+        if (r->stack[i].obj == obj)
+            return true;
+    }
+    return false;
+}
+
+static void config_push(config_reader_t *r, fobject_t *obj, bool mapping,
+                        fobject_t *want)
+{
+    config_frame_t *f;
+
+    if (r->depth == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 16;
+        r->stack = safe_realloc(r->stack,
+                                r->capacity * sizeof(config_frame_t));
+    }
+    f = &r->stack[r->depth++];
+    memset(f, 0, sizeof(config_frame_t));
+    f->obj = obj;
+    f->mapping = mapping;
+    f->want = want;
+}
+
+static void config_key(config_reader_t *r, yaml_event_t *event)
+{
+    config_frame_t *top = config_top(r);
+    const char *key = (const char *)event->data.scalar.value;
+    size_t len = event->data.scalar.length;
+    fobject_t *want = NULL;
+
+    top->has_key = true;
+    if (top->obj == NULL)
+        return;
+    if (top->want != NULL && !config_is_merge_key(key, len)) {
+        want = fdict_lookup(top->want, key, len, fdict_hash(key, len));
+        if (want == NULL) {
+            top->skip = true;
+            return;
+        }
+    }
+    top->value_want = (want && want->type == FTYPE_DICT) ? want : NULL;
+    top->key = (char *)event->data.scalar.value;
+    top->key_len = len;
+    event->data.scalar.value = NULL;
+}
+
+/* The value of the current key is done with */
+static void config_value_done(config_frame_t *top)
+{
+    if (!top->mapping)
+        return;
+    safe_free(top->key);
+    top->key = NULL;
+    top->value_want = NULL;
+    top->has_key = false;
+    top->skip = false;
+}
 
-#define SET_CURRENT(r, c)  do {        \
-        r->previous = r->current;      \
-        r->current = c;                \
-    } while (0);
+static void config_anchor(config_reader_t *r, yaml_char_t *anchor,
+                          fobject_t *obj)
+{
+    if (anchor != NULL)
+        fdict_insert_item(r->anchors, (const char *)anchor, obj);
+}
 
-#define SET_CURRENT_TO_PARENT(r) do {        \
-        if (r->current->parent != NULL)      \
-            r->current = r->current->parent; \
-    } while (0);
+/* `<<: *defaults`; keys from a merged mapping never override own keys */
+static void config_merge(fobject_t *dict, fobject_t *from)
+{
+    size_t pos = 0, i;
+    const char *key;
+    fobject_t *item;
+
+    if (from->type == FTYPE_LIST) {
+        for (i = 0; i < from->list.length; i++)
+            config_merge(dict, from->list.items[i]);
+        return;
+    }
+    while (fdict_next(from, &pos, &key, &item)) {
+        if (fdict_get_item(dict, key) == NULL)
+            fdict_insert_item(dict, key, item);
+    }
+}
 
-static ferror_t config_process_event(yaml_reader_t *r, yaml_event_t *event)
+/* Add a complete node to the open container, or make it the root */
+static ferror_t config_add(config_reader_t *r, fobject_t *obj)
 {
-#if 1
-    printf("YRS: %s Event: %s\n",
-           yrs_state_name(r->state),
-           yaml_event_name(event->type));
-#endif
+    config_frame_t *top = config_top(r);
 
+    if (top == NULL) {
+        if (obj->type != FTYPE_DICT)
+            fexcept(FERROR_OBJECT_TYPE);
+        r->root = INC_REF(obj);
+        return FERROR_OK;
+    }
+    if (top->obj == NULL || top->skip) {
+        /* skipped, or an anchored node where nothing was wanted */
+        config_value_done(top);
+        return FERROR_OK;
+    }
+    if (!top->mapping) {
+        flist_append(top->obj, obj);
+        return FERROR_OK;
+    }
+    if (config_is_merge_key(top->key, top->key_len) &&
+        (obj->type == FTYPE_DICT || obj->type == FTYPE_LIST)) {
+        config_merge(top->obj, obj);
+    }
+    else {
+        fdict_insert_owned(top->obj, top->key, top->key_len, obj);
+        top->key = NULL;
+    }
+    config_value_done(top);
     return FERROR_OK;
 }
 
-ferror_t config_parse_yaml_buf(const char *input, size_t length)
+static ferror_t config_process_event(config_reader_t *r, yaml_event_t *event)
+{
+    ferror_t e;
+    fobject_t *obj;
+    yaml_char_t *anchor;
+    bool mapping;
+
+    switch (event->type) {
+    case YAML_SCALAR_EVENT:
+        if (config_expects_key(r)) {
+            config_key(r, event);
+            return FERROR_OK;
+        }
+        if (config_is_skipping(r) && event->data.scalar.anchor == NULL) {
+            config_value_done(config_top(r));
+            return FERROR_OK;
+        }
+        obj = config_scalar(event);
+        config_anchor(r, event->data.scalar.anchor, obj);
+        break;
+    case YAML_ALIAS_EVENT:
+        if (config_expects_key(r))
+            fexcept(FERROR_CONFIG_EVENT);
+        /* anchors are built even where skipped, so this holds either way */
+        obj = fdict_get_item(r->anchors,
+                             (const char *)event->data.alias.anchor);
+        if (obj == NULL)
+            fexcept(FERROR_CONFIG_ALIAS);
+        if (config_is_open(r, obj))
+            fexcept(FERROR_CONFIG_NESTING); /* would contain itself */
+        if (config_is_skipping(r)) {
+            config_value_done(config_top(r));
+            return FERROR_OK;
+        }
+        INC_REF(obj);
+        break;
+    case YAML_SEQUENCE_START_EVENT:
+    case YAML_MAPPING_START_EVENT:
+        if (config_expects_key(r))
+            fexcept(FERROR_CONFIG_EVENT);
+        mapping = event->type == YAML_MAPPING_START_EVENT;
+        anchor = mapping ? event->data.mapping_start.anchor :
+                           event->data.sequence_start.anchor;
+        if (config_is_skipping(r) && anchor == NULL) {
+            config_push(r, NULL, mapping, NULL);
+            return FERROR_OK;
+        }
+        obj = mapping ? fdict_new() : flist_new(0);
+        config_anchor(r, anchor, obj);
+        config_push(r, obj, mapping, anchor ? NULL : config_want(r));
+        return FERROR_OK;
+    case YAML_SEQUENCE_END_EVENT:
+    case YAML_MAPPING_END_EVENT:
+        if (r->depth == 0)
+            fexcept(FERROR_CONFIG_NESTING);
+        obj = r->stack[--r->depth].obj;
+        break;
+    case YAML_DOCUMENT_END_EVENT:
+    case YAML_STREAM_END_EVENT:
+        /* only the first document is read */
+        r->done = true;
+        return FERROR_OK;
+    default:
+        return FERROR_OK;
+    }
+
+    e = config_add(r, obj);
+    DEC_REF(obj);
+    return e;
+}
+
+ferror_t config_parse_yaml_buf(const char *input, size_t length,
+                               fobject_t **root, fobject_t *only)
 {
     ferror_t e = FERROR_OK;
     yaml_event_t event;
     yaml_parser_t parser;
     config_reader_t r;
 
-    reader.state = YRS_START;
-    reader.level = 0;
-    reader.root = fdict_new();
+    memset(&r, 0, sizeof(config_reader_t));
+    r.anchors = fdict_new();
+    r.only = only;
 
     yaml_parser_initialize(&parser);
-    yaml_parser_set_input_string(&parser, (unsigned char *)input, length);
-
-    while (r.state != YRS_STOP) {
-
-        if (!yaml_parser_parse(&parser, &event))
-            fexcept_goto(FERROR_CONFIG_PARSER, error);
-
-        e = config_process_yaml_event(&r, &event);
-        fexcept_proagate_goto(e, error);
+    yaml_parser_set_input_string(&parser, (const unsigned char *)
+                                 (length ? input : ""), length);
 
+    while (!r.done) {
+        if (!yaml_parser_parse(&parser, &event)) {
+            e = FERROR_CONFIG_PARSER;
+            fexcept_print(e);
+            fprintf(stderr, "EXCEPTION: %s at line %zu\n",
+                    parser.problem ? parser.problem : "bad input",
+                    parser.problem_mark.line + 1);
+            goto error;
+        }
+        e = config_process_event(&r, &event);
         yaml_event_delete(&event);
+        fexcept_proagate_goto(e, error);
     }
 
-    fluid_object_dump(r.root);
+    /* an empty document is an empty config */
+    *root = r.root ? r.root : fdict_new();
+    r.root = NULL;
 
 error:
+    while (r.depth > 0) {
+        r.depth--;
+        DEC_REF(r.stack[r.depth].obj);
+        safe_free(r.stack[r.depth].key);
+    }
+    safe_free(r.stack);
+    DEC_REF(r.anchors);
+    DEC_REF(r.root);
     yaml_parser_delete(&parser);
     return e;
 }
 
-ferror_t config_parse_yaml(const char *file)
+/* Tells one config file apart from another; a word at a time, FNV-1a */
+static uint64_t config_hash(const char *buf, size_t len)
 {
-    ferror_t e = FERROR_OK;
-    char *buf = NULL;
-    size_t size = 0;
-    FILE *fd;
+    uint64_t h = 0xcbf29ce484222325ULL ^ len, word;
+
+    for (; len >= sizeof(word); buf += sizeof(word), len -= sizeof(word)) {
+        memcpy(&word, buf, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; len > 0; buf++, len--)
+        h = (h ^ (unsigned char)*buf) * 0x100000001b3ULL;
+    return h ^ (h >> 32);
+}
+
+static bool config_has_ext(const char *file, const char *ext)
+{
+    size_t len = strlen(file), ext_len = strlen(ext);
+
+    return len > ext_len && strcasecmp(file + len - ext_len, ext) == 0;
+}
+
+/**
+ * By extension, or else by content: an object whose first key is quoted
+ * (or that is empty) is read as JSON. Being valid YAML as well, it reads
+ * the same either way; JSON is just much quicker to read.
+ */
+static enum config_format config_detect(const char *file, const char *buf,
+                                        size_t len)
+{
+    const char *p = buf, *end = buf + len;
+
+    if (config_has_ext(file, ".json"))
+        return CONFIG_FORMAT_JSON;
+    if (config_has_ext(file, ".yml") || config_has_ext(file, ".yaml"))
+        return CONFIG_FORMAT_YAML;
 
-    if ((fd = fopen(file, "r")) == NULL)
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+    if (p == end || *p++ != '{')
+        return CONFIG_FORMAT_YAML;
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+    if (p < end && (*p == '"' || *p == '}'))
+        return CONFIG_FORMAT_JSON;
+    return CONFIG_FORMAT_YAML;
+}
+
+ferror_t config_parse(const char *file, enum config_format format,
+                      fobject_t **root, fobject_t *only, bool snapshot,
+                      uint64_t *hash)
+{
+    ferror_t e;
+    source_t src;
+    char *path = NULL;
+    uint64_t key = 0;
+
+    if (source_load(&src, file) != 0)
         fexcept(FERROR_FILE_NOT_FOUND);
 
-    if (file_read_all(fd, &buf, &size))
-        fexcept_goto(FERROR_FILE_NOT_FOUND, error);
+    if (hash != NULL || snapshot)
+        key = config_hash(src.buf, src.size);
+    if (hash != NULL)
+        *hash = key;
 
-    e = config_parse_yaml_buf(buf, size);
-    fexcept_proagate_goto(e, error);
+    if (snapshot && strcmp(file, "-") != 0) {
+        path = safe_malloc(strlen(file) + sizeof(CONFIG_SNAPSHOT_EXT));
+        strcpy(path, file);
+        strcat(path, CONFIG_SNAPSHOT_EXT);
+        *root = snapshot_load(path, key);
+        if (*root != NULL) {
+            source_unload(&src);
+            safe_free(path);
+            return FERROR_OK;
+        }
+    }
 
-error:
-    safe_free(buf);
-    fclose(fd);
-    return e;
+    /* a snapshot serves any template, so it holds everything */
+    if (path != NULL)
+        only = NULL;
+    if (format == CONFIG_FORMAT_AUTO)
+        format = config_detect(file, src.buf, src.size);
+    if (format == CONFIG_FORMAT_JSON)
+        e = config_parse_json_buf(src.buf, src.size, root, only);
+    else
+        e = config_parse_yaml_buf(src.buf, src.size, root, only);
+    source_unload(&src);
+    /* without a snapshot, the next run just parses again */
+    if (e == FERROR_OK && path != NULL)
+        snapshot_save(*root, key, path);
+    safe_free(path);
+    fexcept_proagate(e);
+    return FERROR_OK;
+}
+
+fobject_t *config_layer(fobject_t *top, fobject_t *base)
+{
+    size_t pos = 0;
+    const char *key;
+    fobject_t *layer, *item, *under;
+
+    layer = fdict_new();
+    fdict_set_parent(layer, base);
+    while (fdict_next(top, &pos, &key, &item)) {
+        under = fdict_get_item(base, key);
+        if (item->type == FTYPE_DICT && under && under->type == FTYPE_DICT) {
+            item = config_layer(item, under);
+            fdict_insert_item(layer, key, item);
+            DEC_REF(item);
+        }
+        else {
+            fdict_insert_item(layer, key, item);
+        }
+    }
+    return layer;
 }
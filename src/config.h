@@ -8,10 +8,67 @@
 #define _CONFIG_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "ferrors.h"
+#include "fobjects.h"
 
-ferror_t config_parse_yaml(const char *file);
-ferror_t config_parse_yaml_buf(const char *input, size_t length);
+/* Binary snapshots of a parsed config are kept next to it, as <file><ext> */
+#define CONFIG_SNAPSHOT_EXT            ".fluidcfg"
+
+enum config_format {
+    CONFIG_FORMAT_AUTO,       /* by file extension, or else by content */
+    CONFIG_FORMAT_YAML,
+    CONFIG_FORMAT_JSON,
+};
+
+/**
+ * On success, *root is a new dict holding the config. If `only` is not
+ * NULL, it is a tree of the keys to keep, as made by vm_config_paths();
+ * the rest is parsed, but nothing is built for it.
+ *
+ * With `snapshot`, the tree is loaded from the file's snapshot when that
+ * was saved from the same input, and saved to it otherwise; such a tree
+ * is complete, whatever `only` says, and read-only.
+ *
+ * If `hash` is not NULL, it is set to a hash of the file's contents.
+ */
+ferror_t config_parse(const char *file, enum config_format format,
+                      fobject_t **root, fobject_t *only, bool snapshot,
+                      uint64_t *hash);
+
+/* config.c; YAML 1.1 with anchors, aliases and merge keys */
+ferror_t config_parse_yaml_buf(const char *input, size_t length,
+                               fobject_t **root, fobject_t *only);
+
+/* json.c; RFC 8259, except that an empty input is an empty config */
+ferror_t config_parse_json_buf(const char *input, size_t length,
+                               fobject_t **root, fobject_t *only);
+
+/**
+ * A new dict with the keys of `top` over those of `base`. Where both have
+ * a dict at the same key, the two are layered in turn; any other value in
+ * top (lists included) replaces the one in base. Nothing of base is
+ * copied: the layers look keys they don't have up in it.
+ *
+ * The layers refer to values of top but not to top itself; when it was
+ * loaded from a snapshot, keep it until the layers are released.
+ */
+fobject_t *config_layer(fobject_t *top, fobject_t *base);
+
+static inline ferror_t config_parse_yaml(const char *file, fobject_t **root,
+                                         fobject_t *only, bool snapshot)
+{
+    return config_parse(file, CONFIG_FORMAT_YAML, root, only, snapshot,
+                        NULL);
+}
+
+static inline ferror_t config_parse_json(const char *file, fobject_t **root,
+                                         fobject_t *only, bool snapshot)
+{
+    return config_parse(file, CONFIG_FORMAT_JSON, root, only, snapshot,
+                        NULL);
+}
 
 #endif  /* _CONFIG_H_ */
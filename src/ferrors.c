@@ -35,9 +35,10 @@ const char *ferror_message(ferror_t e)
     case FERROR_OBJECT_TYPE:           return "invalid object type";
 
     /* Config errors */
-    case FERROR_CONFIG_PARSER:         return "yaml parser error";
+    case FERROR_CONFIG_PARSER:         return "config parser error";
     case FERROR_CONFIG_EVENT:          return "invalid yaml event";
     case FERROR_CONFIG_NESTING:        return "invalid object nesting request";
+    case FERROR_CONFIG_ALIAS:          return "undefined yaml alias";
 
     /* lables that dont have a case */
     case FERROR_OK:
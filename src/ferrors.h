@@ -36,6 +36,7 @@ typedef enum ferror_e {
         FERROR_CONFIG_PARSER,
         FERROR_CONFIG_EVENT,
         FERROR_CONFIG_NESTING,
+        FERROR_CONFIG_ALIAS,
     FERROR_CE_END,
 
 } ferror_t;
@@ -5,6 +5,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <utils/strutils.h>
 #include <utils/utils.h>
 
@@ -62,15 +63,16 @@ liq_filter_handler_t liq_filters[LIQ_FILTER_SENTINEL] = {
     [LIQ_FILTER_RSTRIP]      = { "rstrip",     fluid_filter_rstrip,     LIQ_FF_NONE },
 };
 
-enum liq_filter get_filter_id(const char *identifer)
+enum liq_filter get_filter_id(const char *identifer, size_t len)
 {
     enum liq_filter i;
 
     for (i = LIQ_FILTER_NONE+1; i < LIQ_FILTER_SENTINEL; i++) {
-        if(strcmp(identifer, liq_filters[i].identifier) == 0)
-            break;
+        if (strncmp(identifer, liq_filters[i].identifier, len) == 0 &&
+            liq_filters[i].identifier[len] == '\0')
+            return i;
     }
-    return i;
+    return LIQ_FILTER_NONE;
 }
 
 int liq_filter_arg_count(enum liq_filter id)
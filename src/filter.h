@@ -7,6 +7,8 @@
 #ifndef _FILTER_H_
 #define _FILTER_H_
 
+#include <stddef.h>
+
 #define LIQ_FILTER_ARG_MAXLEN   32
 #define LIQ_FILTER_ARG_COUNT    2
 
@@ -23,7 +25,7 @@ typedef struct {
     char args[LIQ_FILTER_ARG_COUNT][LIQ_FILTER_ARG_MAXLEN + 1];
 } liq_filter_t;
 
-enum liq_filter get_filter_id(const char *identifer);
+enum liq_filter get_filter_id(const char *identifer, size_t len);
 int filter_execute(liq_filter_t *f, char *in);
 int liq_filter_arg_count(enum liq_filter id);
 
@@ -4,8 +4,10 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <utils/file.h>
 #include <utils/logger.h>
 
@@ -15,13 +17,14 @@
 #include "liquid.h"
 #include "ferrors.h"
 #include "config.h"
+#include "include.h"
+#include "vm.h"
 
 LOGGER_MODULE_DEFINE(fluid, LOG_ERR);
 
 fluid_t *fluid_load(const char *dirname, const char *filename)
 {
     char *path = NULL;
-    FILE *fd = NULL;
     fluid_t *ctx = NULL;
 
     path = path_join(dirname, filename);
@@ -30,16 +33,10 @@ fluid_t *fluid_load(const char *dirname, const char *filename)
         return NULL;
     }
 
-    fd = fopen(path, "r");
-    if (fd == NULL) {
-        LOG_ERR("failed to open '%s'", path);
-        safe_free(path);
-        return NULL;
-    }
-
     ctx = safe_calloc(1, sizeof(fluid_t));
-    if (file_read_all(fd, &ctx->buf, &ctx->buf_size) != 0) {
-        LOG_ERR("failed to read file %s", filename);
+    arena_init(&ctx->arena, 0);
+    if (source_load(&ctx->src, path) != 0) {
+        LOG_ERR("failed to read file '%s'", path);
         goto error;
     }
 
@@ -48,173 +45,306 @@ fluid_t *fluid_load(const char *dirname, const char *filename)
         goto error;
     }
     safe_free(path);
-    fclose(fd);
     return ctx;
 
 error:
-    if (ctx) {
-        safe_free(ctx->filename);
-        safe_free(ctx->dirname);
-        safe_free(ctx);
-    }
+    source_unload(&ctx->src);
+    safe_free(ctx->filename);
+    safe_free(ctx->dirname);
+    safe_free(ctx);
     safe_free(path);
-    fclose(fd);
     return NULL;
 }
 
 void fluid_destroy_context(fluid_t *ctx)
 {
+    if (ctx->inc_cache_owner)
+        include_cache_free(ctx->inc_cache);
+    lexer_blocks_free(&ctx->blocks);
+    lexer_includes_free(&ctx->includes);
+    arena_destroy(&ctx->arena);
+    source_unload(&ctx->src);
     safe_free(ctx->filename);
     safe_free(ctx->dirname);
     safe_free(ctx);
 }
 
-void fluid_render_data(fluid_t *ctx)
+static int fluid_include(fluid_t *ctx, lexer_blocks_t *out, lexer_tok_t *file)
 {
-    lexer_block_t *blk;
+    char *path;
+    fluid_t *sub_ctx;
 
-    LIST_FOREACH(&ctx->lex_blocks, p) {
-        blk = CONTAINER_OF(p, lexer_block_t, node);
-        if (blk->type == LEXER_BLOCK_DATA) {
-            fprintf(ctx->outfile, "%s", blk->content.buf);
-        }
+    include_cache_setup(ctx, INCLUDE_MAX_DEPTH_DEFAULT);
+
+    path = arena_strndup(&ctx->arena, file->span.buf, file->span.len);
+    sub_ctx = include_resolve(ctx, path);
+    if (sub_ctx == NULL) {
+        return -1;
     }
+    /* blocks spliced into out hold views into sub_ctx; the cache owns it */
+    lexer_blocks_splice(ctx, out, &sub_ctx->blocks, 0, sub_ctx->blocks.count);
+    return 0;
 }
 
-void fluid_explode_sub_ctx(fluid_t *ctx, lexer_block_t *blk, fluid_t *sub_ctx)
+/**
+ * Splice in included files. Comments and raw blocks were already dealt
+ * with by lexer_lex(), so only the ranges between include tags are copied
+ * to a new vector, coalescing data blocks where the ranges meet.
+ */
+int fluid_preprocessor(fluid_t *ctx)
 {
-    list_insert_nodes(&ctx->lex_blocks, &blk->node,
-              sub_ctx->lex_blocks.head, sub_ctx->lex_blocks.tail);
-
-    lexer_remove_block(ctx, blk);
+    size_t i, idx, from = 0;
+    lexer_blocks_t out, *in = &ctx->blocks;
+    lexer_includes_t *inc = &ctx->includes;
+
+    if (inc->count == 0)
+        return 0;
+
+    lexer_blocks_init(&out);
+    for (i = 0; i < inc->count; i++) {
+        idx = inc->idx[i];
+        lexer_blocks_splice(ctx, &out, in, from, idx);
+        from = idx + 1;
+        if (fluid_include(ctx, &out, &in->toks[idx].tag.tokens[0])) {
+            lexer_blocks_free(&out);
+            return -1;
+        }
+    }
+    lexer_blocks_splice(ctx, &out, in, from, in->count);
 
-    /* empty sub_ctx blocks to prevent lexer_teardown() from free-ing them */
-    sub_ctx->lex_blocks.head = NULL;
-    sub_ctx->lex_blocks.tail = NULL;
+    lexer_blocks_free(in);
+    *in = out;
+    inc->count = 0;
+    return 0;
 }
 
-int fluid_remove_blocks(fluid_t *ctx, lexer_block_t *start, lexer_block_t *end)
-{
-    node_t *next;
+/* --- Streaming render --- */
 
-    if (list_remove_nodes(&ctx->lex_blocks, &start->node, &end->node)) {
-        LOG_ERR("block remove failed");
-        return -1;
-    }
+#ifndef FLUID_STREAM_CHUNK_SIZE
+#define FLUID_STREAM_CHUNK_SIZE        (64 * 1024)
+#endif
 
-    while (start != end) {
-        next = start->node.next;
-        lexer_remove_block(ctx, start);
-        start = CONTAINER_OF(next, lexer_block_t, node);
-    }
-    lexer_remove_block(ctx, end);
-    return 0;
-}
+typedef struct fluid_stream_s fluid_stream_t;
 
-void fluid_handle_raw_blocks(fluid_t *ctx, lexer_block_t *start, lexer_block_t *end)
-{
-    lexer_block_t *p;
+struct fluid_stream_s {
+    fluid_t *ctx;             /* arena and token scratch for tags */
+    fluid_stream_t *parent;   /* file that included this one */
+    const char *dirname;      /* to resolve includes against */
+    dev_t dev;                /* identity of this file; for cycle checks */
+    ino_t ino;
+    int depth;
+    int max_depth;
+    bool in_comment;
+    bool in_raw;
+};
 
-    p = CONTAINER_OF(start->node.next, lexer_block_t, node);
-    lexer_remove_block(ctx, start);
-    while (p != end) {
-        lexer_block_cast_to_data(p);
-        p = CONTAINER_OF(p->node.next, lexer_block_t, node);
-    }
-    lexer_remove_block(ctx, end);
+static int fluid_stream_file(fluid_t *ctx, fluid_stream_t *parent,
+                             const char *dirname, const char *filename);
+
+/* Blocks that need the compiler (logic, variables) are refused */
+static int fluid_stream_refuse(lexer_span_t *span)
+{
+    LOG_ERR("'%.*s' needs a full render; --stream only takes text, "
+            "comments, raw blocks and includes",
+            (int)(span->len < 40 ? span->len : 40), span->buf);
+    return -1;
 }
 
-int fluid_preprocessor(fluid_t *ctx)
+static int fluid_stream_emit(void *arg, enum lexer_block type,
+                             lexer_span_t *span)
 {
-    node_t *p;
-    lexer_block_t *blk;
-    fluid_t *sub_ctx;
-    lexer_block_t *comment_start = NULL;
-    lexer_block_t *raw_start = NULL;
-
-    p = ctx->lex_blocks.head;
-    while (p) {
-        blk = CONTAINER_OF(p, lexer_block_t, node);
-        p = p->next;
-
-        /* strip comments */
-        if (comment_start) {
-            if (blk->type == LEXER_BLOCK_TAG &&
-                blk->tok.tag.keyword == LIQ_KW_ENDCOMMENT)
-            {
-                if (fluid_remove_blocks(ctx, comment_start, blk))
-                    return -1;
-                comment_start = NULL;
-            }
-            continue;
+    int ret = 0;
+    char *path;
+    lexer_token_t tok;
+    fluid_stream_t *st = arg;
+    enum liq_kw kw = LIQ_KW_NONE;
+
+    if (type == LEXER_BLOCK_TAG) {
+        memset(&tok, 0, sizeof(lexer_token_t));
+        if (lexer_tokenize_tag(st->ctx, span, &tok) == 0) {
+            kw = tok.tag.keyword;
         }
-        else if (blk->type == LEXER_BLOCK_TAG &&
-                 blk->tok.tag.keyword == LIQ_KW_COMMENT)
-        {
-            comment_start = blk;
-            continue;
+        else if (!st->in_comment && !st->in_raw) {
+            LOG_ERR("tokenize tag failed");
+            return -1;
         }
+    }
 
-        /* force mark raw blocks as data blocks */
-        if (raw_start) {
-            if (blk->type == LEXER_BLOCK_TAG &&
-                blk->tok.tag.keyword == LIQ_KW_ENDRAW)
-            {
-                fluid_handle_raw_blocks(ctx, raw_start, blk);
-                raw_start = NULL;
-            }
-            continue;
+    if (st->in_comment) {
+        if (kw == LIQ_KW_ENDCOMMENT)
+            st->in_comment = false;
+        goto out;
+    }
+    if (st->in_raw) {
+        if (kw == LIQ_KW_ENDRAW)
+            st->in_raw = false;
+        else
+            ret = sink_write(st->ctx->out, span->buf, span->len);
+        goto out;
+    }
+
+    switch (type) {
+    case LEXER_BLOCK_DATA:
+        ret = sink_write(st->ctx->out, span->buf, span->len);
+        break;
+    case LEXER_BLOCK_TAG:
+        if (kw == LIQ_KW_COMMENT) {
+            st->in_comment = true;
         }
-        else if (blk->type == LEXER_BLOCK_TAG &&
-                 blk->tok.tag.keyword == LIQ_KW_RAW)
-        {
-            raw_start = blk;
-            continue;
+        else if (kw == LIQ_KW_RAW) {
+            st->in_raw = true;
+        }
+        else if (kw == LIQ_KW_INCLUDE && tok.tag.num_tokens > 0) {
+            path = arena_strndup(&st->ctx->arena, tok.tag.tokens[0].span.buf,
+                                 tok.tag.tokens[0].span.len);
+            ret = fluid_stream_file(st->ctx, st, st->dirname, path);
+        }
+        else {
+            ret = fluid_stream_refuse(span);
         }
+        break;
+    case LEXER_BLOCK_OBJECT:
+        ret = fluid_stream_refuse(span);
+        break;
+    default:
+        break;
+    }
 
-        /* include files */
-        if (blk->type == LEXER_BLOCK_TAG &&
-            blk->tok.tag.keyword == LIQ_KW_INCLUDE &&
-            blk->tok.tag.tokens && blk->tok.tag.tokens[0])
-        {
-            sub_ctx = fluid_load(ctx->dirname, blk->tok.tag.tokens[0]);
-            if (sub_ctx == NULL) {
-                return -1;
-            }
-            lexer_setup(sub_ctx);
-            if (lexer_lex(sub_ctx) != 0) {
-                return -1;
-            }
-            if (fluid_preprocessor(sub_ctx)) {
-                return -1;
+out:
+    /* nothing derived from a block outlives its emit call */
+    arena_reset(&st->ctx->arena);
+    return ret;
+}
+
+static int fluid_stream_file(fluid_t *ctx, fluid_stream_t *parent,
+                             const char *dirname, const char *filename)
+{
+    int ret = -1;
+    size_t len;
+    FILE *fd = NULL;
+    char *path, *buf = NULL;
+    char *file_dir = NULL, *file_name = NULL;
+    struct stat sb;
+    lexer_stream_t ls;
+    fluid_stream_t *p, st = { .ctx = ctx, .parent = parent };
+
+    if (parent) {
+        st.depth = parent->depth + 1;
+        st.max_depth = parent->max_depth;
+        if (st.depth > st.max_depth) {
+            LOG_ERR("include depth exceeds %d at '%s'", st.max_depth, filename);
+            return -1;
+        }
+    }
+
+    path = path_join(dirname, filename);
+    if (path == NULL) {
+        LOG_ERR("join '%s' and '%s' failed", dirname, filename);
+        return -1;
+    }
+    if (path_extract(path, &file_dir, &file_name)) {
+        LOG_ERR("failed to extract dirname/basename from '%s'", path);
+        goto out;
+    }
+    fd = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (fd == NULL) {
+        LOG_ERR("failed to open '%s'", path);
+        goto out;
+    }
+    st.dirname = file_dir;
+
+    if (fstat(fileno(fd), &sb) == 0) {
+        st.dev = sb.st_dev;
+        st.ino = sb.st_ino;
+        for (p = parent; p; p = p->parent) {
+            if (p->dev == st.dev && p->ino == st.ino) {
+                LOG_ERR("include cycle detected at '%s'", path);
+                goto out;
             }
-            fluid_explode_sub_ctx(ctx, blk, sub_ctx);
-            lexer_teardown(sub_ctx);
-            fluid_destroy_context(sub_ctx);
         }
     }
 
-    /**
-     * After preprocessing there may be consecutive data blocks
-     * so call lexer_grabage_collect() to squash them.
-     */
-    lexer_grabage_collect(ctx);
+    buf = safe_malloc(FLUID_STREAM_CHUNK_SIZE);
+    lexer_stream_init(&ls, fluid_stream_emit, &st);
+    while ((len = fread(buf, 1, FLUID_STREAM_CHUNK_SIZE, fd)) > 0) {
+        if (lexer_stream_feed(&ls, buf, len))
+            goto out_stream;
+    }
+    if (ferror(fd)) {
+        LOG_ERR("failed to read file %s", path);
+        goto out_stream;
+    }
+    if (lexer_stream_finish(&ls))
+        goto out_stream;
+    if (st.in_comment || st.in_raw) {
+        LOG_ERR("unterminated %s block in '%s'",
+                st.in_comment ? "comment" : "raw", path);
+        goto out_stream;
+    }
+    ret = 0;
+
+out_stream:
+    lexer_stream_free(&ls);
+out:
+    if (fd && fd != stdin)
+        fclose(fd);
+    safe_free(buf);
+    safe_free(file_dir);
+    safe_free(file_name);
+    safe_free(path);
+    return ret;
+}
 
-    return 0;
+/**
+ * Render `filename` without ever holding all of it in memory. Only data,
+ * comments, raw blocks and includes are handled; any other tag, or an
+ * object, fails the render (after the output before it went out), as
+ * the compiler needs the whole template. So does an unterminated comment
+ * or raw block, once the end of the file shows it is one.
+ */
+int fluid_stream(sink_t *out, const char *filename, int max_depth)
+{
+    int ret;
+    fluid_t ctx;
+    fluid_stream_t root = { .max_depth = max_depth, .depth = -1 };
+
+    memset(&ctx, 0, sizeof(fluid_t));
+    ctx.out = out;
+    arena_init(&ctx.arena, 0);
+    ret = fluid_stream_file(&ctx, &root, NULL, filename);
+    lexer_teardown(&ctx);
+    arena_destroy(&ctx.arena);
+    return ret;
 }
 
 struct fluid_opts_s {
     char *infile;
     char *outfile;
-    char *config_file;
+    char **config_files;
+    int num_config_files;
     int verbosity;
+    int jobs;
+    int max_include_depth;
+    bool stream;
+    bool compile;
+    bool config_snapshot;
 } fluid_opts;
 
 static const char *fluid_help[] = {
-    "Usage: fluid [OPTIONS] <template_file> [-o <output_file>]",
+    "Usage: fluid [OPTIONS] <template_file|-> [-o <output_file>]",
     "",
     "OPTIONS:",
     "  outfile              Write output to file (defaults to stdout)",
+    "  config               YAML or JSON file of variables for the template;",
+    "                       each one more is a layer over the ones before it",
+    "  config-snapshot      Cache the parsed config in <config>" CONFIG_SNAPSHOT_EXT " and",
+    "                       load it from there while the config is unchanged",
+    "  stream               Lex and render the template in fixed size chunks;",
+    "                       it may only have text, comments, raw and includes",
+    "  compile              Write the compiled template instead of rendering it;",
+    "                       inputs named *" FLUID_IMAGE_EXT " are rendered without parsing",
+    "  jobs                 Threads used to load included files (default: #cpus)",
+    "  max-include-depth    Fail when includes nest deeper than this (default: 64)",
     "  help                 Print this help text",
     "  version              Print fluid version",
     "  verbosity            Increase the verbosity (allows multiple)",
@@ -256,11 +386,16 @@ void process_cli_opts(int argc, char *argv[])
         { "outfile",    required_argument, NULL,                   'o' },
         { "verbose",    optional_argument, NULL,                   'v' },
         { "config",     required_argument, NULL,                   'c' },
+        { "config-snapshot", no_argument,  NULL,                   'S' },
+        { "stream",     no_argument,       NULL,                   's' },
+        { "compile",    no_argument,       NULL,                   'C' },
+        { "jobs",       required_argument, NULL,                   'j' },
+        { "max-include-depth", required_argument, NULL,            'd' },
         { NULL,         0,                 NULL,                    0  }
     };
     const char *opt_str =
-        /* no_argument       */ "hV"
-        /* required_argument */ "o:c:"
+        /* no_argument       */ "hVsCS"
+        /* required_argument */ "o:c:j:d:"
         /* optional_argument */ "v::"
     ;
     while ((c = getopt_long(argc, argv, opt_str, opts, &opt_ndx)) >= 0) {
@@ -271,15 +406,35 @@ void process_cli_opts(int argc, char *argv[])
             fluid_opts.outfile = safe_strdup(optarg);
             break;
         case 'c':
-            if (fluid_opts.config_file)
-                exit_error("Cannot pass multiple config files");
-            fluid_opts.config_file = safe_strdup(optarg);
+            fluid_opts.config_files = safe_realloc(fluid_opts.config_files,
+                    (fluid_opts.num_config_files + 1) * sizeof(char *));
+            fluid_opts.config_files[fluid_opts.num_config_files++] =
+                    safe_strdup(optarg);
+            break;
+        case 'S':
+            fluid_opts.config_snapshot = true;
             break;
         case 'v':
             fluid_opts.verbosity += 1;
             if (optarg)
                 fluid_opts.verbosity += strlen(optarg);
             break;
+        case 's':
+            fluid_opts.stream = true;
+            break;
+        case 'C':
+            fluid_opts.compile = true;
+            break;
+        case 'j':
+            fluid_opts.jobs = atoi(optarg);
+            if (fluid_opts.jobs <= 0)
+                exit_error("--jobs must be a positive number");
+            break;
+        case 'd':
+            fluid_opts.max_include_depth = atoi(optarg);
+            if (fluid_opts.max_include_depth <= 0)
+                exit_error("--max-include-depth must be a positive number");
+            break;
         case 'V':
             exit_version();
             break;
@@ -299,54 +454,169 @@ void process_cli_opts(int argc, char *argv[])
     if (argc != 1)
         exit_error("no input files given. See --help");
 
+    if (fluid_opts.stream && fluid_opts.compile)
+        exit_error("--stream and --compile cannot be used together");
+
+    if (fluid_opts.stream && fluid_opts.num_config_files)
+        exit_error("--stream does not read config files");
+
     fluid_opts.infile = safe_strdup(argv[0]);
 }
 
+static bool fluid_is_image(const char *path)
+{
+    size_t len = strlen(path), ext = strlen(FLUID_IMAGE_EXT);
+
+    return len > ext && strcmp(path + len - ext, FLUID_IMAGE_EXT) == 0;
+}
+
+/* Lex, preprocess and parse a loaded template */
+static int fluid_parse(fluid_t *ctx)
+{
+    lexer_setup(ctx);
+    if (lexer_lex(ctx) != 0) {
+        return -1;
+    }
+
+    include_cache_setup(ctx, fluid_opts.max_include_depth);
+    if (fluid_opts.jobs == 0)
+        fluid_opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    include_prefetch(ctx, fluid_opts.jobs);
+
+    if (fluid_preprocessor(ctx)) {
+        return -1;
+    }
+
+    parser_setup(ctx);
+    return parser_parse(ctx);
+}
+
+/**
+ * Read the config files, if any, each a layer over the ones before it.
+ * When the template is parsed already, only the parts of the config that
+ * it reads are built. The files as read are kept in the list `files`, as
+ * the layers refer to them. *hash identifies the files' contents, in
+ * order; it is 0 without any.
+ */
+static ferror_t fluid_config(fluid_t *ctx, fobject_t **config,
+                             fobject_t **files, uint64_t *hash)
+{
+    int i;
+    ferror_t e = FERROR_OK;
+    uint64_t file_hash;
+    fobject_t *only = NULL, *file, *layer;
+
+    *config = NULL;
+    *files = NULL;
+    *hash = 0;
+    if (fluid_opts.num_config_files == 0)
+        return FERROR_OK;
+    if (ctx != NULL)
+        only = vm_config_paths(ctx->parser_data);
+    *files = flist_new(fluid_opts.num_config_files);
+    for (i = 0; i < fluid_opts.num_config_files; i++) {
+        e = config_parse(fluid_opts.config_files[i], CONFIG_FORMAT_AUTO,
+                         &file, only, fluid_opts.config_snapshot, &file_hash);
+        if (e != FERROR_OK)
+            break;
+        *hash = (*hash ^ file_hash) * 0x100000001b3ULL | 1;
+        flist_append(*files, file);
+        if (*config == NULL) {
+            *config = file;
+            continue;
+        }
+        layer = config_layer(file, *config);
+        DEC_REF(file);
+        DEC_REF(*config);
+        *config = layer;
+    }
+    DEC_REF(only);
+    fexcept_proagate(e);
+    return FERROR_OK;
+}
+
 int main(int argc, char *argv[])
 {
+    int ret, fd;
     ferror_t e;
+    sink_t out;
     fluid_t *ctx;
+    uint64_t config_hash;
+    vm_program_t *prog;
+    fobject_t *config = NULL, *config_files = NULL, *globals;
 
     process_cli_opts(argc, argv);
 
-    if (fluid_opts.config_file) {
-        e = config_parse_yaml(fluid_opts.config_file);
-        fexcept_proagate(e);
+    ctx = NULL;
+    if (!fluid_opts.stream && !fluid_is_image(fluid_opts.infile)) {
+        ctx = fluid_load(NULL, fluid_opts.infile);
+        if (ctx == NULL || fluid_parse(ctx) != 0) {
+            return -1;
+        }
     }
 
-    ctx = fluid_load(NULL, fluid_opts.infile);
-    if (ctx == NULL) {
-        return -1;
-    }
+    e = fluid_config(ctx, &config, &config_files, &config_hash);
+    fexcept_proagate(e);
+    globals = vm_globals(config);
 
-    ctx->outfile = stdout;
+    fd = STDOUT_FILENO;
     if (fluid_opts.outfile) {
-        ctx->outfile = fopen(fluid_opts.outfile, "w");
-        if (ctx->outfile == NULL) {
+        fd = open(fluid_opts.outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
             LOG_ERR("Failed to open out file %s", fluid_opts.outfile);
             return -1;
         }
     }
-
-    lexer_setup(ctx);
-    if (lexer_lex(ctx) != 0) {
-        return -1;
+    sink_open_fd(&out, fd);
+
+    if (fluid_opts.stream) {
+        if (fluid_opts.max_include_depth == 0)
+            fluid_opts.max_include_depth = INCLUDE_MAX_DEPTH_DEFAULT;
+        ret = fluid_stream(&out, fluid_opts.infile,
+                           fluid_opts.max_include_depth);
+        if (sink_close(&out) != 0)
+            ret = -1;
+        return ret;
     }
 
-    if (fluid_preprocessor(ctx)) {
-        return -1;
+    if (ctx == NULL) {
+        prog = vm_program_load(fluid_opts.infile);
+        if (prog && prog->config_hash != 0 &&
+            prog->config_hash != config_hash) {
+            LOG_ERR("%s was compiled with other config files; pass the same "
+                    "ones, or compile it without any", fluid_opts.infile);
+            vm_program_free(prog);
+            prog = NULL;
+        }
     }
-
-    parser_setup(ctx);
-    if (parser_parse(ctx) != 0) {
+    else {
+        ctx->out = &out;
+        /* values found in config are folded into the program */
+        prog = vm_compile(ctx->parser_data, globals);
+        if (prog)
+            prog->config_hash = config_hash;
+    }
+    if (prog == NULL) {
         return -1;
     }
 
-    fluid_render_data(ctx);
+    if (fluid_opts.compile)
+        ret = vm_program_save(prog, &out);
+    else
+        ret = vm_render(prog, globals, &out);
+    /* text spans are referenced from prog, not copied; flush before free */
+    if (sink_close(&out) != 0)
+        ret = -1;
 
-    lexer_teardown(ctx);
-    parser_teardown(ctx);
-    fluid_destroy_context(ctx);
+    vm_program_free(prog);
+    if (ctx) {
+        lexer_teardown(ctx);
+        parser_teardown(ctx);
+        fluid_destroy_context(ctx);
+    }
+    DEC_REF(globals);
+    DEC_REF(config);
+    DEC_REF(config_files);
 
-    return 0;
+    return ret;
 }
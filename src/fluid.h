@@ -8,24 +8,42 @@
 #define _FLUID_H_
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <utils/list.h>
 #include <utils/utils.h>
 #include <utils/strutils.h>
 #include <utils/strlib.h>
 
+#include "arena.h"
+#include "lexer.h"
+#include "sink.h"
+#include "source.h"
+
 #ifndef VERSION
 #define VERSION "0.0.0"
 #endif
 
+#define FLUID_IMAGE_EXT                ".fluidc"
+
+typedef struct include_cache_s include_cache_t;
+
 typedef struct fluid_s {
-    FILE *outfile;
+    sink_t *out;
     char *filename;
     char *dirname;
-    char *buf;
-    size_t buf_size;
-    list_t lex_blocks;    /* list of nodes of type lexer_block_t */
+    source_t src;         /* template text; blocks hold views into it */
+    arena_t arena;        /* lexer/parser allocations; released at once */
+    lexer_blocks_t blocks;
+    lexer_includes_t includes; /* include tags in blocks, yet to be expanded */
+    lexer_tok_scratch_t tok_scratch;
+    include_cache_t *inc_cache; /* shared by a template and its partials */
+    bool inc_cache_owner;
     void *parser_data;
 } fluid_t;
 
+fluid_t *fluid_load(const char *dirname, const char *filename);
+void fluid_destroy_context(fluid_t *ctx);
+int fluid_preprocessor(fluid_t *ctx);
+
 #endif /* _FLUID_H_ */
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 
 #include "fobjects.h"
+#include "snapshot.h"
 
 /*
 
@@ -43,7 +44,6 @@ my_var.baz = [ "This", "is", "a", "list" ]
 
 fobject_t *__fobj_new(enum ftype_e type)
 {
-    int length;
     fobject_t *obj;
 
     obj = safe_calloc(1, sizeof(fobject_t));
@@ -54,22 +54,36 @@ fobject_t *__fobj_new(enum ftype_e type)
 
 void *__fobj_delete(fobject_t *obj)
 {
-    char *identifier;
+    size_t i;
     fobject_t *tmp;
-    hash_map_iterator_t it;
 
-    assert(obj->ref_count == 1);
+    assert(obj->ref_count == 0);
+
+    if (obj->flags & FOBJ_F_SNAPSHOT) {
+        /* only a snapshot's root is ever released; it takes the rest */
+        snapshot_release(obj);
+        return NULL;
+    }
 
     switch (obj->type) {
+    case FTYPE_STRING:
+        safe_free(obj->string.data);
+        break;
     case FTYPE_LIST:
+        while (obj->list.length > 0) {
+            tmp = obj->list.items[--obj->list.length];
+            DEC_REF(tmp);
+        }
         safe_free(obj->list.items);
         break;
     case FTYPE_DICT:
-        hash_map_it_init(&it, &obj->dict.map);
-        while (hash_map_it_next(&it, &identifier, &tmp) == 0) {
-            DEC_REF(tmp);
-            hash_map_delete(&obj->dict.map, identifier, 0);
+        for (i = 0; i < obj->dict.num_entries; i++) {
+            DEC_REF(obj->dict.entries[i].value);
+            safe_free(obj->dict.entries[i].key);
         }
+        safe_free(obj->dict.entries);
+        safe_free(obj->dict.slots);
+        DEC_REF(obj->dict.parent);
         break;
     default:
         break;
@@ -101,6 +115,29 @@ fobject_t *fobj_from_cstring(const char *val)
     return obj;
 }
 
+fobject_t *fobj_from_string(const char *val, size_t len)
+{
+    fobject_t *obj;
+
+    obj = __fobj_new(FTYPE_STRING);
+    obj->string.data = safe_malloc(len + 1);
+    memcpy(obj->string.data, val, len);
+    obj->string.data[len] = '\0';
+    obj->string.length = len;
+    return obj;
+}
+
+/* Takes over `val`; a malloc-ed buffer with val[len] == '\0' */
+fobject_t *fobj_from_owned_string(char *val, size_t len)
+{
+    fobject_t *obj;
+
+    obj = __fobj_new(FTYPE_STRING);
+    obj->string.data = val;
+    obj->string.length = len;
+    return obj;
+}
+
 fobject_t *fobj_from_bool(bool val)
 {
     fobject_t *obj;
@@ -144,7 +181,8 @@ int fobj_autovivify(fobject_t **obj, const char *literal)
 {
     int i;
     double val_double;
-    char *tmp, len;
+    char *tmp;
+    size_t len;
 
     len = strlen(literal);
 
@@ -154,27 +192,25 @@ int fobj_autovivify(fobject_t **obj, const char *literal)
     if (IS_NUMBER_ISH(literal)) {
         val_double = strtod(literal, &tmp);
         if (*tmp != '\0')
-            fexcept(FTYPE_ERR_NUM);
-        *obj = fobject_from_double(val_double);
+            return FTYPE_ERR_NUM;
+        *obj = fobj_from_double(val_double);
     }
     else if (strcmp(literal, "true") == 0) {
-        *obj = fobject_from_bool(true);
+        *obj = fobj_from_bool(true);
     }
     else if (strcmp(literal, "false") == 0 ) {
-        *obj = fobject_from_bool(false);
+        *obj = fobj_from_bool(false);
     }
     else if (IS_STRING_ISH(literal)) {
         i = 1;
         while (literal[i] && !IS_STRING_ISH(literal + i))
             i++;
         if (!IS_STRING_ISH(literal + i) || literal[i + 1] != '\0')
-            fexcept(FTYPE_ERR_STR);
-        tmp = safe_strdup(literal + 1);
-        tmp[i-1] = '\0';
-        *obj = fobject_from_cstring(tmp);
+            return FTYPE_ERR_STR;
+        *obj = fobj_from_string(literal + 1, i - 1);
     }
     else {
-        *obj = fobject_from_cstring(literal);
+        *obj = fobj_from_cstring(literal);
     }
 
     return 0;
@@ -216,9 +252,7 @@ int flist_get_item(fobject_t *obj, size_t offset, fobject_t **item)
 
 int flist_set_item(fobject_t *obj, size_t offset, fobject_t *item)
 {
-    fobject_t *old;
-
-    if (obj->type != FTYPE_LIST)
+    if (obj->type != FTYPE_LIST || FOBJ_IS_FROZEN(obj))
         return -1;
     if (offset >= obj->list.length)
         return -2;
@@ -231,9 +265,10 @@ void flist_grow(fobject_t *obj)
 {
     size_t new_capacity;
 
-    new_capacity = obj->list.capacity * 2;
+    new_capacity = obj->list.capacity ? obj->list.capacity * 2 : 8;
     obj->list.items = safe_realloc_zero(obj->list.items,
-                                        obj->list.capacity, new_capacity);
+                                obj->list.capacity * sizeof(fobject_t *),
+                                new_capacity * sizeof(fobject_t *));
     obj->list.capacity = new_capacity;
 }
 
@@ -241,7 +276,7 @@ int flist_insert(fobject_t *obj, size_t offset, fobject_t *item)
 {
     size_t pos;
 
-    if (obj->type != FTYPE_LIST)
+    if (obj->type != FTYPE_LIST || FOBJ_IS_FROZEN(obj))
         return -1;
 
     if (offset >= obj->list.length)
@@ -264,7 +299,7 @@ int flist_remove(fobject_t *obj, size_t offset, fobject_t **item)
 {
     fobject_t *val;
 
-    if (obj->type != FTYPE_LIST)
+    if (obj->type != FTYPE_LIST || FOBJ_IS_FROZEN(obj))
         return -1;
     if (offset >= obj->list.length)
         return -2;
@@ -282,7 +317,7 @@ int flist_remove(fobject_t *obj, size_t offset, fobject_t **item)
 
 int flist_append(fobject_t *obj, fobject_t *item)
 {
-    if (obj->type != FTYPE_LIST)
+    if (obj->type != FTYPE_LIST || FOBJ_IS_FROZEN(obj))
         return -1;
     if (obj->list.length + 1 >= obj->list.capacity)
         flist_grow(obj);
@@ -297,42 +332,253 @@ int flist_append(fobject_t *obj, fobject_t *item)
 
 fobject_t *fdict_new()
 {
-    fobject_t *obj;
+    return __fobj_new(FTYPE_DICT);
+}
 
-    obj = __fobj_new(FTYPE_DICT);
-    hash_map_init(&obj->dict.map);
+/* FNV-1a; paths are hashed with this at compile time, so keep it stable */
+uint32_t fdict_hash(const char *key, size_t len)
+{
+    size_t i;
+    uint32_t hash = 2166136261u;
 
-    return obj;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-fobject_t *fdict_get_item(fobject_t *obj, const char *key)
+/* Slot of `key`, or the empty slot where it would go */
+static uint32_t *fdict_slot(ftype_dict_t *d, const char *key, size_t len,
+                            uint32_t hash)
 {
-    if (obj->type != FTYPE_DICT)
-        return -1;
+    size_t i, mask = d->num_slots - 1;
+    ftype_dict_entry_t *e;
+
+    for (i = hash & mask; d->slots[i] != FDICT_SLOT_EMPTY; i = (i + 1) & mask) {
+        e = &d->entries[d->slots[i]];
+        if (e->hash == hash && e->key_len == len && e->value &&
+            memcmp(e->key, key, len) == 0)
+            break;
+    }
+    return &d->slots[i];
+}
+
+/* Drop deleted entries and rebuild the slots with room for one more */
+static void fdict_resize(ftype_dict_t *d)
+{
+    size_t i, j, mask;
 
-    return hash_map_get(&obj->dict.map, key, 0);
+    for (i = 0, j = 0; i < d->num_entries; i++) {
+        if (d->entries[i].value)
+            d->entries[j++] = d->entries[i];
+        else
+            safe_free(d->entries[i].key);
+    }
+    d->num_entries = j;
+    if (d->num_entries + 1 > d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 8;
+        d->entries = safe_realloc(d->entries,
+                                  d->capacity * sizeof(ftype_dict_entry_t));
+    }
+    /* keep the load factor of the slots at or below 1/2 */
+    while (d->num_slots < 2 * d->capacity)
+        d->num_slots = d->num_slots ? d->num_slots * 2 : 16;
+    d->slots = safe_realloc(d->slots, d->num_slots * sizeof(uint32_t));
+    memset(d->slots, 0xff, d->num_slots * sizeof(uint32_t));
+    mask = d->num_slots - 1;
+    for (i = 0; i < d->num_entries; i++) {
+        for (j = d->entries[i].hash & mask; d->slots[j] != FDICT_SLOT_EMPTY;
+             j = (j + 1) & mask)
+            ;
+        d->slots[j] = i;
+    }
 }
 
-int fdict_insert_item(fobject_t *obj, const char *key, fobject_t *item)
+/* Item at `key` in obj itself, not its parents */
+static fobject_t *fdict_own(fobject_t *obj, const char *key, size_t len,
+                            uint32_t hash)
+{
+    uint32_t *slot;
+
+    if (obj->dict.count == 0)
+        return NULL;
+    slot = fdict_slot(&obj->dict, key, len, hash);
+    if (*slot == FDICT_SLOT_EMPTY)
+        return NULL;
+    return obj->dict.entries[*slot].value;
+}
+
+/* Borrowed reference to the item at `key` (whose fdict_hash() is `hash`) */
+fobject_t *fdict_lookup(fobject_t *obj, const char *key, size_t len,
+                        uint32_t hash)
 {
+    fobject_t *item;
+
     if (obj->type != FTYPE_DICT)
+        return NULL;
+    for (; obj != NULL; obj = obj->dict.parent) {
+        item = fdict_own(obj, key, len, hash);
+        if (item != NULL)
+            return item;
+    }
+    return NULL;
+}
+
+fobject_t *fdict_get_item(fobject_t *obj, const char *key)
+{
+    size_t len = strlen(key);
+
+    return fdict_lookup(obj, key, len, fdict_hash(key, len));
+}
+
+/* `owned` is a key buffer to take over, or NULL to copy `key` */
+static int fdict_insert(fobject_t *obj, const char *key, size_t len,
+                        char *owned, fobject_t *item)
+{
+    uint32_t *slot, hash;
+    ftype_dict_entry_t *e;
+    ftype_dict_t *d = &obj->dict;
+
+    if (obj->type != FTYPE_DICT || FOBJ_IS_FROZEN(obj) || item == NULL) {
+        safe_free(owned);
         return -1;
+    }
 
-    hash_map_insert(&obj->dict.map, key, INC_REF(item));
-    obj->dict.count++;
+    hash = fdict_hash(key, len);
+    if (d->num_slots) {
+        slot = fdict_slot(d, key, len, hash);
+        if (*slot != FDICT_SLOT_EMPTY) {
+            e = &d->entries[*slot];
+            DEC_REF(e->value);
+            e->value = INC_REF(item);
+            safe_free(owned);
+            return 0;
+        }
+    }
+    if (d->num_entries == d->capacity)
+        fdict_resize(d);
+    slot = fdict_slot(d, key, len, hash);
+    e = &d->entries[d->num_entries];
+    if (owned == NULL) {
+        owned = safe_malloc(len + 1);
+        memcpy(owned, key, len);
+        owned[len] = '\0';
+    }
+    e->key = owned;
+    e->key_len = len;
+    e->hash = hash;
+    e->value = INC_REF(item);
+    *slot = d->num_entries++;
+    d->count++;
 
     return 0;
 }
 
+int fdict_insert_item(fobject_t *obj, const char *key, fobject_t *item)
+{
+    return fdict_insert(obj, key, strlen(key), NULL, item);
+}
+
+/* Like fdict_insert_item(), but takes over the malloc-ed `key` */
+int fdict_insert_owned(fobject_t *obj, char *key, size_t len,
+                       fobject_t *item)
+{
+    return fdict_insert(obj, key, len, key, item);
+}
+
 fobject_t *fdict_delete_item(fobject_t *obj, const char *key)
 {
+    size_t len = strlen(key);
+    uint32_t *slot;
     fobject_t *item;
+    ftype_dict_entry_t *e;
 
-    if (obj->type != FTYPE_DICT)
+    if (obj->type != FTYPE_DICT || FOBJ_IS_FROZEN(obj) ||
+        obj->dict.count == 0)
         return NULL;
 
-    item = hash_map_delete(&obj->dict.map, key, 0);
+    slot = fdict_slot(&obj->dict, key, len, fdict_hash(key, len));
+    if (*slot == FDICT_SLOT_EMPTY)
+        return NULL;
+    /* the slot stays taken so that later entries can still be found */
+    e = &obj->dict.entries[*slot];
+    item = e->value;
+    e->value = NULL;
     obj->dict.count--;
 
     return DEC_REF(item);
 }
+
+/* An entry of `layer` (obj or one of its parents) that obj hides */
+static bool fdict_is_shadowed(fobject_t *obj, fobject_t *layer,
+                              ftype_dict_entry_t *e)
+{
+    for (; obj != layer; obj = obj->dict.parent) {
+        if (fdict_own(obj, e->key, e->key_len, e->hash) != NULL)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Iterate in insertion order, then over the keys only the parent has;
+ * `*pos` starts at 0 and counts through the entries of each layer.
+ */
+bool fdict_next(fobject_t *obj, size_t *pos, const char **key,
+                fobject_t **item)
+{
+    size_t i;
+    fobject_t *layer;
+    ftype_dict_entry_t *e;
+
+    if (obj->type != FTYPE_DICT)
+        return false;
+    for (;;) {
+        i = *pos;
+        for (layer = obj; layer && i >= layer->dict.num_entries;
+             layer = layer->dict.parent)
+            i -= layer->dict.num_entries;
+        if (layer == NULL)
+            return false;
+        e = &layer->dict.entries[i];
+        (*pos)++;
+        if (e->value && (layer == obj || !fdict_is_shadowed(obj, layer, e))) {
+            *key = e->key;
+            *item = e->value;
+            return true;
+        }
+    }
+}
+
+int fdict_set_parent(fobject_t *obj, fobject_t *parent)
+{
+    fobject_t *p;
+
+    if (obj->type != FTYPE_DICT || FOBJ_IS_FROZEN(obj) ||
+        (parent && parent->type != FTYPE_DICT))
+        return -1;
+    for (p = parent; p != NULL; p = p->dict.parent) {
+        if (p == obj)
+            return -1; /* would be its own parent */
+    }
+    INC_REF(parent);
+    DEC_REF(obj->dict.parent);
+    obj->dict.parent = parent;
+    return 0;
+}
+
+size_t fdict_length(fobject_t *obj)
+{
+    size_t n = 0, pos = 0;
+    const char *key;
+    fobject_t *item;
+
+    if (obj->type != FTYPE_DICT)
+        return 0;
+    if (obj->dict.parent == NULL)
+        return obj->dict.count;
+    while (fdict_next(obj, &pos, &key, &item))
+        n++;
+    return n;
+}
@@ -4,15 +4,15 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#ifndef _TYPES_H_
-#define _TYPES_H_
+#ifndef _FOBJECTS_H_
+#define _FOBJECTS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
 
 #include <utils/utils.h>
-#include <utils/hashmap.h>
 
 typedef struct ftype_number {
     double data;
@@ -33,9 +33,33 @@ typedef struct ftype_list {
     size_t length;
 } ftype_list_t;
 
+struct fobject;
+
+typedef struct ftype_dict_entry {
+    char *key;
+    size_t key_len;
+    uint32_t hash;
+    struct fobject *value;      /* NULL once deleted */
+} ftype_dict_entry_t;
+
+/**
+ * Entries are kept in insertion order; `slots` is an open addressed
+ * (linear probing) index into them, keyed by the entry's hash. Deleted
+ * entries stay in place until the next resize so that probe chains
+ * through them remain intact.
+ *
+ * A dict may have a parent (see fdict_set_parent()) that keys it does not
+ * have are looked up in; that makes a layer over the parent that shares
+ * all of it instead of copying it.
+ */
 typedef struct ftype_dict {
-    hash_map_t map;
-    size_t count;
+    ftype_dict_entry_t *entries;
+    uint32_t *slots;            /* FDICT_SLOT_EMPTY or index into entries */
+    uint32_t num_entries;       /* used, including deleted */
+    uint32_t capacity;          /* of entries */
+    uint32_t num_slots;         /* power of 2; 0 for an empty dict */
+    uint32_t count;             /* live entries, not counting the parent's */
+    struct fobject *parent;
 } ftype_dict_t;
 
 enum ftype_e {
@@ -47,8 +71,14 @@ enum ftype_e {
     FTYPE_DICT,
 };
 
+/* Lives in a mapped snapshot (see snapshot.c); read-only, never freed */
+#define FOBJ_F_SNAPSHOT                0x01
+
+#define FOBJ_IS_FROZEN(obj)            ((obj)->flags & FOBJ_F_SNAPSHOT)
+
 typedef struct fobject {
     enum ftype_e type;
+    uint32_t flags;
     union {
         ftype_number_t number;
         ftype_string_t string;
@@ -76,8 +106,8 @@ void *__fobj_delete(fobject_t *obj);
 
 /* --- End PRIVATE --- */
 
-#define INC_REF(obj) (obj) ? _INC_REF((fobject_t *)(obj)) : NULL;
-#define DEC_REF(obj) (obj) ? _DEC_REF((fobject_t *)(obj)) : NULL;
+#define INC_REF(obj) ((obj) ? _INC_REF((fobject_t *)(obj)) : NULL)
+#define DEC_REF(obj) ((obj) ? _DEC_REF((fobject_t *)(obj)) : NULL)
 
 /* ------------------------------- */
 /*           Primitive             */
@@ -85,6 +115,8 @@ void *__fobj_delete(fobject_t *obj);
 
 fobject_t *fobj_from_double(double val);
 fobject_t *fobj_from_cstring(const char *val);
+fobject_t *fobj_from_string(const char *val, size_t len);
+fobject_t *fobj_from_owned_string(char *val, size_t len);
 fobject_t *fobj_from_bool(bool val);
 int fobj_to_double(fobject_t *obj, double *val);
 int fobj_to_cstring(fobject_t *obj, char **val, int *len);
@@ -108,9 +140,27 @@ int flist_append(fobject_t *obj, fobject_t *item);
 /*           Dictionary            */
 /* ------------------------------- */
 
+#define FDICT_SLOT_EMPTY               UINT32_MAX
+
 fobject_t *fdict_new();
+uint32_t fdict_hash(const char *key, size_t len);
+fobject_t *fdict_lookup(fobject_t *obj, const char *key, size_t len,
+                        uint32_t hash);
 fobject_t *fdict_get_item(fobject_t *obj, const char *key);
 int fdict_insert_item(fobject_t *obj, const char *key, fobject_t *item);
+int fdict_insert_owned(fobject_t *obj, char *key, size_t len,
+                       fobject_t *item);
 fobject_t *fdict_delete_item(fobject_t *obj, const char *key);
+bool fdict_next(fobject_t *obj, size_t *pos, const char **key,
+                fobject_t **item);
+
+/**
+ * Lookups of keys that obj doesn't have, and fdict_next(), go on to
+ * `parent` (and its parents). Inserts and deletes only change obj.
+ */
+int fdict_set_parent(fobject_t *obj, fobject_t *parent);
+
+/* Number of keys, including those only a parent has */
+size_t fdict_length(fobject_t *obj);
 
-#endif /* _TYPES_H_ */
+#endif /* _FOBJECTS_H_ */
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <utils/logger.h>
+
+#include "vm.h"
+
+LOGGER_MODULE_EXTERN(fluid, image);
+
+/**
+ * A .fluidc image is a vm_program_t with its pointers turned into file
+ * offsets:
+ *
+ *   header | code | strtab | spans | consts | paths | segs | filters
+ *
+ * Every section starts on an 8 byte boundary, so after the file is mapped
+ * the program arrays point straight into it. The image is tied to the
+ * byte order and struct layout it was written with; both are recorded in
+ * the header and checked on load.
+ */
+
+#define VM_IMAGE_MAGIC                 "FLUIDC\r\n"
+#define VM_IMAGE_VERSION               3
+#define VM_IMAGE_BYTE_ORDER            0x01020304
+#define VM_IMAGE_ALIGN                 8
+
+enum vm_image_section {
+    VM_IMAGE_CODE,
+    VM_IMAGE_STRTAB,
+    VM_IMAGE_SPANS,
+    VM_IMAGE_CONSTS,
+    VM_IMAGE_PATHS,
+    VM_IMAGE_SEGS,
+    VM_IMAGE_FILTERS,
+    VM_IMAGE_SENTINEL
+};
+
+typedef struct {
+    uint32_t off;
+    uint32_t count;
+    uint32_t elem_size;
+    uint32_t reserved;
+} vm_image_section_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_regs;
+    uint32_t num_locals;
+    uint32_t num_loops;
+    uint32_t num_counters;
+    uint32_t max_captures;
+    uint32_t reserved;
+    uint64_t config_hash;
+    vm_image_section_t sections[VM_IMAGE_SENTINEL];
+} vm_image_header_t;
+
+/* Where each section lives in a vm_program_t */
+static void vm_image_sections(vm_program_t *prog, void ***ptrs,
+                              uint32_t **counts, uint32_t *sizes)
+{
+    ptrs[VM_IMAGE_CODE] = (void **)&prog->code;
+    ptrs[VM_IMAGE_STRTAB] = (void **)&prog->strtab;
+    ptrs[VM_IMAGE_SPANS] = (void **)&prog->spans;
+    ptrs[VM_IMAGE_CONSTS] = (void **)&prog->consts;
+    ptrs[VM_IMAGE_PATHS] = (void **)&prog->paths;
+    ptrs[VM_IMAGE_SEGS] = (void **)&prog->segs;
+    ptrs[VM_IMAGE_FILTERS] = (void **)&prog->filters;
+
+    counts[VM_IMAGE_CODE] = &prog->code_len;
+    counts[VM_IMAGE_STRTAB] = &prog->strtab_len;
+    counts[VM_IMAGE_SPANS] = &prog->num_spans;
+    counts[VM_IMAGE_CONSTS] = &prog->num_consts;
+    counts[VM_IMAGE_PATHS] = &prog->num_paths;
+    counts[VM_IMAGE_SEGS] = &prog->num_segs;
+    counts[VM_IMAGE_FILTERS] = &prog->num_filters;
+
+    sizes[VM_IMAGE_CODE] = sizeof(vm_insn_t);
+    sizes[VM_IMAGE_STRTAB] = sizeof(char);
+    sizes[VM_IMAGE_SPANS] = sizeof(vm_str_t);
+    sizes[VM_IMAGE_CONSTS] = sizeof(vm_const_t);
+    sizes[VM_IMAGE_PATHS] = sizeof(vm_path_t);
+    sizes[VM_IMAGE_SEGS] = sizeof(vm_seg_t);
+    sizes[VM_IMAGE_FILTERS] = sizeof(liq_filter_t);
+}
+
+static size_t vm_image_align(size_t off)
+{
+    return (off + VM_IMAGE_ALIGN - 1) & ~((size_t)VM_IMAGE_ALIGN - 1);
+}
+
+int vm_program_save(vm_program_t *prog, sink_t *out)
+{
+    int i;
+    size_t off, len;
+    void **ptrs[VM_IMAGE_SENTINEL];
+    uint32_t *counts[VM_IMAGE_SENTINEL], sizes[VM_IMAGE_SENTINEL];
+    static const char zeros[VM_IMAGE_ALIGN];
+    vm_image_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VM_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = VM_IMAGE_VERSION;
+    hdr.byte_order = VM_IMAGE_BYTE_ORDER;
+    hdr.num_regs = prog->num_regs;
+    hdr.num_locals = prog->num_locals;
+    hdr.num_loops = prog->num_loops;
+    hdr.num_counters = prog->num_counters;
+    hdr.max_captures = prog->max_captures;
+    hdr.config_hash = prog->config_hash;
+
+    vm_image_sections(prog, ptrs, counts, sizes);
+    off = vm_image_align(sizeof(hdr));
+    for (i = 0; i < VM_IMAGE_SENTINEL; i++) {
+        hdr.sections[i].off = off;
+        hdr.sections[i].count = *counts[i];
+        hdr.sections[i].elem_size = sizes[i];
+        off = vm_image_align(off + (size_t)*counts[i] * sizes[i]);
+        if (off > UINT32_MAX) {
+            LOG_ERR("image: program too large");
+            return -1;
+        }
+    }
+
+    off = sizeof(hdr);
+    sink_write(out, &hdr, sizeof(hdr));
+    for (i = 0; i < VM_IMAGE_SENTINEL; i++) {
+        sink_write(out, zeros, hdr.sections[i].off - off);
+        len = (size_t)*counts[i] * sizes[i];
+        sink_write(out, *ptrs[i], len);
+        off = hdr.sections[i].off + len;
+    }
+    return sink_write(out, zeros, vm_image_align(off) - off);
+}
+
+static int vm_image_check_str(vm_program_t *prog, vm_str_t *s)
+{
+    return ((size_t)s->off + s->len < prog->strtab_len &&
+            prog->strtab[s->off + s->len] == '\0') ? 0 : -1;
+}
+
+/**
+ * The compiler only jumps back to the FOR_ITER of an enclosing loop. Hold
+ * images to that, so a damaged one can't spin forever.
+ */
+static int vm_image_check_back_jump(vm_program_t *prog, uint32_t pc)
+{
+    uint32_t i, target = prog->code[pc].imm;
+    vm_insn_t *loop = &prog->code[target];
+
+    if (prog->code[pc].op != VM_OP_JUMP || loop->op != VM_OP_FOR_ITER)
+        return -1;
+    for (i = target; i < pc; i++) {
+        if (prog->code[i].op == VM_OP_FOR_INIT && prog->code[i].a == loop->a)
+            return -1;
+    }
+    return 0;
+}
+
+/* Operand bounds; an image may come from anywhere */
+static int vm_image_verify(vm_program_t *prog)
+{
+    uint32_t i, limit;
+    bool jump;
+    vm_insn_t *insn;
+
+    if (prog->code_len == 0 || prog->code[prog->code_len - 1].op != VM_OP_HALT)
+        return -1;
+    /* a program with no text or strings at all has an empty one */
+    if (prog->strtab_len != 0 && prog->strtab[prog->strtab_len - 1] != '\0')
+        return -1;
+    if (prog->num_regs > VM_MAX_REGS || prog->num_loops > UINT8_MAX)
+        return -1;
+    if (prog->num_locals > VM_MAX_SLOTS || prog->num_counters > VM_MAX_SLOTS ||
+        prog->max_captures > VM_MAX_SLOTS)
+        return -1;
+
+    for (i = 0; i < prog->num_spans; i++) {
+        if ((size_t)prog->spans[i].off + prog->spans[i].len >
+            prog->strtab_len)
+            return -1;
+    }
+    for (i = 0; i < prog->num_consts; i++) {
+        if (prog->consts[i].type == VM_CONST_STRING &&
+            vm_image_check_str(prog, &prog->consts[i].string))
+            return -1;
+    }
+    for (i = 0; i < prog->num_segs; i++) {
+        if (vm_image_check_str(prog, &prog->segs[i].key) ||
+            prog->segs[i].kind >= VM_SEG_SENTINEL)
+            return -1;
+    }
+    for (i = 0; i < prog->num_paths; i++) {
+        if ((size_t)prog->paths[i].first_seg + prog->paths[i].num_segs >
+            prog->num_segs || prog->paths[i].num_segs == 0)
+            return -1;
+        if (prog->paths[i].local != VM_NONE &&
+            prog->paths[i].local >= prog->num_locals)
+            return -1;
+    }
+    for (i = 0; i < prog->num_filters; i++) {
+        if (prog->filters[i].id <= LIQ_FILTER_NONE ||
+            prog->filters[i].id >= LIQ_FILTER_SENTINEL)
+            return -1;
+    }
+
+    for (i = 0; i < prog->code_len; i++) {
+        insn = &prog->code[i];
+        if (insn->op >= VM_OP_SENTINEL)
+            return -1;
+        jump = false;
+        switch (insn->op) {
+        case VM_OP_EMIT_SPAN:     limit = prog->num_spans; break;
+        case VM_OP_LOAD_CONST:
+        case VM_OP_CMP_CONST:     limit = prog->num_consts; break;
+        case VM_OP_LOAD_PATH:     limit = prog->num_paths; break;
+        case VM_OP_FILTER:        limit = prog->num_filters; break;
+        case VM_OP_STORE:
+        case VM_OP_CAPTURE_END:   limit = prog->num_locals; break;
+        case VM_OP_CMP:           limit = LIQ_OP_SENTINEL; break;
+        case VM_OP_INCREMENT:
+        case VM_OP_DECREMENT:     limit = prog->num_counters; break;
+        case VM_OP_JUMP:
+        case VM_OP_JUMP_IF:
+        case VM_OP_JUMP_IFNOT:
+        case VM_OP_FOR_INIT:
+        case VM_OP_FOR_ITER:      limit = prog->code_len; jump = true; break;
+        default:                  limit = UINT32_MAX; break;
+        }
+        if (insn->imm >= limit)
+            return -1;
+        if (insn->a >= prog->num_regs && insn->op != VM_OP_FOR_INIT &&
+            insn->op != VM_OP_FOR_ITER && insn->op != VM_OP_HALT &&
+            insn->op != VM_OP_EMIT_SPAN && insn->op != VM_OP_JUMP &&
+            insn->op != VM_OP_CAPTURE_BEGIN && insn->op != VM_OP_CAPTURE_END &&
+            insn->op != VM_OP_INCREMENT && insn->op != VM_OP_DECREMENT)
+            return -1;
+        if ((insn->op == VM_OP_FOR_INIT || insn->op == VM_OP_FOR_ITER) &&
+            insn->a >= prog->num_loops)
+            return -1;
+        if (insn->op == VM_OP_FOR_INIT && insn->b + 4u > prog->num_regs)
+            return -1;
+        if (insn->op == VM_OP_FOR_ITER && insn->b >= prog->num_regs)
+            return -1;
+        if (insn->op == VM_OP_CMP && (insn->b >= prog->num_regs ||
+                                      insn->c >= prog->num_regs))
+            return -1;
+        if (insn->op == VM_OP_CMP_CONST && (insn->b >= prog->num_regs ||
+                                            insn->c >= LIQ_OP_SENTINEL))
+            return -1;
+        if (jump && insn->imm <= i &&
+            vm_image_check_back_jump(prog, i))
+            return -1;
+    }
+    return 0;
+}
+
+vm_program_t *vm_program_load(const char *path)
+{
+    int i;
+    size_t end;
+    void **ptrs[VM_IMAGE_SENTINEL];
+    uint32_t *counts[VM_IMAGE_SENTINEL], sizes[VM_IMAGE_SENTINEL];
+    const vm_image_header_t *hdr;
+    const vm_image_section_t *sec;
+    vm_program_t *prog;
+
+    prog = safe_calloc(1, sizeof(vm_program_t));
+    if (source_load(&prog->image, path) != 0) {
+        LOG_ERR("image: failed to read %s", path);
+        safe_free(prog);
+        return NULL;
+    }
+
+    hdr = (const vm_image_header_t *)prog->image.buf;
+    if (prog->image.size < sizeof(*hdr) ||
+        memcmp(hdr->magic, VM_IMAGE_MAGIC, sizeof(hdr->magic)) != 0) {
+        LOG_ERR("image: %s is not a compiled template", path);
+        goto error;
+    }
+    if (hdr->version != VM_IMAGE_VERSION ||
+        hdr->byte_order != VM_IMAGE_BYTE_ORDER) {
+        LOG_ERR("image: %s was compiled by an incompatible fluid", path);
+        goto error;
+    }
+
+    prog->num_regs = hdr->num_regs;
+    prog->num_locals = hdr->num_locals;
+    prog->num_loops = hdr->num_loops;
+    prog->num_counters = hdr->num_counters;
+    prog->max_captures = hdr->max_captures;
+    prog->config_hash = hdr->config_hash;
+
+    vm_image_sections(prog, ptrs, counts, sizes);
+    for (i = 0; i < VM_IMAGE_SENTINEL; i++) {
+        sec = &hdr->sections[i];
+        end = sec->off + (size_t)sec->count * sec->elem_size;
+        if (sec->elem_size != sizes[i] || sec->off % VM_IMAGE_ALIGN ||
+            sec->off < sizeof(*hdr) || end > prog->image.size) {
+            LOG_ERR("image: %s is corrupt or incompatible", path);
+            goto error;
+        }
+        *ptrs[i] = (void *)(prog->image.buf + sec->off);
+        *counts[i] = sec->count;
+    }
+
+    if (vm_image_verify(prog) != 0) {
+        LOG_ERR("image: %s failed verification", path);
+        goto error;
+    }
+    return prog;
+error:
+    vm_program_free(prog);
+    return NULL;
+}
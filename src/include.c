@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utils/file.h>
+#include <utils/logger.h>
+
+#include "include.h"
+
+LOGGER_MODULE_EXTERN(fluid, include);
+
+#define INCLUDE_CACHE_BUCKETS          64
+#define INCLUDE_MAX_JOBS               32
+
+enum include_entry_state {
+    INCLUDE_ENTRY_LOADING,    /* claimed by a prefetch worker */
+    INCLUDE_ENTRY_LEXED,      /* prefetched; not preprocessed yet */
+    INCLUDE_ENTRY_EXPANDING,  /* being preprocessed; on the include stack */
+    INCLUDE_ENTRY_READY,      /* lexed and preprocessed */
+    INCLUDE_ENTRY_FAILED,     /* load or preprocess failed; not retried */
+};
+
+typedef struct include_entry_s include_entry_t;
+
+struct include_entry_s {
+    include_entry_t *next;
+    enum include_entry_state state;
+    uint32_t hash;
+    char *path;               /* realpath() of the partial */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    fluid_t *ctx;
+};
+
+/**
+ * The include graph is expanded depth first, one node at a time. `stack`
+ * holds the chain of partials being expanded; finding one of them again
+ * is a cycle. Each node is expanded (preprocessed) only once; later
+ * includes of it reuse the result.
+ */
+struct include_cache_s {
+    include_entry_t *buckets[INCLUDE_CACHE_BUCKETS];
+    include_entry_t **stack;
+    int depth;
+    int max_depth;
+};
+
+static uint32_t include_hash(const char *s)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+include_cache_t *include_cache_new(int max_depth)
+{
+    include_cache_t *cache;
+
+    if (max_depth <= 0)
+        max_depth = INCLUDE_MAX_DEPTH_DEFAULT;
+
+    cache = safe_calloc(1, sizeof(include_cache_t));
+    cache->stack = safe_calloc(max_depth, sizeof(include_entry_t *));
+    cache->max_depth = max_depth;
+    return cache;
+}
+
+include_cache_t *include_cache_setup(fluid_t *ctx, int max_depth)
+{
+    if (ctx->inc_cache == NULL) {
+        /* top level template; owns the cache for all its partials */
+        ctx->inc_cache = include_cache_new(max_depth);
+        ctx->inc_cache_owner = true;
+    }
+    return ctx->inc_cache;
+}
+
+void include_cache_free(include_cache_t *cache)
+{
+    int i;
+    include_entry_t *e, *next;
+
+    for (i = 0; i < INCLUDE_CACHE_BUCKETS; i++) {
+        e = cache->buckets[i];
+        while (e) {
+            next = e->next;
+            if (e->ctx)
+                fluid_destroy_context(e->ctx);
+            safe_free(e->path);
+            safe_free(e);
+            e = next;
+        }
+    }
+    safe_free(cache->stack);
+    safe_free(cache);
+}
+
+static include_entry_t *include_cache_lookup(include_cache_t *cache,
+                                             const char *path, uint32_t hash,
+                                             struct stat *st)
+{
+    include_entry_t *e;
+
+    e = cache->buckets[hash % INCLUDE_CACHE_BUCKETS];
+    while (e) {
+        /**
+         * Stale entries (file changed while we were running) are left in
+         * place as blocks spliced from them may still be in use; a newer
+         * entry for the same path shadows them.
+         */
+        if (e->hash == hash && strcmp(e->path, path) == 0 &&
+            e->dev == st->st_dev && e->ino == st->st_ino &&
+            e->mtime.tv_sec == st->st_mtim.tv_sec &&
+            e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+static include_entry_t *
+include_cache_insert(include_cache_t *cache, char *path, uint32_t hash,
+                     struct stat *st, fluid_t *ctx)
+{
+    include_entry_t *e;
+    size_t bucket = hash % INCLUDE_CACHE_BUCKETS;
+
+    e = safe_calloc(1, sizeof(include_entry_t));
+    e->hash = hash;
+    e->path = path;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->ctx = ctx;
+    e->state = INCLUDE_ENTRY_READY;
+    e->next = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    return e;
+}
+
+static char *include_realpath(const char *dirname, const char *file,
+                              struct stat *st)
+{
+    char *path, *resolved;
+
+    path = path_join(dirname, file);
+    if (path == NULL)
+        return NULL;
+    resolved = realpath(path, NULL);
+    safe_free(path);
+    if (resolved && stat(resolved, st) != 0) {
+        free(resolved);
+        return NULL;
+    }
+    return resolved;
+}
+
+static fluid_t *include_load(include_cache_t *cache, const char *path)
+{
+    fluid_t *sub_ctx;
+
+    sub_ctx = fluid_load(NULL, path);
+    if (sub_ctx == NULL)
+        return NULL;
+
+    sub_ctx->inc_cache = cache;
+    lexer_setup(sub_ctx);
+    if (lexer_lex(sub_ctx) != 0) {
+        lexer_teardown(sub_ctx);
+        fluid_destroy_context(sub_ctx);
+        return NULL;
+    }
+    /* the scratch is only needed while lexing */
+    safe_free(sub_ctx->tok_scratch.toks);
+    sub_ctx->tok_scratch.toks = NULL;
+    sub_ctx->tok_scratch.capacity = 0;
+    return sub_ctx;
+}
+
+static void include_print_stack(include_cache_t *cache, fluid_t *ctx,
+                                include_entry_t *e)
+{
+    int i;
+
+    for (i = 0; i < cache->depth; i++)
+        LOG_ERR("  included from '%s'", cache->stack[i]->path);
+    if (cache->depth == 0 || cache->stack[cache->depth - 1]->ctx != ctx)
+        LOG_ERR("  included from '%s/%s'", ctx->dirname, ctx->filename);
+    if (e)
+        LOG_ERR("  includes '%s'", e->path);
+}
+
+static fluid_t *include_failed(include_cache_t *cache, fluid_t *ctx,
+                               const char *file)
+{
+    LOG_ERR("failed to load include '%s'", file);
+    include_print_stack(cache, ctx, NULL);
+    return NULL;
+}
+
+static int include_preprocess(include_cache_t *cache, include_entry_t *e)
+{
+    int ret;
+
+    e->state = INCLUDE_ENTRY_EXPANDING;
+    cache->stack[cache->depth++] = e;
+    ret = fluid_preprocessor(e->ctx);
+    cache->depth--;
+    e->state = ret ? INCLUDE_ENTRY_FAILED : INCLUDE_ENTRY_READY;
+    return ret;
+}
+
+fluid_t *include_resolve(fluid_t *ctx, const char *file)
+{
+    uint32_t hash;
+    struct stat st;
+    char *resolved;
+    fluid_t *sub_ctx;
+    include_entry_t *e;
+    include_cache_t *cache = ctx->inc_cache;
+
+    if (cache->depth >= cache->max_depth) {
+        LOG_ERR("include depth exceeds %d while including '%s'",
+                cache->max_depth, file);
+        include_print_stack(cache, ctx, NULL);
+        return NULL;
+    }
+
+    resolved = include_realpath(ctx->dirname, file, &st);
+    if (resolved == NULL) {
+        LOG_ERR("failed to resolve include '%s' in '%s'", file,
+                ctx->dirname ? ctx->dirname : ".");
+        return NULL;
+    }
+
+    hash = include_hash(resolved);
+    e = include_cache_lookup(cache, resolved, hash, &st);
+    if (e) {
+        free(resolved);
+        if (e->state == INCLUDE_ENTRY_EXPANDING) {
+            LOG_ERR("include cycle detected");
+            include_print_stack(cache, ctx, e);
+            return NULL;
+        }
+        if (e->state == INCLUDE_ENTRY_FAILED) {
+            /* a prefetch worker failed to load it, and logged why */
+            return include_failed(cache, ctx, file);
+        }
+        if (e->state == INCLUDE_ENTRY_LEXED && include_preprocess(cache, e))
+            return NULL;
+        return e->ctx;
+    }
+
+    sub_ctx = include_load(cache, resolved);
+    if (sub_ctx == NULL) {
+        free(resolved);
+        return include_failed(cache, ctx, file);
+    }
+    e = include_cache_insert(cache, resolved, hash, &st, sub_ctx);
+    if (include_preprocess(cache, e))
+        return NULL;
+    return sub_ctx;
+}
+
+/* --- Parallel prefetch --- */
+
+typedef struct include_job_s include_job_t;
+
+struct include_job_s {
+    include_job_t *next;
+    const char *dirname;      /* owned by the including fluid_t */
+    char *file;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    include_job_t *head;
+    include_job_t *tail;
+    int pending;              /* jobs queued or in progress */
+    include_cache_t *cache;
+} include_pool_t;
+
+/* Call `fn` for each include tag of ctx that is yet to be expanded */
+static void include_foreach(fluid_t *ctx,
+                            void (*fn)(void *arg, lexer_tok_t *file),
+                            void *arg)
+{
+    size_t i;
+    lexer_blocks_t *b = &ctx->blocks;
+
+    for (i = 0; i < ctx->includes.count; i++)
+        fn(arg, &b->toks[ctx->includes.idx[i]].tag.tokens[0]);
+}
+
+struct include_enqueue_arg {
+    include_pool_t *pool;
+    const char *dirname;
+};
+
+/* called with pool->lock held (or before the workers are started) */
+static void include_enqueue(void *arg, lexer_tok_t *file)
+{
+    include_job_t *job;
+    struct include_enqueue_arg *a = arg;
+
+    job = safe_calloc(1, sizeof(include_job_t));
+    job->dirname = a->dirname;
+    job->file = safe_malloc(file->span.len + 1);
+    memcpy(job->file, file->span.buf, file->span.len);
+    job->file[file->span.len] = '\0';
+
+    if (a->pool->tail)
+        a->pool->tail->next = job;
+    else
+        a->pool->head = job;
+    a->pool->tail = job;
+    a->pool->pending += 1;
+}
+
+static void include_prefetch_job(include_pool_t *pool, include_job_t *job)
+{
+    uint32_t hash;
+    struct stat st;
+    char *resolved;
+    fluid_t *sub_ctx;
+    include_entry_t *e;
+    struct include_enqueue_arg arg = { .pool = pool };
+
+    resolved = include_realpath(job->dirname, job->file, &st);
+    if (resolved == NULL) {
+        /* include_resolve() will report this if it is really needed */
+        return;
+    }
+    hash = include_hash(resolved);
+
+    pthread_mutex_lock(&pool->lock);
+    e = include_cache_lookup(pool->cache, resolved, hash, &st);
+    if (e) {
+        pthread_mutex_unlock(&pool->lock);
+        free(resolved);
+        return;
+    }
+    /* claim it so other workers skip this file */
+    e = include_cache_insert(pool->cache, resolved, hash, &st, NULL);
+    e->state = INCLUDE_ENTRY_LOADING;
+    pthread_mutex_unlock(&pool->lock);
+
+    sub_ctx = include_load(pool->cache, resolved);
+
+    pthread_mutex_lock(&pool->lock);
+    e->ctx = sub_ctx;
+    e->state = sub_ctx ? INCLUDE_ENTRY_LEXED : INCLUDE_ENTRY_FAILED;
+    if (sub_ctx) {
+        arg.dirname = sub_ctx->dirname;
+        include_foreach(sub_ctx, include_enqueue, &arg);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *include_worker(void *arg)
+{
+    include_job_t *job;
+    include_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && pool->pending > 0)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->head == NULL)
+            break; /* nothing queued and nothing in flight; all done */
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        include_prefetch_job(pool, job);
+        safe_free(job->file);
+        safe_free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= 1;
+        /* new jobs may have been queued, or we may be all done */
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int include_prefetch(fluid_t *ctx, int jobs)
+{
+    int i, n = 0;
+    pthread_t threads[INCLUDE_MAX_JOBS];
+    include_pool_t pool = { .head = NULL };
+    struct include_enqueue_arg arg = { .pool = &pool, .dirname = ctx->dirname };
+
+    if (jobs > INCLUDE_MAX_JOBS)
+        jobs = INCLUDE_MAX_JOBS;
+    if (jobs <= 1)
+        return 0;
+
+    include_foreach(ctx, include_enqueue, &arg);
+    if (pool.pending == 0)
+        return 0;
+
+    pool.cache = include_cache_setup(ctx, INCLUDE_MAX_DEPTH_DEFAULT);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[n], NULL, include_worker, &pool) == 0)
+            n++;
+    }
+    if (n == 0) /* no threads; do it ourselves */
+        include_worker(&pool);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _INCLUDE_H_
+#define _INCLUDE_H_
+
+#include "fluid.h"
+
+/**
+ * @brief Cache of lexed and preprocessed partials, keyed by the resolved
+ * path of the file and validated against its inode and mtime. A partial
+ * that is included many times is read, lexed and preprocessed only once;
+ * each include splices in a copy of its block vector (the spans still
+ * point into the cached partial, which the cache keeps alive).
+ */
+typedef struct include_cache_s include_cache_t;
+
+#define INCLUDE_MAX_DEPTH_DEFAULT      64
+
+include_cache_t *include_cache_new(int max_depth);
+void include_cache_free(include_cache_t *cache);
+
+/**
+ * Create the include cache of a top level template, if it doesn't have
+ * one already; a max_depth <= 0 picks INCLUDE_MAX_DEPTH_DEFAULT.
+ */
+include_cache_t *include_cache_setup(fluid_t *ctx, int max_depth);
+
+/**
+ * Resolve `file` relative to ctx->dirname and return the preprocessed
+ * context for it, loading it on a cache miss. The returned context is
+ * owned by the cache. Fails with the include chain logged if `file` is
+ * already being expanded (a cycle) or the chain gets deeper than the
+ * cache's max_depth.
+ */
+fluid_t *include_resolve(fluid_t *ctx, const char *file);
+
+/**
+ * Walk the include graph of a lexed template and load/lex all distinct
+ * partials concurrently on `jobs` threads, filling ctx's include cache.
+ * Preprocessing (and the ordered splice of partials) is left to
+ * fluid_preprocessor(), which then finds everything in the cache. This is
+ * best-effort; a partial that fails to load is logged by the worker and
+ * kept as failed, so include_resolve() fails on it without loading it
+ * again. Other errors are left to include_resolve().
+ */
+int include_prefetch(fluid_t *ctx, int jobs);
+
+#endif /* _INCLUDE_H_ */
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "scan.h"
+
+/**
+ * JSON config reader. The input is read once, front to back, and objects
+ * are built as their values are parsed; there are no tokens in between.
+ * Runs of plain string bytes are found with scan_string() (SIMD where the
+ * CPU has it) and copied straight into the string or key that owns them,
+ * and most numbers are converted without strtod().
+ *
+ * Values of keys that are not wanted (see config_parse_json_buf()) are
+ * only checked, not built. The whole input is always checked, as it is
+ * for YAML.
+ */
+
+#define JSON_MAX_DEPTH                 512
+#define JSON_FAST_DIGITS               15  /* 10^15 < 2^53: exact as double */
+
+typedef struct {
+    const char *buf;
+    const char *p;
+    const char *end;
+    size_t depth;
+    const char *error;        /* what went wrong, at p */
+} json_reader_t;
+
+static const double json_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int json_fail(json_reader_t *r, const char *error)
+{
+    if (r->error == NULL)
+        r->error = error;
+    return -1;
+}
+
+static void json_ws(json_reader_t *r)
+{
+    while (r->p < r->end &&
+           (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t'))
+        r->p++;
+}
+
+static bool json_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int json_hex4(const char *p, uint32_t *out)
+{
+    int i;
+    char c;
+
+    *out = 0;
+    for (i = 0; i < 4; i++) {
+        c = p[i];
+        *out <<= 4;
+        if (c >= '0' && c <= '9')
+            *out |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *out |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *out |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+static size_t json_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* Decode the escape at *p (just after the '\') into out */
+static int json_escape(json_reader_t *r, const char **p, char *out,
+                       size_t *len)
+{
+    static const char from[] = "\"\\/bfnrt", to[] = "\"\\/\b\f\n\r\t";
+    const char *s = *p, *c;
+    uint32_t cp, lo;
+
+    c = strchr(from, *s);
+    if (*s != '\0' && c != NULL) {
+        *out = to[c - from];
+        *len = 1;
+        *p = s + 1;
+        return 0;
+    }
+    if (*s != 'u' || r->end - s < 5 || json_hex4(s + 1, &cp) != 0)
+        return json_fail(r, "bad escape in string");
+    s += 5;
+    if (cp >= 0xdc00 && cp <= 0xdfff)
+        return json_fail(r, "lone surrogate in string");
+    if (cp >= 0xd800 && cp <= 0xdbff) {
+        if (r->end - s < 6 || s[0] != '\\' || s[1] != 'u' ||
+            json_hex4(s + 2, &lo) != 0 || lo < 0xdc00 || lo > 0xdfff)
+            return json_fail(r, "lone surrogate in string");
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        s += 6;
+    }
+    *len = json_utf8(out, cp);
+    *p = s;
+    return 0;
+}
+
+/**
+ * Read the string at r->p (on the opening quote). If `out` is not NULL,
+ * it is set to a new copy, unescaped and NUL terminated. An escape never
+ * decodes to more bytes than it takes up, so the raw length is enough.
+ * Escapes are checked either way.
+ */
+static int json_string(json_reader_t *r, char **out, size_t *out_len)
+{
+    const char *start = r->p + 1, *p = start, *run;
+    bool escaped = false;
+    size_t n, len;
+    char *buf, *dst, scratch[4];
+
+    for (;;) {
+        p += scan_string(p, r->end - p);
+        if (p >= r->end)
+            return json_fail(r, "unterminated string");
+        if (*p == '"')
+            break;
+        if (*p != '\\') {
+            r->p = p;
+            return json_fail(r, "control character in string");
+        }
+        if (r->end - p < 2)
+            return json_fail(r, "unterminated string");
+        escaped = true;
+        p += 2;
+    }
+    r->p = p + 1;
+    if (!escaped) {
+        if (out != NULL) {
+            *out = safe_malloc(p - start + 1);
+            memcpy(*out, start, p - start);
+            *out_len = p - start;
+            (*out)[*out_len] = '\0';
+        }
+        return 0;
+    }
+
+    /* a skipped string is decoded into scratch, just to check it */
+    buf = dst = out ? safe_malloc(p - start + 1) : NULL;
+    for (run = start; run < p; ) {
+        n = scan_string(run, p - run);
+        if (buf != NULL) {
+            memcpy(dst, run, n);
+            dst += n;
+        }
+        run += n;
+        if (run == p)
+            break;
+        run++; /* the '\' */
+        if (json_escape(r, &run, buf ? dst : scratch, &len) != 0) {
+            r->p = run;
+            safe_free(buf);
+            return -1;
+        }
+        if (buf != NULL)
+            dst += len;
+    }
+    if (buf != NULL) {
+        *out = buf;
+        *out_len = dst - buf;
+        *dst = '\0';
+    }
+    return 0;
+}
+
+/**
+ * -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+ *
+ * With at most JSON_FAST_DIGITS digits and a small enough exponent, both
+ * the digits and the power of 10 are exact as doubles and one multiply or
+ * divide gives the correctly rounded result. Anything else goes through
+ * strtod().
+ */
+static int json_number(json_reader_t *r, double *out)
+{
+    const char *p = r->p, *start = r->p;
+    uint64_t mant = 0;
+    int digits = 0, scale = 0, exp = 0, exp_sign = 1;
+    bool neg = false;
+    char tmp[64], *copy;
+
+    if (*p == '-') {
+        neg = true;
+        p++;
+    }
+    if (p >= r->end || !json_is_digit(*p))
+        return json_fail(r, "bad number");
+    if (*p == '0') {
+        p++;
+    }
+    else {
+        for (; p < r->end && json_is_digit(*p); p++, digits++)
+            mant = mant * 10 + (*p - '0');
+    }
+    if (p < r->end && *p == '.') {
+        p++;
+        if (p >= r->end || !json_is_digit(*p))
+            return json_fail(r, "bad number");
+        for (; p < r->end && json_is_digit(*p); p++, digits++, scale++)
+            mant = mant * 10 + (*p - '0');
+    }
+    if (p < r->end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < r->end && (*p == '+' || *p == '-'))
+            exp_sign = (*p++ == '-') ? -1 : 1;
+        if (p >= r->end || !json_is_digit(*p))
+            return json_fail(r, "bad number");
+        for (; p < r->end && json_is_digit(*p); p++) {
+            if (exp < 10000)
+                exp = exp * 10 + (*p - '0');
+        }
+    }
+    r->p = p;
+
+    exp = exp * exp_sign - scale;
+    if (digits <= JSON_FAST_DIGITS && exp >= -22 && exp <= 22) {
+        *out = (exp < 0) ? (double)mant / json_pow10[-exp] :
+                           (double)mant * json_pow10[exp];
+        if (neg)
+            *out = -*out;
+        return 0;
+    }
+
+    /* the input is not NUL terminated; strtod() needs a copy */
+    copy = (size_t)(p - start) < sizeof(tmp) ? tmp :
+           safe_malloc(p - start + 1);
+    memcpy(copy, start, p - start);
+    copy[p - start] = '\0';
+    *out = strtod(copy, NULL);
+    if (copy != tmp)
+        safe_free(copy);
+    return 0;
+}
+
+static int json_literal(json_reader_t *r, const char *word)
+{
+    size_t len = strlen(word);
+
+    if ((size_t)(r->end - r->p) < len || memcmp(r->p, word, len) != 0)
+        return json_fail(r, "unexpected character");
+    r->p += len;
+    return 0;
+}
+
+static int json_value(json_reader_t *r, fobject_t **out, fobject_t *want);
+
+/* `want` is what to keep of the object; NULL for everything */
+static int json_object(json_reader_t *r, fobject_t **out, fobject_t *want)
+{
+    char *key;
+    size_t len;
+    fobject_t *obj = NULL, *item, *sub, **dst;
+
+    r->p++;
+    if (out != NULL) {
+        obj = fdict_new();
+        *out = obj;
+    }
+    json_ws(r);
+    if (r->p < r->end && *r->p == '}') {
+        r->p++;
+        return 0;
+    }
+    for (;;) {
+        if (r->p >= r->end || *r->p != '"')
+            return json_fail(r, "expected a key");
+        key = NULL;
+        if (json_string(r, obj ? &key : NULL, &len) != 0)
+            return -1;
+        json_ws(r);
+        if (r->p >= r->end || *r->p != ':') {
+            safe_free(key);
+            return json_fail(r, "expected ':'");
+        }
+        r->p++;
+        json_ws(r);
+
+        sub = NULL;
+        dst = key ? &item : NULL;
+        if (key && want) {
+            sub = fdict_lookup(want, key, len, fdict_hash(key, len));
+            if (sub == NULL) {
+                safe_free(key);
+                key = NULL;
+                dst = NULL;
+            }
+        }
+        item = NULL;
+        if (json_value(r, dst, (sub && sub->type == FTYPE_DICT) ?
+                               sub : NULL) != 0) {
+            safe_free(key);
+            DEC_REF(item);
+            return -1;
+        }
+        if (dst != NULL) {
+            fdict_insert_owned(obj, key, len, item);
+            DEC_REF(item);
+        }
+
+        json_ws(r);
+        if (r->p < r->end && *r->p == ',') {
+            r->p++;
+            json_ws(r);
+            continue;
+        }
+        if (r->p < r->end && *r->p == '}') {
+            r->p++;
+            return 0;
+        }
+        return json_fail(r, "expected ',' or '}'");
+    }
+}
+
+/* Items keep what `want` says, like the list itself */
+static int json_array(json_reader_t *r, fobject_t **out, fobject_t *want)
+{
+    fobject_t *item;
+
+    r->p++;
+    if (out != NULL)
+        *out = flist_new(0);
+    json_ws(r);
+    if (r->p < r->end && *r->p == ']') {
+        r->p++;
+        return 0;
+    }
+    for (;;) {
+        item = NULL;
+        if (json_value(r, out ? &item : NULL, want) != 0) {
+            DEC_REF(item);
+            return -1;
+        }
+        if (out != NULL) {
+            flist_append(*out, item);
+            DEC_REF(item);
+        }
+        json_ws(r);
+        if (r->p < r->end && *r->p == ',') {
+            r->p++;
+            json_ws(r);
+            continue;
+        }
+        if (r->p < r->end && *r->p == ']') {
+            r->p++;
+            return 0;
+        }
+        return json_fail(r, "expected ',' or ']'");
+    }
+}
+
+/* Parse the value at r->p into *out; if out is NULL, just skip it */
+static int json_value(json_reader_t *r, fobject_t **out, fobject_t *want)
+{
+    int ret;
+    char *str;
+    size_t len;
+    double num;
+    bool val;
+
+    if (r->p >= r->end)
+        return json_fail(r, "unexpected end of input");
+
+    switch (*r->p) {
+    case '{':
+    case '[':
+        if (++r->depth > JSON_MAX_DEPTH)
+            return json_fail(r, "nested too deep");
+        ret = (*r->p == '{') ? json_object(r, out, want) :
+                               json_array(r, out, want);
+        r->depth--;
+        return ret;
+    case '"':
+        if (json_string(r, out ? &str : NULL, &len) != 0)
+            return -1;
+        if (out != NULL)
+            *out = fobj_from_owned_string(str, len);
+        return 0;
+    case 't':
+    case 'f':
+        val = *r->p == 't';
+        if (json_literal(r, val ? "true" : "false") != 0)
+            return -1;
+        if (out != NULL)
+            *out = fobj_from_bool(val);
+        return 0;
+    case 'n':
+        if (json_literal(r, "null") != 0)
+            return -1;
+        if (out != NULL)
+            *out = __fobj_new(FTYPE_NIL);
+        return 0;
+    default:
+        if (*r->p != '-' && !json_is_digit(*r->p))
+            return json_fail(r, "unexpected character");
+        if (json_number(r, &num) != 0)
+            return -1;
+        if (out != NULL)
+            *out = fobj_from_double(num);
+        return 0;
+    }
+}
+
+static size_t json_line(json_reader_t *r)
+{
+    const char *p;
+    size_t line = 1;
+
+    for (p = r->buf; p < r->p && p < r->end; p++) {
+        if (*p == '\n')
+            line++;
+    }
+    return line;
+}
+
+ferror_t config_parse_json_buf(const char *input, size_t length,
+                               fobject_t **root, fobject_t *only)
+{
+    json_reader_t r;
+    fobject_t *obj = NULL;
+
+    memset(&r, 0, sizeof(json_reader_t));
+    r.buf = r.p = input;
+    r.end = input + length;
+
+    json_ws(&r);
+    if (r.p == r.end) {
+        /* an empty document is an empty config, as with YAML */
+        *root = fdict_new();
+        return FERROR_OK;
+    }
+    if (*r.p != '{') {
+        /* the root must be an object */
+        fexcept(FERROR_OBJECT_TYPE);
+    }
+    if (json_value(&r, &obj, only) == 0) {
+        json_ws(&r);
+        if (r.p != r.end)
+            json_fail(&r, "trailing characters");
+    }
+    if (r.error != NULL) {
+        DEC_REF(obj);
+        fexcept_print(FERROR_CONFIG_PARSER);
+        fprintf(stderr, "EXCEPTION: %s at line %zu\n", r.error, json_line(&r));
+        return FERROR_CONFIG_PARSER;
+    }
+    *root = obj;
+    return FERROR_OK;
+}
@@ -8,354 +8,727 @@
 
 #include "fluid.h"
 #include "lexer.h"
+#include "scan.h"
 
 LOGGER_MODULE_EXTERN(fluid, lexer);
 
-enum lexer_state {
-    LEXER_BLOCK_STATE_DATA,
-    LEXER_BLOCK_STATE_OBJECT,
-    LEXER_BLOCK_STATE_TAG,
-    LEXER_BLOCK_STATE_ERROR,
-};
+#define LEXER_BLOCKS_INITIAL_CAPACITY  64
 
-/* Transform "{% TAG %}" or "{{ OBJ }}" as "TAG" or "OBJ" */
-static int lexer_clean_liquid_markup(char *buf, size_t len)
+void lexer_blocks_init(lexer_blocks_t *b)
 {
-    buf[0] = ' ';
-    buf[1] = ' ';
-    buf[len - 2] = ' ';
-    buf[len - 1] = ' ';
-    return strip(buf);
+    memset(b, 0, sizeof(lexer_blocks_t));
 }
 
-static void lexer_block_free(lexer_block_t *blk)
+void lexer_blocks_free(lexer_blocks_t *b)
 {
-    if (blk->type == LEXER_BLOCK_TAG) {
-        safe_free(blk->tok.tag.tokens);
-    }
-    else if (blk->type == LEXER_BLOCK_OBJECT) {
-        safe_free(blk->tok.obj.identifier);
-        safe_free(blk->tok.obj.filters);
-    }
-    string_destroy(&blk->content);
-    safe_free(blk);
+    safe_free(b->types);
+    safe_free(b->spans);
+    safe_free(b->toks);
+    lexer_blocks_init(b);
 }
 
-void lexer_remove_block(fluid_t *ctx, lexer_block_t *blk)
+static void lexer_blocks_reserve(lexer_blocks_t *b, size_t count)
 {
-    list_remove_node(&ctx->lex_blocks, &blk->node);
-    lexer_block_free(blk);
+    size_t capacity;
+
+    if (count <= b->capacity)
+        return;
+
+    capacity = b->capacity ? b->capacity : LEXER_BLOCKS_INITIAL_CAPACITY;
+    while (capacity < count)
+        capacity *= 2;
+
+    b->types = safe_realloc(b->types, capacity * sizeof(uint8_t));
+    b->spans = safe_realloc(b->spans, capacity * sizeof(lexer_span_t));
+    b->toks = safe_realloc(b->toks, capacity * sizeof(lexer_token_t));
+    b->capacity = capacity;
 }
 
-int lexer_merge_blocks(fluid_t *ctx, lexer_block_t *b1, lexer_block_t *b2)
+/* Append blocks [start, end) of src to dst */
+void lexer_blocks_append_range(lexer_blocks_t *dst, lexer_blocks_t *src,
+                               size_t start, size_t end)
 {
-    if (b1->type != b2->type)
-        return -1;
+    size_t n = end - start;
 
-    /* b1 and b2 are in order. So merge as-is and swap so b1 can be free-ed */
-    if (string_merge(&b1->content, &b2->content)) {
-        return -1;
-    }
-    memcpy(&b2->content, &b1->content, sizeof(string_t));
-    b1->content.buf = NULL; // clear as it is now held in b2.content.buf
-    lexer_remove_block(ctx, b1);
-    return 0;
+    if (start >= end)
+        return;
+
+    lexer_blocks_reserve(dst, dst->count + n);
+    memcpy(dst->types + dst->count, src->types + start,
+           n * sizeof(uint8_t));
+    memcpy(dst->spans + dst->count, src->spans + start,
+           n * sizeof(lexer_span_t));
+    memcpy(dst->toks + dst->count, src->toks + start,
+           n * sizeof(lexer_token_t));
+    dst->count += n;
 }
 
-void lexer_block_cast_to_data(lexer_block_t *blk)
+void lexer_includes_free(lexer_includes_t *inc)
 {
-    if (blk->type == LEXER_BLOCK_TAG) {
-        safe_free(blk->tok.tag.tokens);
-    }
-    else if (blk->type == LEXER_BLOCK_OBJECT) {
-        safe_free(blk->tok.obj.identifier);
-        safe_free(blk->tok.obj.filters);
+    safe_free(inc->idx);
+    memset(inc, 0, sizeof(lexer_includes_t));
+}
+
+/**
+ * Append src[0..count) to segs[] (if not NULL), widening the last segment
+ * instead when the two are adjacent in the same buffer. Returns the new
+ * segment count.
+ */
+static int lexer_rope_append(const lexer_span_t *src, int count,
+                             lexer_span_t *segs, int n)
+{
+    int j;
+    lexer_span_t last = { 0 };
+
+    if (n && segs)
+        last = segs[n - 1];
+    for (j = 0; j < count; j++) {
+        if (n && last.buf + last.len == src[j].buf) {
+            last.len += src[j].len;
+        } else {
+            last = src[j];
+            n += 1;
+        }
+        if (segs)
+            segs[n - 1] = last;
     }
-    blk->type = LEXER_BLOCK_DATA;
+    return n;
 }
 
-static int
-lexer_block_add(fluid_t *ctx, enum lexer_block type, size_t pos, size_t len)
+static int lexer_rope_append_block(lexer_blocks_t *b, size_t i,
+                                   lexer_span_t *segs, int n)
 {
-    lexer_block_t *blk;
+    int count;
+    lexer_span_t *src;
 
-    if (len <= 0 || type <= LEXER_BLOCK_NONE ||
-        type >= LEXER_BLOCK_SENTINEL) {
-        return -1;
+    count = lexer_block_segments(b, i, &src);
+    return lexer_rope_append(src, count, segs, n);
+}
+
+/* Make data block `i` of b hold segs[0..n) of total length len */
+static void lexer_block_set_rope(fluid_t *ctx, lexer_blocks_t *b, size_t i,
+                                 const lexer_span_t *segs, int n, size_t len)
+{
+    memset(&b->toks[i], 0, sizeof(lexer_token_t));
+    if (n == 1) {
+        b->spans[i] = segs[0];
+        return;
     }
+    b->spans[i].buf = NULL;
+    b->spans[i].len = len;
+    b->toks[i].data.segs = arena_alloc(&ctx->arena, n * sizeof(lexer_span_t));
+    memcpy(b->toks[i].data.segs, segs, n * sizeof(lexer_span_t));
+    b->toks[i].data.num_segs = n;
+}
 
-    blk = safe_calloc(1, sizeof(lexer_block_t));
-    blk->type = type;
-    string_create(&blk->content, ctx->buf + pos, len);
-    list_append(&ctx->lex_blocks, &blk->node);
-    return 0;
+void lexer_blocks_splice(fluid_t *ctx, lexer_blocks_t *dst,
+                         lexer_blocks_t *src, size_t start, size_t end)
+{
+    int n;
+    size_t last;
+    lexer_span_t *segs;
+
+    if (start < end && dst->count &&
+        dst->types[dst->count - 1] == LEXER_BLOCK_DATA &&
+        src->types[start] == LEXER_BLOCK_DATA)
+    {
+        last = dst->count - 1;
+        n = lexer_rope_append_block(dst, last, NULL, 0);
+        n = lexer_rope_append_block(src, start, NULL, n);
+        segs = arena_alloc(&ctx->arena, n * sizeof(lexer_span_t));
+        n = lexer_rope_append_block(dst, last, segs, 0);
+        n = lexer_rope_append_block(src, start, segs, n);
+        lexer_block_set_rope(ctx, dst, last, segs, n,
+                             dst->spans[last].len + src->spans[start].len);
+        start += 1;
+    }
+    lexer_blocks_append_range(dst, src, start, end);
+}
+
+/* Append a block to b and return its index */
+static size_t lexer_blocks_push(lexer_blocks_t *b, enum lexer_block type,
+                                const char *buf, size_t len)
+{
+    lexer_blocks_reserve(b, b->count + 1);
+    b->types[b->count] = type;
+    b->spans[b->count].buf = buf;
+    b->spans[b->count].len = len;
+    memset(&b->toks[b->count], 0, sizeof(lexer_token_t));
+    return b->count++;
 }
 
-static void lexer_free_blocks(fluid_t *ctx)
+#define LEXER_TOK_SCRATCH_INITIAL    16
+
+#define IS_SPACE(c)    ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define IS_QUOTE(c)    ((c) == '"' || (c) == '\'')
+#define IS_OPERATOR(c) ((c) == '=' || (c) == '!' || (c) == '<' || (c) == '>')
+#define IS_PUNCT(c)    ((c) == '|' || (c) == ':' || (c) == ',' ||              \
+                        (c) == '(' || (c) == ')')
+#define IS_DIGIT(c)    ((c) >= '0' && (c) <= '9')
+
+static bool lexer_span_is_number(const char *p, size_t len)
 {
-    lexer_block_t *blk;
-    node_t *p;
-
-    p = ctx->lex_blocks.head;
-    while (p) {
-        blk = CONTAINER_OF(p, lexer_block_t, node);
-        p = p->next;
-        lexer_block_free(blk);
+    size_t i = 0, digits = 0;
+
+    if (i < len && (p[i] == '+' || p[i] == '-'))
+        i++;
+    while (i < len && IS_DIGIT(p[i])) {
+        i++; digits++;
+    }
+    if (i < len && p[i] == '.') {
+        i++;
+        while (i < len && IS_DIGIT(p[i])) {
+            i++; digits++;
+        }
     }
+    if (digits && i < len && (p[i] == 'e' || p[i] == 'E')) {
+        i++;
+        if (i < len && (p[i] == '+' || p[i] == '-'))
+            i++;
+        if (i >= len || !IS_DIGIT(p[i]))
+            return false;
+        while (i < len && IS_DIGIT(p[i]))
+            i++;
+    }
+    return digits && i == len;
 }
 
-int lexer_lex_blocks(fluid_t *ctx)
+/**
+ * Split the body of a tag/object (between the delimiters) into typed
+ * tokens in a single pass. Tokens are spans over the source; the only
+ * memory touched is ctx->tok_scratch, which is reused for every block.
+ * Returns the number of tokens or -1 on syntax errors.
+ */
+static int lexer_scan_tokens(fluid_t *ctx, const char *p, const char *end)
 {
-    char c1, c2;
-    size_t current = 0, start = 0;
-    enum lexer_state state = LEXER_BLOCK_STATE_DATA;
-
-    while (current < (ctx->buf_size - 1)) {
-        c1 = ctx->buf[current];
-        c2 = ctx->buf[current + 1];
-        switch(state) {
-        case LEXER_BLOCK_STATE_DATA:
-            if (c1 == '{' && c2 == '%') {
-                lexer_block_add(ctx, LEXER_BLOCK_DATA, start,
-                        current - start);
-                start = current;
-                state = LEXER_BLOCK_STATE_TAG;
-                break;
-            }
-            if (c1 == '{' && c2 == '{') {
-                lexer_block_add(ctx, LEXER_BLOCK_DATA, start,
-                        current - start);
-                start = current;
-                state = LEXER_BLOCK_STATE_OBJECT;
-                break;
-            }
-            break;
-        case LEXER_BLOCK_STATE_TAG:
-            if (c1 == '%' && c2 == '}') {
-                /* +2 to include `%}` in current block */
-                lexer_block_add(ctx, LEXER_BLOCK_TAG, start,
-                        current - start + 2);
-                start = current + 2;
-                state = LEXER_BLOCK_STATE_DATA;
-            }
+    size_t n = 0;
+    const char *start;
+    lexer_tok_t *tok;
+    lexer_tok_scratch_t *s = &ctx->tok_scratch;
+
+    while (1) {
+        while (p < end && IS_SPACE(*p))
+            p++;
+        if (p >= end)
             break;
-        case LEXER_BLOCK_STATE_OBJECT:
-            if (c1 == '}' && c2 == '}') {
-                /* +2 to include `}}` in current block */
-                lexer_block_add(ctx, LEXER_BLOCK_OBJECT, start,
-                        current - start + 2);
-                start = current + 2;
-                state = LEXER_BLOCK_STATE_DATA;
+
+        if (n == s->capacity) {
+            s->capacity = s->capacity ? s->capacity * 2 :
+                                        LEXER_TOK_SCRATCH_INITIAL;
+            s->toks = safe_realloc(s->toks, s->capacity * sizeof(lexer_tok_t));
+        }
+        tok = &s->toks[n++];
+        start = p;
+
+        if (IS_QUOTE(*p)) {
+            p = memchr(p + 1, *start, end - p - 1);
+            if (p == NULL) {
+                LOG_ERR("unterminated string literal");
+                return -1;
             }
-            break;
-        case LEXER_BLOCK_STATE_ERROR:
-            break;
+            tok->type = LEXER_TOK_STRING;
+            tok->span.buf = start + 1;
+            tok->span.len = p - start - 1;
+            p += 1;
+            continue;
         }
-        current += 1;
-    }
-    if (state != LEXER_BLOCK_STATE_DATA) {
-        /* at the end we must always be at a data block */
-        return -1;
+
+        if (IS_OPERATOR(*p)) {
+            p++;
+            if (p < end && (*p == '=' || (*start == '<' && *p == '>')))
+                p++;
+            tok->type = LEXER_TOK_OPERATOR;
+        }
+        else if (IS_PUNCT(*p)) {
+            p++;
+            tok->type = LEXER_TOK_PUNCT;
+        }
+        else {
+            while (p < end && !IS_SPACE(*p) && !IS_QUOTE(*p) &&
+                   !IS_OPERATOR(*p) && !IS_PUNCT(*p))
+                p++;
+            tok->type = lexer_span_is_number(start, p - start) ?
+                        LEXER_TOK_NUMBER : LEXER_TOK_WORD;
+        }
+        tok->span.buf = start;
+        tok->span.len = p - start;
     }
-    /* if there tailing chars, create a new block from them */
-    lexer_block_add(ctx, LEXER_BLOCK_DATA, start, current - start);
-    return 0;
+    return (int)n;
 }
 
-int lexer_filter_parse(liq_filter_t *f, char *str)
+/**
+ * Parse a filter, `name[: arg1[, arg2]]`, from toks[0..count). Returns the
+ * number of tokens consumed or -1.
+ */
+static int lexer_filter_parse(liq_filter_t *f, lexer_tok_t *toks, int count)
 {
-    char *tok, args;
-    int len, i;
+    int i, args, pos = 0;
+    lexer_tok_t *t;
 
-    if((tok = strsep(&str, ":")) == NULL)
+    if (count <= 0 || toks[0].type != LEXER_TOK_WORD)
         return -1;
 
-    lstrip_soft(tok); rstrip(tok);
-    if ((f->id = get_filter_id(tok)) == LIQ_FILTER_NONE)
+    f->id = get_filter_id(toks[0].span.buf, toks[0].span.len);
+    if (f->id == LIQ_FILTER_NONE)
         return -1;
+    pos = 1;
 
     args = liq_filter_arg_count(f->id);
 
-    if (strisempty(str)) {
+    if (pos >= count || !lexer_tok_is_punct(&toks[pos], ':')) {
         if (args != 0)
             return -1;
-        return 0;
+        return pos;
     }
+    pos += 1; /* skip ':' */
 
     for (i = 0; i < args; i++) {
-        if((tok = strsep(&str, ",")) == NULL)
+        if (i > 0) {
+            if (pos >= count || !lexer_tok_is_punct(&toks[pos], ','))
+                return -1;
+            pos += 1;
+        }
+        if (pos >= count)
             return -1;
-
-        lstrip_soft(tok); len = rstrip(tok);
-        if (len > LIQ_FILTER_ARG_MAXLEN)
+        t = &toks[pos++];
+        if (t->type == LEXER_TOK_PUNCT || t->type == LEXER_TOK_OPERATOR ||
+            t->span.len > LIQ_FILTER_ARG_MAXLEN)
             return -1;
-
-        strncpy(f->args[i], tok, LIQ_FILTER_ARG_MAXLEN);
+        memcpy(f->args[i], t->span.buf, t->span.len);
+        f->args[i][t->span.len] = '\0';
     }
 
-    if (!strisempty(str))
-        return -1;
-
-    return 0;
+    return pos;
 }
 
-int lexer_tokenize_tag(lexer_block_t *blk)
-{
-    int len;
-    char *tok, *p, *f, buf[256];
+/* the body of "{% TAG %}" or "{{ OBJ }}" is "TAG" or "OBJ" */
+#define MARKUP_BODY(s)        ((s)->buf + 2)
+#define MARKUP_BODY_END(s)    ((s)->buf + (s)->len - 2)
 
-    if (blk->content.max_len >= 256) {
-        LOG_ERR("object too large");
-        return -1;
-    }
+int lexer_tokenize_tag(fluid_t *ctx, lexer_span_t *span, lexer_token_t *tok)
+{
+    int n, i, ret;
+    lexer_tok_t *toks;
 
-    p = buf;
-    strncpy(buf, blk->content.buf, blk->content.len);
-    buf[blk->content.len] = '\0';
-    if (lexer_clean_liquid_markup(buf, blk->content.len) == 0)
+    if (span->len < 4)
         return -1;
 
-    if ((tok = strsep(&p, " ")) == NULL) {
+    n = lexer_scan_tokens(ctx, MARKUP_BODY(span), MARKUP_BODY_END(span));
+    if (n <= 0 || ctx->tok_scratch.toks[0].type != LEXER_TOK_WORD) {
         LOG_ERR("failed to extract keyword");
         return -1;
     }
-    lstrip_soft(tok); rstrip(tok);
-    blk->tok.tag.keyword = liquid_get_kw(tok);
+    toks = ctx->tok_scratch.toks;
+    tok->tag.keyword = liquid_get_kw(toks[0].span.buf, toks[0].span.len);
 
-    if (p && (f = strchr(p, '|')) != NULL) {
-        f[0] = '\0';
-        lstrip_soft(f); len = rstrip(f);
-        if (!len || lexer_filter_parse(&blk->tok.tag.filter, f)) {
+    /* arguments run up to an optional '|' that introduces a filter */
+    for (i = 1; i < n; i++) {
+        if (lexer_tok_is_punct(&toks[i], '|'))
+            break;
+    }
+    if (i < n) {
+        ret = lexer_filter_parse(&tok->tag.filter, toks + i + 1, n - i - 1);
+        if (ret < 0 || i + 1 + ret != n) {
             LOG_ERR("tag filter syntax error");
             return -1;
         }
     }
 
-    if (p && split_string(p, " ", &blk->tok.tag.tokens)) {
-        LOG_ERR("tag parse errors");
-        return -1;
+    tok->tag.num_tokens = i - 1;
+    if (tok->tag.num_tokens) {
+        tok->tag.tokens = arena_alloc(&ctx->arena,
+                                      (i - 1) * sizeof(lexer_tok_t));
+        memcpy(tok->tag.tokens, toks + 1, (i - 1) * sizeof(lexer_tok_t));
     }
 
     return 0;
 }
 
-int lexer_tokenize_object(lexer_block_t *blk)
+int lexer_tokenize_object(fluid_t *ctx, lexer_span_t *span, lexer_token_t *tok)
 {
-    int i = 0;
-    int num_filters;
-    liq_filter_t *filters, *filter;
-    char *tok, *p, buf[256];
+    int i, n, ret, num_filters = 0;
+    liq_filter_t *filters;
+    lexer_tok_t *toks;
 
-    if (blk->content.max_len >= 256) {
-        LOG_ERR("object too large");
+    if (span->len < 4)
         return -1;
-    }
 
-    p = buf;
-    strncpy(buf, blk->content.buf, blk->content.len);
-    buf[blk->content.len] = '\0';
-    if (lexer_clean_liquid_markup(buf, blk->content.len) == 0)
-        return -1;
-
-    if ((tok = strsep(&p, " ")) == NULL) {
+    n = lexer_scan_tokens(ctx, MARKUP_BODY(span), MARKUP_BODY_END(span));
+    if (n <= 0 || ctx->tok_scratch.toks[0].type == LEXER_TOK_PUNCT ||
+        ctx->tok_scratch.toks[0].type == LEXER_TOK_OPERATOR) {
         LOG_ERR("failed to extract identifier");
         return -1;
     }
-    blk->tok.obj.identifier = safe_strdup(tok);
+    toks = ctx->tok_scratch.toks;
+    tok->obj.identifier = toks[0];
 
-    if (strisempty(p))
+    if (n == 1)
         return 0;
 
-    if (*p != '|') {
-        LOG_ERR("object found '%s' in place of filters", p);
+    if (!lexer_tok_is_punct(&toks[1], '|')) {
+        LOG_ERR("object found '%.*s' in place of filters",
+                (int)toks[1].span.len, toks[1].span.buf);
         return -1;
     }
-    p += 1; /* skip the leading '|' */
-    num_filters = 1 + strcntchr(p, '|');
-    filters = filter = safe_calloc(num_filters, sizeof(liq_filter_t));
-    while (i < num_filters && (tok = strsep(&p, "|")) != NULL) {
-        lstrip_soft(tok);
-        if (strisempty(tok))
-            break;
-        if (lexer_filter_parse(filter, tok)) {
+    for (i = 1; i < n; i++) {
+        if (lexer_tok_is_punct(&toks[i], '|'))
+            num_filters += 1;
+    }
+
+    filters = arena_calloc(&ctx->arena, num_filters, sizeof(liq_filter_t));
+    i = 1;
+    while (i < n) {
+        /* toks[i] must be the '|' that introduces the next filter */
+        if (!lexer_tok_is_punct(&toks[i], '|'))
+            ret = -1;
+        else
+            ret = lexer_filter_parse(&filters[tok->obj.num_filters],
+                                     toks + i + 1, n - i - 1);
+        if (ret < 0) {
             LOG_ERR("object filter syntax error");
-            break;
+            return -1;
         }
-        filter += 1;
-        i += 1;
+        tok->obj.num_filters += 1;
+        i += 1 + ret;
     }
 
-    if (i != num_filters) {
-        safe_free(filters);
-        return -1;
+    tok->obj.filters = filters;
+    return 0;
+}
+
+/* --- Streaming lexer --- */
+
+void lexer_stream_init(lexer_stream_t *s, lexer_stream_emit_t emit, void *arg)
+{
+    memset(s, 0, sizeof(lexer_stream_t));
+    s->state = LEXER_BLOCK_DATA;
+    s->emit = emit;
+    s->arg = arg;
+}
+
+void lexer_stream_free(lexer_stream_t *s)
+{
+    safe_free(s->pending);
+    s->pending = NULL;
+    s->pending_len = s->pending_cap = 0;
+}
+
+static void lexer_stream_hold(lexer_stream_t *s, const char *buf, size_t len)
+{
+    if (s->pending_len + len > s->pending_cap) {
+        s->pending_cap = MAX(s->pending_cap * 2, s->pending_len + len);
+        s->pending = safe_realloc(s->pending, s->pending_cap);
     }
+    memcpy(s->pending + s->pending_len, buf, len);
+    s->pending_len += len;
+}
 
-    blk->tok.obj.num_filters = num_filters;
-    blk->tok.obj.filters = filters;
-    return 0;
+static int lexer_stream_emit(lexer_stream_t *s, enum lexer_block type,
+                             const char *buf, size_t len)
+{
+    lexer_span_t span = { .buf = buf, .len = len };
+
+    if (len == 0)
+        return 0;
+    return s->emit(s->arg, type, &span);
 }
 
-int lexer_lex_tokens(fluid_t *ctx)
+int lexer_stream_feed(lexer_stream_t *s, const char *buf, size_t len)
 {
-    lexer_block_t *blk;
+    char c;
+    size_t pos, end, start = 0;
+
+    while (start < len) {
+        if (s->state == LEXER_BLOCK_DATA) {
+            if (s->pending_len) {
+                /* a '{' was held back at the end of the previous chunk */
+                if (buf[start] == '%' || buf[start] == '{') {
+                    s->state = (buf[start] == '%') ? LEXER_BLOCK_TAG :
+                                                     LEXER_BLOCK_OBJECT;
+                    lexer_stream_hold(s, buf + start, 1);
+                    start += 1;
+                    continue;
+                }
+                if (lexer_stream_emit(s, LEXER_BLOCK_DATA, "{", 1))
+                    return -1;
+                s->pending_len = 0;
+            }
 
-    LIST_FOREACH(&ctx->lex_blocks, p) {
-        blk = CONTAINER_OF(p, lexer_block_t, node);
-        if (blk->type == LEXER_BLOCK_TAG) {
-            if (lexer_tokenize_tag(blk) != 0) {
-                LOG_ERR("tokenize tag failed");
-                return -1;
+            pos = start + scan_markup_open(buf + start, len - start);
+            if (pos >= len) {
+                /* hold back a trailing '{'; it may open a tag/object */
+                end = (buf[len - 1] == '{') ? len - 1 : len;
+                if (lexer_stream_emit(s, LEXER_BLOCK_DATA,
+                                      buf + start, end - start))
+                    return -1;
+                if (end < len)
+                    lexer_stream_hold(s, buf + end, 1);
+                return 0;
             }
-        }
-        if (blk->type == LEXER_BLOCK_OBJECT) {
-            if (lexer_tokenize_object(blk) != 0) {
-                LOG_ERR("tokenize object failed");
+            if (lexer_stream_emit(s, LEXER_BLOCK_DATA,
+                                  buf + start, pos - start))
                 return -1;
+            s->state = (buf[pos + 1] == '%') ? LEXER_BLOCK_TAG :
+                                               LEXER_BLOCK_OBJECT;
+            lexer_stream_hold(s, buf + pos, 2);
+            start = pos + 2;
+            continue;
+        }
+
+        c = (s->state == LEXER_BLOCK_TAG) ? '%' : '}';
+        if (s->pending_len > 2 && s->pending[s->pending_len - 1] == c &&
+            buf[start] == '}') {
+            /* closing delimiter split across chunks, after the opener */
+            pos = start + 1;
+        } else {
+            end = start + scan_markup_close(buf + start, len - start, c);
+            if (end >= len) {
+                lexer_stream_hold(s, buf + start, len - start);
+                return 0;
             }
+            /* +2 to include `%}` or `}}` in current block */
+            pos = end + 2;
         }
+        lexer_stream_hold(s, buf + start, pos - start);
+        if (lexer_stream_emit(s, s->state, s->pending, s->pending_len))
+            return -1;
+        s->pending_len = 0;
+        s->state = LEXER_BLOCK_DATA;
+        start = pos;
     }
     return 0;
 }
 
-void lexer_grabage_collect(fluid_t *ctx)
+int lexer_stream_finish(lexer_stream_t *s)
 {
-    lexer_block_t *cur, *prev = NULL;
+    if (s->state != LEXER_BLOCK_DATA) {
+        /* at the end we must always be at a data block */
+        LOG_ERR("unterminated '%s' at end of input",
+                s->state == LEXER_BLOCK_OBJECT ? "{{" : "{%");
+        return -1;
+    }
+    if (lexer_stream_emit(s, LEXER_BLOCK_DATA, s->pending, s->pending_len))
+        return -1;
+    s->pending_len = 0;
+    return 0;
+}
 
-    if (ctx->lex_blocks.head == NULL)
-        return;
+/* --- Fused lex + preprocess --- */
 
-    LIST_FOREACH(&ctx->lex_blocks, p) {
-        cur = CONTAINER_OF(p, lexer_block_t, node);
-        if (prev && prev->type == LEXER_BLOCK_DATA &&
-            cur->type == LEXER_BLOCK_DATA)
-        {
-            if (lexer_merge_blocks(ctx, prev, cur)) {
-                LOG_INF("gc: failed to merge blocks. Skipped!");
-            }
+#define LEXER_DATA_INITIAL           8
+#define LEXER_INCLUDES_INITIAL       8
+
+/* Data segments seen since the last markup block */
+typedef struct {
+    lexer_span_t *segs;
+    int count;
+    int capacity;
+    size_t len;
+} lexer_data_t;
+
+static void lexer_data_push(lexer_data_t *d, const char *buf, size_t len)
+{
+    lexer_span_t *last;
+
+    if (len == 0)
+        return;
+    d->len += len;
+    if (d->count) {
+        last = &d->segs[d->count - 1];
+        if (last->buf + last->len == buf) {
+            last->len += len;
+            return;
         }
-        prev = cur;
     }
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : LEXER_DATA_INITIAL;
+        d->segs = safe_realloc(d->segs, d->capacity * sizeof(lexer_span_t));
+    }
+    d->segs[d->count].buf = buf;
+    d->segs[d->count].len = len;
+    d->count += 1;
 }
 
-void lexer_setup(fluid_t *ctx)
+/* Emit the pending data as one (possibly rope) data block */
+static void lexer_data_flush(fluid_t *ctx, lexer_data_t *d)
+{
+    size_t i;
+    lexer_blocks_t *b = &ctx->blocks;
+
+    if (d->count == 0)
+        return;
+    i = lexer_blocks_push(b, LEXER_BLOCK_DATA, NULL, 0);
+    lexer_block_set_rope(ctx, b, i, d->segs, d->count, d->len);
+    d->count = 0;
+    d->len = 0;
+}
+
+static void lexer_includes_push(lexer_includes_t *inc, size_t i)
 {
-    list_init(&ctx->lex_blocks);
+    if (inc->count == inc->capacity) {
+        inc->capacity = inc->capacity ? inc->capacity * 2 :
+                                        LEXER_INCLUDES_INITIAL;
+        inc->idx = safe_realloc(inc->idx, inc->capacity * sizeof(size_t));
+    }
+    inc->idx[inc->count++] = i;
 }
 
-int lexer_lex(fluid_t *ctx)
+/**
+ * Find the next markup block at or after `pos`: buf[*start, *end) spans
+ * "{{ ... }}" or "{% ... %}". Returns 1 if found, 0 if there is no more
+ * markup and -1 if the block is unterminated.
+ */
+static int lexer_next_markup(const char *buf, size_t len, size_t pos,
+                             size_t *start, size_t *end)
 {
-    /* State1: Identify data/tag/object blocks */
-    if (lexer_lex_blocks(ctx) != 0)
-        return -1;
+    char c;
+    size_t close;
 
-    /* State2: Lex tag and object blocks for more information */
-    if (lexer_lex_tokens(ctx) != 0)
+    *start = pos + scan_markup_open(buf + pos, len - pos);
+    if (*start >= len)
+        return 0;
+    c = (buf[*start + 1] == '%') ? '%' : '}';
+    /* the close is looked for after the opener: "{%}" is not a tag */
+    close = *start + 2 + scan_markup_close(buf + *start + 2,
+                                           len - *start - 2, c);
+    if (close >= len)
         return -1;
+    *end = close + 2;
+    return 1;
+}
 
-    return 0;
+/* Does the tag at buf[start, end) open with the word `kw`? */
+static bool lexer_tag_is(const char *buf, size_t start, size_t end,
+                         const char *kw)
+{
+    size_t n = strlen(kw);
+    const char *p = buf + start + 2, *stop = buf + end - 2;
+
+    while (p < stop && IS_SPACE(*p))
+        p++;
+    if ((size_t)(stop - p) < n || memcmp(p, kw, n) != 0)
+        return false;
+    p += n;
+    return p == stop || IS_SPACE(*p) || IS_QUOTE(*p) ||
+           IS_OPERATOR(*p) || IS_PUNCT(*p);
+}
+
+/**
+ * Skip to the tag `end_kw` closing a comment/raw block whose body starts at
+ * `pos`. The body is only split into markup blocks, so a delimiter inside
+ * an object or string does not end it. On success, *body_end is where the
+ * closing tag starts and *next is just past it.
+ */
+static bool lexer_skip_block(const char *buf, size_t len, size_t pos,
+                             const char *end_kw, size_t *body_end,
+                             size_t *next)
+{
+    size_t start, end;
+
+    while (lexer_next_markup(buf, len, pos, &start, &end) == 1) {
+        if (buf[start + 1] == '%' && lexer_tag_is(buf, start, end, end_kw)) {
+            *body_end = start;
+            *next = end;
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+/**
+ * Split the source into data, tag and object blocks and tokenize the
+ * markup, all in one pass. Comment blocks are skipped and raw blocks become
+ * data as they are met (their bodies are never tokenized), and data is
+ * coalesced into a single block between two markup blocks. An unterminated
+ * comment or raw block, and everything after it, is kept as-is. Includes
+ * are left in place with their indices in ctx->includes.
+ */
+int lexer_lex(fluid_t *ctx)
+{
+    int ret;
+    size_t i, pos = 0, start, end, body_end, next;
+    bool verbatim = false;
+    enum liq_kw kw;
+    lexer_span_t span;
+    lexer_token_t tok;
+    lexer_data_t data = { 0 };
+    const char *buf = ctx->src.buf;
+    size_t len = ctx->src.size;
+    lexer_blocks_t *b = &ctx->blocks;
+
+    while ((ret = lexer_next_markup(buf, len, pos, &start, &end)) == 1) {
+        lexer_data_push(&data, buf + pos, start - pos);
+        pos = end;
+        span.buf = buf + start;
+        span.len = end - start;
+        memset(&tok, 0, sizeof(lexer_token_t));
+
+        if (buf[start + 1] != '%') {
+            if (lexer_tokenize_object(ctx, &span, &tok) != 0) {
+                LOG_ERR("tokenize object failed");
+                ret = -1;
+                goto out;
+            }
+            lexer_data_flush(ctx, &data);
+            i = lexer_blocks_push(b, LEXER_BLOCK_OBJECT, span.buf, span.len);
+            b->toks[i] = tok;
+            continue;
+        }
+
+        if (lexer_tokenize_tag(ctx, &span, &tok) != 0) {
+            LOG_ERR("tokenize tag failed");
+            ret = -1;
+            goto out;
+        }
+        kw = tok.tag.keyword;
+
+        if (!verbatim && kw == LIQ_KW_COMMENT) {
+            if (lexer_skip_block(buf, len, pos, "endcomment",
+                                 &body_end, &next)) {
+                pos = next;
+                continue;
+            }
+            verbatim = true;
+        }
+        else if (!verbatim && kw == LIQ_KW_RAW) {
+            if (lexer_skip_block(buf, len, pos, "endraw",
+                                 &body_end, &next)) {
+                lexer_data_push(&data, buf + pos, body_end - pos);
+                pos = next;
+                continue;
+            }
+            verbatim = true;
+        }
+
+        lexer_data_flush(ctx, &data);
+        i = lexer_blocks_push(b, LEXER_BLOCK_TAG, span.buf, span.len);
+        b->toks[i] = tok;
+        if (!verbatim && kw == LIQ_KW_INCLUDE && tok.tag.num_tokens > 0)
+            lexer_includes_push(&ctx->includes, i);
+    }
+    if (ret < 0) {
+        LOG_ERR("unterminated '%.2s' at offset %zu", buf + start, start);
+        goto out;
+    }
+    lexer_data_push(&data, buf + pos, len - pos);
+    lexer_data_flush(ctx, &data);
+out:
+    safe_free(data.segs);
+    return ret;
+}
+
+void lexer_setup(fluid_t *ctx)
+{
+    lexer_blocks_init(&ctx->blocks);
 }
 
 void lexer_teardown(fluid_t *ctx)
 {
-    lexer_free_blocks(ctx);
+    /* tokens are owned by ctx->arena; only the vectors need to go */
+    lexer_blocks_free(&ctx->blocks);
+    lexer_includes_free(&ctx->includes);
+    safe_free(ctx->tok_scratch.toks);
+    ctx->tok_scratch.toks = NULL;
+    ctx->tok_scratch.capacity = 0;
 }
@@ -8,12 +8,12 @@
 #define _LEXER_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <utils/utils.h>
-#include <utils/list.h>
 
 #include "liquid.h"
 #include "filter.h"
@@ -26,36 +26,149 @@ enum lexer_block {
     LEXER_BLOCK_SENTINEL,
 };
 
+/**
+ * A span is a view into the buffer of the fluid_t that lexed it (or an
+ * included fluid_t kept alive by it); blocks do not copy the source text.
+ * Spans of rewritten blocks (merges) point into the fluid_t's arena.
+ */
+typedef struct {
+    const char *buf;
+    size_t len;
+} lexer_span_t;
+
+enum lexer_tok_type {
+    LEXER_TOK_WORD,           /* keywords, identifiers, paths, file names */
+    LEXER_TOK_STRING,         /* quoted literal; span excludes the quotes */
+    LEXER_TOK_NUMBER,
+    LEXER_TOK_OPERATOR,       /* == != <> < > <= >= = */
+    LEXER_TOK_PUNCT,          /* | : , ( ) */
+};
+
+/* A single token inside a tag/object; a span over the source buffer */
+typedef struct {
+    enum lexer_tok_type type;
+    lexer_span_t span;
+} lexer_tok_t;
+
 typedef struct {
     enum liq_kw keyword;
     liq_filter_t filter;
-    char **tokens;
+    lexer_tok_t *tokens;      /* arguments that follow the keyword */
+    int num_tokens;
 } lexer_token_tag_t;
 
 typedef struct {
-    char *identifier;
+    lexer_tok_t identifier;
     int num_filters;
     liq_filter_t *filters;
 } lexer_token_obj_t;
 
+/**
+ * Consecutive data blocks are coalesced into a rope (list of segments)
+ * rather than copied into one buffer. For a rope, the block's span has a
+ * NULL buf and the total length; use lexer_block_segments() to read it.
+ */
+typedef struct {
+    lexer_span_t *segs;
+    int num_segs;
+} lexer_token_data_t;
+
 typedef union {
     lexer_token_tag_t tag;
     lexer_token_obj_t obj;
+    lexer_token_data_t data;
 } lexer_token_t;
 
+/* scratch space used by the tokenizer; reused across blocks */
 typedef struct {
-    node_t node;
-    enum lexer_block type;
-    string_t content;
-    lexer_token_t tok;
-} lexer_block_t;
+    lexer_tok_t *toks;
+    size_t capacity;
+} lexer_tok_scratch_t;
+
+/**
+ * Blocks are kept in a vector, structure-of-arrays style, so that passes
+ * that only look at block types (or spans) walk a dense array.
+ */
+typedef struct {
+    uint8_t *types;           /* enum lexer_block */
+    lexer_span_t *spans;
+    lexer_token_t *toks;
+    size_t count;
+    size_t capacity;
+} lexer_blocks_t;
+
+/* Indices of the include tags left in a block vector by lexer_lex() */
+typedef struct {
+    size_t *idx;
+    size_t count;
+    size_t capacity;
+} lexer_includes_t;
+
+typedef struct fluid_s fluid_t;
+
+/**
+ * Streaming lexer: consumes input in chunks of any size and calls `emit`
+ * for each block. Data is emitted as soon as it is known to be data (so a
+ * long data region may be emitted in several pieces) while tags/objects
+ * are buffered until they are complete. Memory use is bounded by the
+ * chunk size plus the largest single tag/object.
+ */
+typedef int (*lexer_stream_emit_t)(void *arg, enum lexer_block type,
+                                   lexer_span_t *span);
+
+typedef struct {
+    enum lexer_block state;   /* block currently being scanned */
+    char *pending;            /* partial tag/object (or a trailing '{') */
+    size_t pending_len;
+    size_t pending_cap;
+    lexer_stream_emit_t emit;
+    void *arg;
+} lexer_stream_t;
+
+static inline enum liq_kw lexer_block_keyword(lexer_blocks_t *b, size_t i)
+{
+    if (b->types[i] != LEXER_BLOCK_TAG)
+        return LIQ_KW_NONE;
+    return b->toks[i].tag.keyword;
+}
+
+static inline bool lexer_tok_is_punct(lexer_tok_t *t, char c)
+{
+    return t->type == LEXER_TOK_PUNCT && t->span.buf[0] == c;
+}
+
+/* Segments of data block `i`; a plain block is a rope of one segment */
+static inline int lexer_block_segments(lexer_blocks_t *b, size_t i,
+                                       lexer_span_t **segs)
+{
+    if (b->toks[i].data.segs == NULL) {
+        *segs = &b->spans[i];
+        return 1;
+    }
+    *segs = b->toks[i].data.segs;
+    return b->toks[i].data.num_segs;
+}
 
 void lexer_setup(fluid_t *ctx);
 int  lexer_lex(fluid_t *ctx);
 void lexer_teardown(fluid_t *ctx);
-void lexer_grabage_collect(fluid_t *ctx);
-void lexer_remove_block(fluid_t *ctx, lexer_block_t *blk);
-void lexer_block_cast_to_data(lexer_block_t *blk);
-int lexer_merge_blocks(fluid_t *ctx, lexer_block_t *prim, lexer_block_t *sec);
+
+void lexer_blocks_init(lexer_blocks_t *b);
+void lexer_blocks_free(lexer_blocks_t *b);
+void lexer_blocks_append_range(lexer_blocks_t *dst, lexer_blocks_t *src,
+                               size_t start, size_t end);
+void lexer_includes_free(lexer_includes_t *inc);
+
+/* Like lexer_blocks_append_range(), but coalesces data at the seam */
+void lexer_blocks_splice(fluid_t *ctx, lexer_blocks_t *dst,
+                         lexer_blocks_t *src, size_t start, size_t end);
+
+int lexer_tokenize_tag(fluid_t *ctx, lexer_span_t *span, lexer_token_t *tok);
+int lexer_tokenize_object(fluid_t *ctx, lexer_span_t *span, lexer_token_t *tok);
+
+void lexer_stream_init(lexer_stream_t *s, lexer_stream_emit_t emit, void *arg);
+int lexer_stream_feed(lexer_stream_t *s, const char *buf, size_t len);
+int lexer_stream_finish(lexer_stream_t *s);
+void lexer_stream_free(lexer_stream_t *s);
 
 #endif /* _LEXER_H_ */
@@ -54,7 +54,7 @@ typedef struct {
 } liq_blk_t;
 
 static liq_blk_t liq_blk[LIQ_BLK_SENTINEL] = {
-    [LIQ_BLK_CASE]     = { LIQ_KW_CASE,    LIQ_KW_ENDIF,      { LIQ_KW_WHEN,  LIQ_KW_ELSE } },
+    [LIQ_BLK_CASE]     = { LIQ_KW_CASE,    LIQ_KW_ENDCASE,    { LIQ_KW_WHEN,  LIQ_KW_ELSE } },
     [LIQ_BLK_CAPTURE]  = { LIQ_KW_CAPTURE, LIQ_KW_ENDCAPTURE, {} },
     [LIQ_BLK_COMMENT]  = { LIQ_KW_COMMENT, LIQ_KW_ENDCOMMENT, {} },
     [LIQ_BLK_FOR]      = { LIQ_KW_FOR,     LIQ_KW_ENDFOR,     { LIQ_KW_ELSE,  LIQ_KW_BREAK, LIQ_KW_CONTINUE }  },
@@ -63,25 +63,25 @@ static liq_blk_t liq_blk[LIQ_BLK_SENTINEL] = {
     [LIQ_BLK_UNLESS]   = { LIQ_KW_UNLESS,  LIQ_KW_ENDUNLESS,  {} },
 };
 
-enum liq_kw liquid_get_kw(const char *literal)
+enum liq_kw liquid_get_kw(const char *literal, size_t len)
 {
     enum liq_kw i;
     enum liq_blk j;
-    size_t len;
     int is_end = 0;
 
-    if (strncmp(literal, "end", 3) == 0) {
+    if (len > 3 && strncmp(literal, "end", 3) == 0) {
         literal += 3;
+        len -= 3;
         is_end = true;
     }
 
-    len = strlen(literal);
     if (len == 0 || len >= LIQ_KW_MAXLEN) {
         return LIQ_KW_NONE;
     }
 
     for (i = 1; i < LIQ_KW_SENTINEL; i++) {
-        if (strncmp(literal, liq_kw[i].literal, len) == 0)
+        if (strncmp(literal, liq_kw[i].literal, len) == 0 &&
+            liq_kw[i].literal[len] == '\0')
             break;
     }
 
@@ -145,6 +145,11 @@ bool liquid_is_valid(enum liq_blk parent, enum liq_kw kw)
 {
     int i;
 
+    if (kw >= LIQ_KW_SENTINEL) {
+        /* an end tag must close the innermost block */
+        return parent != LIQ_BLK_NONE && liq_blk[parent].end == kw;
+    }
+
     if (parent == LIQ_BLK_NONE) {
         /* only a new tag_open or a bare tag can appear at level 1 */
         return liquid_is_block_begin(kw) || KW_HAS_ATTR(kw, LIQ_KW_F_BARE);
@@ -163,3 +168,29 @@ bool liquid_is_valid(enum liq_blk parent, enum liq_kw kw)
 
     return false;
 }
+
+static const char *liq_op[LIQ_OP_SENTINEL] = {
+    [LIQ_OP_LESS]            = "<",
+    [LIQ_OP_GREAT]           = ">",
+    [LIQ_OP_LESS_EQUAL]      = "<=",
+    [LIQ_OP_GREAT_EQUAL]     = ">=",
+    [LIQ_OP_EQUAlS]          = "==",
+    [LIQ_OP_NOT_EQUAL]       = "!=",
+    [LIQ_OP_LOGIC_OR]        = "or",
+    [LIQ_OP_LOGIC_AND]       = "and",
+    [LIQ_OP_CONTAINS]        = "contains",
+};
+
+enum liq_operators liquid_get_op(const char *literal, size_t len)
+{
+    enum liq_operators i;
+
+    if (len == 2 && strncmp(literal, "<>", 2) == 0)
+        return LIQ_OP_NOT_EQUAL;
+
+    for (i = 0; i < LIQ_OP_SENTINEL; i++) {
+        if (strncmp(literal, liq_op[i], len) == 0 && liq_op[i][len] == '\0')
+            return i;
+    }
+    return LIQ_OP_SENTINEL;
+}
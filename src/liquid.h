@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 
 enum liq_kw {
     LIQ_KW_NONE,
@@ -64,10 +65,13 @@ enum liq_operators {
     LIQ_OP_SENTINEL
 };
 
-enum liq_kw liquid_get_kw(const char *literal);
+enum liq_kw liquid_get_kw(const char *literal, size_t len);
 enum liq_blk liquid_get_blk(enum liq_kw kw);
 bool liquid_is_block_begin(enum liq_kw kw);
 bool liquid_is_block_end(enum liq_kw kw);
 bool liquid_is_valid(enum liq_blk parent, enum liq_kw kw);
 
+/* LIQ_OP_SENTINEL if `literal` is not an operator */
+enum liq_operators liquid_get_op(const char *literal, size_t len);
+
 #endif /* _LIQUID_H_ */
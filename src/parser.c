@@ -4,54 +4,482 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <utils/logger.h>
 
 #include "parser.h"
 
-pt_node_t *new_pt_node(pt_node_t *parent, enum pt_node_type type)
+LOGGER_MODULE_EXTERN(fluid, parser);
+
+#define PARSER_NODES_INITIAL           64
+#define PARSER_STACK_INITIAL           16
+
+/* An open block tag; children of the block go into `arm` */
+typedef struct {
+    uint32_t node;
+    uint32_t arm;
+    uint32_t tail;            /* last child of arm */
+    enum liq_blk blk;
+    bool has_else;
+    lexer_tok_t subject;      /* operand of a case */
+} parser_frame_t;
+
+typedef struct {
+    parser_frame_t *frames;
+    int depth;
+    int capacity;
+} parser_stack_t;
+
+static uint32_t new_pt_node(parser_t *p, uint32_t parent,
+                            enum pt_node_type type)
 {
     pt_node_t *n;
 
-    n = safe_calloc(1, sizeof(pt_node_t));
+    if (p->count == p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : PARSER_NODES_INITIAL;
+        p->nodes = safe_realloc(p->nodes, p->capacity * sizeof(pt_node_t));
+    }
+    n = &p->nodes[p->count];
+    memset(n, 0, sizeof(pt_node_t));
     n->type = type;
     n->parent = parent;
-    return n;
+    n->first_child = PT_IDX_NONE;
+    n->next_sibling = PT_IDX_NONE;
+    return p->count++;
 }
 
-typedef struct {
-    pt_node_t *root;
-} parser_t;
+/* Add a node of `type` as the last child of the arm open in `f` */
+static uint32_t parser_add_child(parser_t *p, parser_frame_t *f,
+                                 enum pt_node_type type)
+{
+    uint32_t idx;
+
+    idx = new_pt_node(p, f->arm, type);
+    if (f->tail == PT_IDX_NONE)
+        p->nodes[f->arm].first_child = idx;
+    else
+        p->nodes[f->tail].next_sibling = idx;
+    f->tail = idx;
+    return idx;
+}
 
-int build_parse_tree(parser_t *ctx, list_t *lex_blocks)
+static parser_frame_t *parser_push(parser_stack_t *s, uint32_t node,
+                                   enum liq_blk blk)
 {
-    lexer_block_t *blk;
+    parser_frame_t *f;
 
-    ARG_UNUSED(ctx);
+    if (s->depth == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : PARSER_STACK_INITIAL;
+        s->frames = safe_realloc(s->frames,
+                                 s->capacity * sizeof(parser_frame_t));
+    }
+    f = &s->frames[s->depth++];
+    memset(f, 0, sizeof(parser_frame_t));
+    f->node = node;
+    f->arm = node;
+    f->tail = PT_IDX_NONE;
+    f->blk = blk;
+    return f;
+}
 
-    LIST_FOREACH(lex_blocks, p) {
-        blk = CONTAINER_OF(p, lexer_block_t, node);
-        switch (blk->type) {
-        case LEXER_BLOCK_DATA:
+static bool parser_tok_is_operand(lexer_tok_t *t)
+{
+    return t->type == LEXER_TOK_WORD || t->type == LEXER_TOK_STRING ||
+           t->type == LEXER_TOK_NUMBER;
+}
+
+static bool parser_tok_is_word(lexer_tok_t *t, const char *word)
+{
+    size_t len = strlen(word);
+
+    return t->type == LEXER_TOK_WORD && t->span.len == len &&
+           memcmp(t->span.buf, word, len) == 0;
+}
+
+static enum liq_operators parser_tok_op(lexer_tok_t *t)
+{
+    if (t->type != LEXER_TOK_OPERATOR && t->type != LEXER_TOK_WORD)
+        return LIQ_OP_SENTINEL;
+    return liquid_get_op(t->span.buf, t->span.len);
+}
+
+static uint32_t parser_logic_node(parser_t *p, uint32_t parent,
+                                  enum liq_operators op,
+                                  uint32_t left, uint32_t right)
+{
+    uint32_t idx;
 
+    idx = new_pt_node(p, parent, PT_NODE_COMPARE);
+    p->nodes[idx].compare.operator = op;
+    p->nodes[idx].compare.left = left;
+    p->nodes[idx].compare.right = right;
+    return idx;
+}
+
+/* `lhs` or `lhs op rhs` */
+static int parser_compare(parser_t *p, uint32_t parent,
+                          lexer_tok_t *toks, int n, uint32_t *out)
+{
+    uint32_t idx;
+    enum liq_operators op = LIQ_OP_SENTINEL;
+
+    if (n == 3)
+        op = parser_tok_op(&toks[1]);
+    if ((n != 1 && n != 3) || !parser_tok_is_operand(&toks[0]) ||
+        (n == 3 && (op == LIQ_OP_SENTINEL || op == LIQ_OP_LOGIC_OR ||
+                    op == LIQ_OP_LOGIC_AND ||
+                    !parser_tok_is_operand(&toks[2]))))
+        return -1;
+
+    idx = new_pt_node(p, parent, PT_NODE_COMPARE);
+    p->nodes[idx].compare.operator = op;
+    p->nodes[idx].compare.lhs = toks[0];
+    if (n == 3)
+        p->nodes[idx].compare.rhs = toks[2];
+    *out = idx;
+    return 0;
+}
+
+/**
+ * Conditions chain compares with `and`/`or`. As in Liquid, there is no
+ * precedence; the chain is grouped from the right.
+ */
+static int parser_condition(parser_t *p, uint32_t parent,
+                            lexer_tok_t *toks, int n, uint32_t *out)
+{
+    int i;
+    uint32_t left, right;
+    enum liq_operators op = LIQ_OP_SENTINEL;
+
+    for (i = 0; i < n; i++) {
+        op = parser_tok_op(&toks[i]);
+        if (op == LIQ_OP_LOGIC_AND || op == LIQ_OP_LOGIC_OR)
+            break;
+    }
+    if (i == n)
+        return parser_compare(p, parent, toks, n, out);
+
+    if (parser_compare(p, parent, toks, i, &left) ||
+        parser_condition(p, parent, toks + i + 1, n - i - 1, &right))
+        return -1;
+    *out = parser_logic_node(p, parent, op, left, right);
+    return 0;
+}
+
+/* `when v1, v2 or v3` is `subject == v1 or subject == v2 or ...` */
+static int parser_when(parser_t *p, uint32_t parent, lexer_tok_t *subject,
+                       lexer_tok_t *toks, int n, uint32_t *out)
+{
+    uint32_t idx;
+
+    if (n == 0 || !parser_tok_is_operand(&toks[0]))
+        return -1;
+
+    idx = new_pt_node(p, parent, PT_NODE_COMPARE);
+    p->nodes[idx].compare.operator = LIQ_OP_EQUAlS;
+    p->nodes[idx].compare.lhs = *subject;
+    p->nodes[idx].compare.rhs = toks[0];
+    if (n == 1) {
+        *out = idx;
+        return 0;
+    }
+    if (n == 2 || !(lexer_tok_is_punct(&toks[1], ',') ||
+                    parser_tok_is_word(&toks[1], "or")))
+        return -1;
+    if (parser_when(p, parent, subject, toks + 2, n - 2, out))
+        return -1;
+    *out = parser_logic_node(p, parent, LIQ_OP_LOGIC_OR, idx, *out);
+    return 0;
+}
+
+/* A bound of `(start..end)`; a number literal or a variable */
+static void parser_range_bound(lexer_tok_t *t, const char *buf, size_t len)
+{
+    t->type = (isdigit((unsigned char)buf[0]) || buf[0] == '-') ?
+              LEXER_TOK_NUMBER : LEXER_TOK_WORD;
+    t->span.buf = buf;
+    t->span.len = len;
+}
+
+/* `variable in collection|(start..end) [limit: n] [offset: n] [reversed]` */
+static int parser_loop(parser_t *p, uint32_t idx, lexer_tok_t *toks, int n)
+{
+    int i = 2;
+    const char *dots, *end;
+    lexer_tok_t *range;
+    struct pt_node_loop *loop = &p->nodes[idx].loop;
+
+    loop->alternate = PT_IDX_NONE;
+    if (n < 3 || toks[0].type != LEXER_TOK_WORD ||
+        !parser_tok_is_word(&toks[1], "in"))
+        return -1;
+    loop->variable = toks[0];
+
+    if (lexer_tok_is_punct(&toks[i], '(')) {
+        if (n < i + 3 || toks[i + 1].type != LEXER_TOK_WORD ||
+            !lexer_tok_is_punct(&toks[i + 2], ')'))
+            return -1;
+        range = &toks[i + 1];
+        dots = range->span.buf + 1;
+        end = range->span.buf + range->span.len - 2;
+        while (dots < end && !(dots[0] == '.' && dots[1] == '.'))
+            dots++;
+        if (dots >= end)
+            return -1;
+        loop->is_range = true;
+        parser_range_bound(&loop->range_start, range->span.buf,
+                           dots - range->span.buf);
+        parser_range_bound(&loop->range_end, dots + 2,
+                           range->span.len - (dots - range->span.buf) - 2);
+        loop->collection = *range;
+        i += 3;
+    }
+    else if (parser_tok_is_operand(&toks[i])) {
+        loop->collection = toks[i++];
+    }
+    else {
+        return -1;
+    }
+
+    while (i < n) {
+        if (parser_tok_is_word(&toks[i], "reversed")) {
+            loop->reversed = true;
+            i += 1;
+            continue;
+        }
+        if (i + 2 >= n || !lexer_tok_is_punct(&toks[i + 1], ':') ||
+            !parser_tok_is_operand(&toks[i + 2]))
+            return -1;
+        if (parser_tok_is_word(&toks[i], "limit"))
+            loop->limit = toks[i + 2];
+        else if (parser_tok_is_word(&toks[i], "offset"))
+            loop->offset = toks[i + 2];
+        else
+            return -1;
+        i += 3;
+    }
+    return 0;
+}
+
+/* Start a new elsif/when/else arm of the branch (or loop) open in `f` */
+static uint32_t parser_new_arm(parser_t *p, parser_frame_t *f,
+                               enum liq_kw kw)
+{
+    uint32_t idx, prev;
+
+    idx = new_pt_node(p, f->node, PT_NODE_BRANCH);
+    p->nodes[idx].branch.keyword = kw;
+    p->nodes[idx].branch.condition = PT_IDX_NONE;
+    p->nodes[idx].branch.alternate = PT_IDX_NONE;
+
+    prev = f->arm;
+    if (p->nodes[prev].type == PT_NODE_LOOP)
+        p->nodes[prev].loop.alternate = idx;
+    else
+        p->nodes[prev].branch.alternate = idx;
+    f->arm = idx;
+    f->tail = PT_IDX_NONE;
+    return idx;
+}
+
+/* break/continue may sit in any block, as long as some enclosing one is a for */
+static bool parser_in_loop(parser_stack_t *s)
+{
+    int i;
+
+    for (i = s->depth - 1; i > 0; i--) {
+        if (s->frames[i].blk == LIQ_BLK_FOR)
+            return true;
+    }
+    return false;
+}
+
+static int parser_tag(parser_t *p, parser_stack_t *s, lexer_blocks_t *b,
+                      size_t i)
+{
+    uint32_t idx, cond;
+    parser_frame_t *f = &s->frames[s->depth - 1];
+    lexer_token_tag_t *tag = &b->toks[i].tag;
+    lexer_tok_t *toks = tag->tokens;
+    int n = tag->num_tokens;
+    enum liq_kw kw = tag->keyword;
+    bool valid;
+
+    if (kw == LIQ_KW_NONE) {
+        LOG_ERR("unknown tag");
+        return -1;
+    }
+    if (kw == LIQ_KW_BREAK || kw == LIQ_KW_CONTINUE)
+        valid = parser_in_loop(s);
+    else
+        valid = liquid_is_valid(f->blk, kw);
+    if (!valid) {
+        LOG_ERR("tag not allowed here");
+        return -1;
+    }
+
+    switch (kw) {
+    case LIQ_KW_IF:
+    case LIQ_KW_UNLESS:
+        idx = parser_add_child(p, f, PT_NODE_BRANCH);
+        p->nodes[idx].branch.keyword = kw;
+        p->nodes[idx].branch.alternate = PT_IDX_NONE;
+        if (parser_condition(p, idx, toks, n, &cond)) {
+            LOG_ERR("bad condition");
+            return -1;
+        }
+        p->nodes[idx].branch.condition = cond;
+        parser_push(s, idx, liquid_get_blk(kw));
+        break;
+    case LIQ_KW_CASE:
+        if (n != 1 || !parser_tok_is_operand(&toks[0])) {
+            LOG_ERR("case needs one operand");
+            return -1;
+        }
+        idx = parser_add_child(p, f, PT_NODE_BRANCH);
+        p->nodes[idx].branch.keyword = kw;
+        p->nodes[idx].branch.condition = PT_IDX_NONE;
+        p->nodes[idx].branch.alternate = PT_IDX_NONE;
+        f = parser_push(s, idx, LIQ_BLK_CASE);
+        f->subject = toks[0];
+        break;
+    case LIQ_KW_ELSIF:
+    case LIQ_KW_WHEN:
+        if (f->has_else) {
+            LOG_ERR("tag after else");
+            return -1;
+        }
+        idx = parser_new_arm(p, f, kw);
+        if (kw == LIQ_KW_ELSIF)
+            n = parser_condition(p, idx, toks, n, &cond);
+        else
+            n = parser_when(p, idx, &f->subject, toks, n, &cond);
+        if (n != 0) {
+            LOG_ERR("bad condition");
+            return -1;
+        }
+        p->nodes[idx].branch.condition = cond;
+        break;
+    case LIQ_KW_ELSE:
+        if (f->has_else || n != 0) {
+            LOG_ERR("misplaced else");
+            return -1;
+        }
+        parser_new_arm(p, f, kw);
+        f->has_else = true;
+        break;
+    case LIQ_KW_FOR:
+        idx = parser_add_child(p, f, PT_NODE_LOOP);
+        if (parser_loop(p, idx, toks, n)) {
+            LOG_ERR("bad for loop");
+            return -1;
+        }
+        parser_push(s, idx, LIQ_BLK_FOR);
+        break;
+    case LIQ_KW_CAPTURE:
+        if (n != 1 || toks[0].type != LEXER_TOK_WORD) {
+            LOG_ERR("capture needs a variable name");
+            return -1;
+        }
+        idx = parser_add_child(p, f, PT_NODE_ASSIGN);
+        p->nodes[idx].assign.identifier = toks[0];
+        p->nodes[idx].assign.capture = true;
+        parser_push(s, idx, LIQ_BLK_CAPTURE);
+        break;
+    case LIQ_KW_ASSIGN:
+        if (n != 3 || toks[0].type != LEXER_TOK_WORD ||
+            toks[1].type != LEXER_TOK_OPERATOR || toks[1].span.len != 1 ||
+            toks[1].span.buf[0] != '=' || !parser_tok_is_operand(&toks[2])) {
+            LOG_ERR("bad assignment");
+            return -1;
+        }
+        idx = parser_add_child(p, f, PT_NODE_ASSIGN);
+        p->nodes[idx].assign.identifier = toks[0];
+        p->nodes[idx].assign.value = toks[2];
+        p->nodes[idx].assign.filter = tag->filter;
+        break;
+    case LIQ_KW_INCREMENT:
+    case LIQ_KW_DECREMENT:
+    case LIQ_KW_BREAK:
+    case LIQ_KW_CONTINUE:
+        idx = parser_add_child(p, f, PT_NODE_STMT);
+        p->nodes[idx].stmt.keyword = kw;
+        p->nodes[idx].stmt.tokens = toks;
+        p->nodes[idx].stmt.num_tokens = n;
+        break;
+    case LIQ_KW_COMMENT:
+    case LIQ_KW_RAW:
+        /* terminated ones never make it past the lexer */
+        LOG_ERR("unterminated block");
+        return -1;
+    case LIQ_KW_INCLUDE:
+        /* includes are expanded by the preprocessor */
+        LOG_ERR("include needs a file name");
+        return -1;
+    default:
+        /* end tags; liquid_is_valid() made sure it matches f->blk */
+        s->depth -= 1;
+        break;
+    }
+    return 0;
+}
+
+int build_parse_tree(parser_t *p, lexer_blocks_t *blocks)
+{
+    int ret = 0;
+    size_t i;
+    uint32_t idx;
+    parser_frame_t *f;
+    parser_stack_t stack = { 0 };
+
+    p->count = 0;
+    idx = new_pt_node(p, PT_IDX_NONE, PT_NODE_ROOT);
+    parser_push(&stack, idx, LIQ_BLK_NONE);
+
+    for (i = 0; i < blocks->count && ret == 0; i++) {
+        f = &stack.frames[stack.depth - 1];
+        switch (blocks->types[i]) {
+        case LEXER_BLOCK_DATA:
+            idx = parser_add_child(p, f, PT_NODE_TEXT);
+            p->nodes[idx].text.span = blocks->spans[i];
+            p->nodes[idx].text.segs = blocks->toks[i].data.segs;
+            p->nodes[idx].text.num_segs = blocks->toks[i].data.num_segs;
             break;
         case LEXER_BLOCK_OBJECT:
+            idx = parser_add_child(p, f, PT_NODE_OBJECT);
+            p->nodes[idx].object.identifier = blocks->toks[i].obj.identifier;
+            p->nodes[idx].object.filters = blocks->toks[i].obj.filters;
+            p->nodes[idx].object.num_filters =
+                                            blocks->toks[i].obj.num_filters;
             break;
         case LEXER_BLOCK_TAG:
+            ret = parser_tag(p, &stack, blocks, i);
+            if (ret != 0)
+                LOG_ERR("  in '%.*s'", (int)blocks->spans[i].len,
+                        blocks->spans[i].buf);
             break;
         default:
             break;
         }
     }
-    return 0;
+
+    if (ret == 0 && stack.depth > 1) {
+        LOG_ERR("unterminated block; missing end tag");
+        ret = -1;
+    }
+    safe_free(stack.frames);
+    return ret;
 }
 
 void parser_setup(fluid_t *ctx)
 {
     parser_t *p;
 
-    p = safe_malloc(sizeof(parser_t));
-    p->root = NULL;
+    p = arena_calloc(&ctx->arena, 1, sizeof(parser_t));
+    p->arena = &ctx->arena;
 
     ctx->parser_data = p;
 }
@@ -60,7 +488,7 @@ int parser_parse(fluid_t *ctx)
 {
     parser_t *p = ctx->parser_data;
 
-    if (build_parse_tree(p, &ctx->lex_blocks))
+    if (build_parse_tree(p, &ctx->blocks))
         return -1;
 
     return 0;
@@ -70,5 +498,8 @@ void parser_teardown(fluid_t *ctx)
 {
     parser_t *p = ctx->parser_data;
 
-    safe_free(p);
+    /* the nodes array is the only thing not owned by ctx->arena */
+    if (p)
+        safe_free(p->nodes);
+    ctx->parser_data = NULL;
 }
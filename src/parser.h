@@ -7,63 +7,117 @@
 #ifndef _PARSER_H_
 #define _PARSER_H_
 
+#include <stdint.h>
+
 #include "fluid.h"
 #include "lexer.h"
 #include "liquid.h"
 #include "filter.h"
 
+#define PT_IDX_NONE                    UINT32_MAX
+
 enum pt_node_type {
     PT_NODE_TEXT,
     PT_NODE_OBJECT,
-    PT_NOTE_STMT,
+    PT_NODE_STMT,
     PT_NODE_COMPARE,
     PT_NODE_ASSIGN,
     PT_NODE_BRANCH,
     PT_NODE_LOOP,
     PT_NODE_CONST,
+    PT_NODE_ROOT,
     PT_NODE_SENTINEL
 };
 
+/* Data; like a data block, a NULL span.buf means `segs` holds a rope */
 struct pt_node_text {
-    char *content;
+    lexer_span_t span;
+    lexer_span_t *segs;
+    int num_segs;
 };
 
 struct pt_node_object {
-    char *identifier;
+    lexer_tok_t identifier;
     liq_filter_t *filters;
+    int num_filters;
 };
 
+/* increment, decrement, break and continue */
 struct pt_node_statement {
     enum liq_kw keyword;
+    lexer_tok_t *tokens;
+    int num_tokens;
 };
 
+/**
+ * `assign identifier = value | filter`, or for a capture, the node's
+ * children render into `identifier`.
+ */
 struct pt_node_assign {
-    char *identifier;
-    struct pt_node *expression;
-    /** TODO: Must have a liq_const_t *default; */
+    lexer_tok_t identifier;
+    lexer_tok_t value;
+    liq_filter_t filter;
+    bool capture;
 };
 
+/**
+ * `lhs operator rhs`. A lone `lhs` (operator is LIQ_OP_SENTINEL) tests
+ * for truthiness. For LIQ_OP_LOGIC_AND/OR, `left` and `right` are the
+ * indices of two more compare nodes.
+ */
 struct pt_node_compare {
-    char *lhs;
     enum liq_operators operator;
-    char *rhs;
+    union {
+        struct {
+            lexer_tok_t lhs;
+            lexer_tok_t rhs;
+        };
+        struct {
+            uint32_t left;
+            uint32_t right;
+        };
+    };
 };
 
+/**
+ * One arm of an if/unless/case. The node's children are the body of the
+ * arm, which is taken when `condition` (a compare node) holds, or always
+ * for an `else` (condition is PT_IDX_NONE). Otherwise control moves on to
+ * the `alternate` arm. A `case` node has no body of its own; its arms are
+ * the `when`s, each with a condition built against the case operand.
+ */
 struct pt_node_branch {
-    struct pt_node_compare condition;
-    struct pt_node *true_body;
-    struct pt_node *false_body;
+    enum liq_kw keyword;
+    uint32_t condition;
+    uint32_t alternate;
 };
 
+/**
+ * `for variable in collection` or `for variable in (lo..hi)`. Children are
+ * the body; `alternate` is the for-else arm (a branch node) if any.
+ */
 struct pt_node_loop {
-    struct pt_node_compare condition;
-    struct pt_node_assign *variable;
-    struct pt_node *body;
+    lexer_tok_t variable;
+    lexer_tok_t collection;
+    lexer_tok_t range_start;
+    lexer_tok_t range_end;
+    lexer_tok_t limit;
+    lexer_tok_t offset;
+    bool is_range;
+    bool reversed;
+    uint32_t alternate;
 };
 
+/**
+ * @brief A node of the parse tree. All nodes of a template live in one
+ * array (parser_t::nodes) and refer to each other by index, so a subtree
+ * is a handful of nearby array slots instead of scattered heap objects.
+ */
 struct pt_node {
-    node_t node;
     enum pt_node_type type;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
     union {
         struct pt_node_branch branch;
         struct pt_node_loop loop;
@@ -71,13 +125,31 @@ struct pt_node {
         struct pt_node_assign assign;
         struct pt_node_compare compare;
         struct pt_node_object object;
+        struct pt_node_statement stmt;
     };
-    list_t children;
-    struct pt_node *parent;
 };
 
 typedef struct pt_node pt_node_t;
 
+/* Node 0 is the root; it is valid only after a successful parser_parse() */
+typedef struct {
+    arena_t *arena;
+    pt_node_t *nodes;
+    uint32_t count;
+    uint32_t capacity;
+} parser_t;
+
+/* Segments of a text node; a plain node is a rope of one segment */
+static inline int pt_text_segments(pt_node_t *n, lexer_span_t **segs)
+{
+    if (n->text.span.buf != NULL) {
+        *segs = &n->text.span;
+        return 1;
+    }
+    *segs = n->text.segs;
+    return n->text.num_segs;
+}
+
 void parser_setup(fluid_t *ctx);
 int parser_parse(fluid_t *lex);
 void parser_teardown(fluid_t *ctx);
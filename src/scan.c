@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86
+#endif
+
+#include "scan.h"
+
+typedef size_t (*scan_pair_fn_t)(const char *buf, size_t len,
+                                 char c1, char c2a, char c2b);
+typedef size_t (*scan_string_fn_t)(const char *buf, size_t len);
+
+/* set once by scan_init(); scans run on include prefetch threads too */
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static scan_pair_fn_t scan_pair_fn;
+static scan_string_fn_t scan_string_fn;
+
+enum scan_isa {
+    SCAN_ISA_PORTABLE,
+    SCAN_ISA_SSE2,
+    SCAN_ISA_AVX2,
+};
+
+/* --- Portable kernel --- */
+
+static size_t scan_pair_memchr(const char *buf, size_t len,
+                               char c1, char c2a, char c2b)
+{
+    const char *p, *end;
+
+    if (len < 2)
+        return len;
+
+    p = buf;
+    end = buf + len - 1; /* last position that can start a pair */
+    while (p < end) {
+        p = memchr(p, c1, end - p);
+        if (p == NULL)
+            break;
+        if (p[1] == c2a || p[1] == c2b)
+            return p - buf;
+        p += 1;
+    }
+    return len;
+}
+
+static size_t scan_string_portable(const char *buf, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)buf[i];
+        if (c == '"' || c == '\\' || c < 0x20)
+            return i;
+    }
+    return len;
+}
+
+/* --- x86 kernels --- */
+
+#ifdef SCAN_HAVE_X86
+
+/**
+ * Both kernels compare a block at `i` against c1 and the same block shifted
+ * by one byte against c2a/c2b, so lone '{' or '%' chars in the payload (CSS,
+ * JS, etc.,) do not cause a fall back to the scalar path.
+ */
+
+__attribute__((target("sse2")))
+static size_t scan_pair_sse2(const char *buf, size_t len,
+                             char c1, char c2a, char c2b)
+{
+    size_t i = 0;
+    uint32_t mask;
+    __m128i a, b, m;
+    const __m128i v1 = _mm_set1_epi8(c1);
+    const __m128i v2a = _mm_set1_epi8(c2a);
+    const __m128i v2b = _mm_set1_epi8(c2b);
+
+    while (i + 16 < len) {
+        a = _mm_loadu_si128((const __m128i *)(buf + i));
+        b = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        m = _mm_and_si128(_mm_cmpeq_epi8(a, v1),
+                          _mm_or_si128(_mm_cmpeq_epi8(b, v2a),
+                                       _mm_cmpeq_epi8(b, v2b)));
+        mask = (uint32_t)_mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + scan_pair_memchr(buf + i, len - i, c1, c2a, c2b);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_pair_avx2(const char *buf, size_t len,
+                             char c1, char c2a, char c2b)
+{
+    size_t i = 0;
+    uint32_t mask;
+    __m256i a, b, m;
+    const __m256i v1 = _mm256_set1_epi8(c1);
+    const __m256i v2a = _mm256_set1_epi8(c2a);
+    const __m256i v2b = _mm256_set1_epi8(c2b);
+
+    while (i + 32 < len) {
+        a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        b = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        m = _mm256_and_si256(_mm256_cmpeq_epi8(a, v1),
+                             _mm256_or_si256(_mm256_cmpeq_epi8(b, v2a),
+                                             _mm256_cmpeq_epi8(b, v2b)));
+        mask = (uint32_t)_mm256_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i + scan_pair_sse2(buf + i, len - i, c1, c2a, c2b);
+}
+
+/* A byte is a control char if max(byte, 0x1f) == 0x1f (unsigned) */
+
+__attribute__((target("sse2")))
+static size_t scan_string_sse2(const char *buf, size_t len)
+{
+    size_t i = 0;
+    uint32_t mask;
+    __m128i a, m;
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+    while (i + 16 <= len) {
+        a = _mm_loadu_si128((const __m128i *)(buf + i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(a, quote),
+                                      _mm_cmpeq_epi8(a, bslash)),
+                         _mm_cmpeq_epi8(_mm_max_epu8(a, ctrl), ctrl));
+        mask = (uint32_t)_mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + scan_string_portable(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_string_avx2(const char *buf, size_t len)
+{
+    size_t i = 0;
+    uint32_t mask;
+    __m256i a, m;
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+
+    while (i + 32 <= len) {
+        a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, quote),
+                                            _mm256_cmpeq_epi8(a, bslash)),
+                            _mm256_cmpeq_epi8(_mm256_max_epu8(a, ctrl), ctrl));
+        mask = (uint32_t)_mm256_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i + scan_string_sse2(buf + i, len - i);
+}
+
+#endif /* SCAN_HAVE_X86 */
+
+/* --- Runtime dispatch --- */
+
+static enum scan_isa scan_isa(void)
+{
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SCAN_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SCAN_ISA_SSE2;
+#endif
+    return SCAN_ISA_PORTABLE;
+}
+
+static void scan_init(void)
+{
+    scan_pair_fn = scan_pair_memchr;
+    scan_string_fn = scan_string_portable;
+
+#ifdef SCAN_HAVE_X86
+    switch (scan_isa()) {
+    case SCAN_ISA_AVX2:
+        scan_pair_fn = scan_pair_avx2;
+        scan_string_fn = scan_string_avx2;
+        break;
+    case SCAN_ISA_SSE2:
+        scan_pair_fn = scan_pair_sse2;
+        scan_string_fn = scan_string_sse2;
+        break;
+    default:
+        break;
+    }
+#endif
+}
+
+size_t scan_pair(const char *buf, size_t len, char c1, char c2a, char c2b)
+{
+    pthread_once(&scan_once, scan_init);
+    return scan_pair_fn(buf, len, c1, c2a, c2b);
+}
+
+size_t scan_string(const char *buf, size_t len)
+{
+    pthread_once(&scan_once, scan_init);
+    return scan_string_fn(buf, len);
+}
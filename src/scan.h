@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/**
+ * @brief Find the first offset `i` in `buf` such that buf[i] == c1 and
+ * buf[i + 1] is one of c2a or c2b.
+ *
+ * The kernel (AVX2, SSE2 or memchr based) is picked at runtime on first
+ * use. Returns `len` when there is no match.
+ */
+size_t scan_pair(const char *buf, size_t len, char c1, char c2a, char c2b);
+
+/**
+ * @brief Offset of the first '"', '\\' or control char (< 0x20) in `buf`,
+ * the chars that end a plain run inside a JSON string; `len` if none.
+ */
+size_t scan_string(const char *buf, size_t len);
+
+/* Offset of the next "{{" or "{%" in buf; `len` if none */
+static inline size_t scan_markup_open(const char *buf, size_t len)
+{
+    return scan_pair(buf, len, '{', '{', '%');
+}
+
+/* Offset of the next "%}" (c = '%') or "}}" (c = '}') in buf; `len` if none */
+static inline size_t scan_markup_close(const char *buf, size_t len, char c)
+{
+    return scan_pair(buf, len, c, '}', '}');
+}
+
+#endif /* _SCAN_H_ */
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <utils/utils.h>
+#include <utils/logger.h>
+
+#include "sink.h"
+
+LOGGER_MODULE_EXTERN(fluid, sink);
+
+static void sink_init(sink_t *s, enum sink_type type, int fd)
+{
+    memset(s, 0, sizeof(sink_t));
+    s->type = type;
+    s->fd = fd;
+    if (type != SINK_MEM) {
+        s->cap = SINK_BUF_SIZE;
+        s->buf = safe_malloc(s->cap);
+    }
+}
+
+void sink_open_fd(sink_t *s, int fd)
+{
+    sink_init(s, SINK_FD, fd);
+}
+
+void sink_open_mem(sink_t *s)
+{
+    sink_init(s, SINK_MEM, -1);
+}
+
+static int sink_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* skip what was written; resume mid-iovec on a short write */
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+int sink_flush(sink_t *s)
+{
+    int ret = 0;
+
+    if (s->type == SINK_MEM || s->iovcnt == 0)
+        return s->error;
+
+    ret = sink_writev_all(s->fd, s->iov, s->iovcnt);
+    if (ret < 0) {
+        LOG_ERR("sink: write failed; %s", strerror(errno));
+        s->error = -1;
+    }
+    s->iovcnt = 0;
+    s->len = 0;
+    return s->error;
+}
+
+static int sink_mem_append(sink_t *s, const void *buf, size_t len)
+{
+    if (s->len + len > s->cap) {
+        s->cap = s->cap ? s->cap : SINK_COPY_MAX;
+        while (s->len + len > s->cap)
+            s->cap *= 2;
+        s->buf = safe_realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    return 0;
+}
+
+/* Whether a write at buf would just extend the last iovec */
+static bool sink_iov_extends(sink_t *s, const void *buf)
+{
+    struct iovec *last;
+
+    if (s->iovcnt == 0)
+        return false;
+    last = &s->iov[s->iovcnt - 1];
+    return (const char *)last->iov_base + last->iov_len == buf;
+}
+
+static int sink_add_iov(sink_t *s, const void *buf, size_t len)
+{
+    if (sink_iov_extends(s, buf)) {
+        s->iov[s->iovcnt - 1].iov_len += len;
+        return 0;
+    }
+    if (s->iovcnt == SINK_IOV_MAX && sink_flush(s) != 0)
+        return -1;
+    s->iov[s->iovcnt].iov_base = (void *)buf;
+    s->iov[s->iovcnt].iov_len = len;
+    s->iovcnt++;
+    return 0;
+}
+
+int sink_write(sink_t *s, const void *buf, size_t len)
+{
+    if (s->error || len == 0)
+        return s->error;
+
+    if (s->type == SINK_MEM)
+        return sink_mem_append(s, buf, len);
+
+    /**
+     * Make room before copying: a flush from sink_add_iov() after the copy
+     * would reset the staging buffer under the iovec just added.
+     */
+    if ((s->len + len > s->cap ||
+         (s->iovcnt == SINK_IOV_MAX && !sink_iov_extends(s, s->buf + s->len)))
+        && sink_flush(s) != 0)
+        return -1;
+
+    if (len > s->cap) {
+        /* too big to stage; buf may not outlive this call */
+        if (sink_add_iov(s, buf, len) != 0)
+            return -1;
+        return sink_flush(s);
+    }
+
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    return sink_add_iov(s, s->buf + s->len - len, len);
+}
+
+int sink_write_ref(sink_t *s, const void *buf, size_t len)
+{
+    if (s->type == SINK_MEM || len < SINK_COPY_MAX)
+        return sink_write(s, buf, len);
+
+    if (s->error || len == 0)
+        return s->error;
+
+    return sink_add_iov(s, buf, len);
+}
+
+const char *sink_mem_data(sink_t *s, size_t *len)
+{
+    *len = s->len;
+    return s->buf;
+}
+
+int sink_close(sink_t *s)
+{
+    int ret;
+
+    ret = sink_flush(s);
+    safe_free(s->buf);
+    memset(s, 0, sizeof(sink_t));
+    s->fd = -1;
+    return ret;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SINK_BUF_SIZE                  (256 * 1024)
+#define SINK_IOV_MAX                   64
+#define SINK_COPY_MAX                  512 /* larger writes go out as-is */
+
+enum sink_type {
+    SINK_FD,
+    SINK_MEM,
+};
+
+/**
+ * @brief Rendered output destination.
+ *
+ * Writes are gathered into an iovec list and flushed with one writev() per
+ * batch. Small writes are copied into a staging buffer; large ones are
+ * referenced in place (see sink_write_ref). The memory sink just grows a
+ * heap buffer.
+ */
+typedef struct {
+    enum sink_type type;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct iovec iov[SINK_IOV_MAX];
+    int iovcnt;
+    int error;
+} sink_t;
+
+void sink_open_fd(sink_t *s, int fd);
+void sink_open_mem(sink_t *s);
+
+/* Copy buf into the sink */
+int sink_write(sink_t *s, const void *buf, size_t len);
+
+/* Like sink_write, but buf must stay valid until the next sink_flush() */
+int sink_write_ref(sink_t *s, const void *buf, size_t len);
+
+int sink_flush(sink_t *s);
+
+/* Contents of a memory sink; valid until sink_close() */
+const char *sink_mem_data(sink_t *s, size_t *len);
+
+/* Flush and release the sink; the fd is not closed. */
+int sink_close(sink_t *s);
+
+#endif /* _SINK_H_ */
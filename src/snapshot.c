@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utils/logger.h>
+
+#include "sink.h"
+#include "source.h"
+#include "snapshot.h"
+
+LOGGER_MODULE_EXTERN(fluid, snapshot);
+
+/**
+ * A snapshot is an fobject tree with its pointers turned into file
+ * offsets:
+ *
+ *   header | objects | list items, dict entries and slots | strings
+ *
+ * objects[0] is the root and every object is stored before the objects
+ * it contains (nodes shared through YAML aliases are stored once), so a
+ * snapshot cannot describe a cycle. On load, the file is mapped privately
+ * and the offsets in the objects and arrays are turned back into pointers
+ * in one pass; the strings are used where they are and never touched.
+ * Like .fluidc images, snapshots are tied to the byte order and struct
+ * layout they were written with.
+ */
+
+#define SNAPSHOT_MAGIC                 "FLUIDCFG"
+#define SNAPSHOT_VERSION               2
+#define SNAPSHOT_BYTE_ORDER            0x01020304
+#define SNAPSHOT_ALIGN                 8
+
+/* ref_count of everything but the root; high enough to never hit zero */
+#define SNAPSHOT_PINNED                (INT_MAX / 2)
+
+#define SNAPSHOT_UNDONE                SIZE_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t obj_size;
+    uint32_t entry_size;
+    uint64_t key;
+    uint64_t size;
+    uint64_t num_objects;
+    uint64_t strings_off;
+    union {
+        source_t src;           /* set on load; released with the root */
+        uint64_t reserved[4];
+    } map;
+} snapshot_header_t;
+
+/* Object -> position in post-order, for objects reachable more than once */
+typedef struct {
+    fobject_t *obj;
+    size_t pos;
+} snapshot_slot_t;
+
+typedef struct {
+    fobject_t *obj;
+    size_t next;              /* next item or entry to visit */
+} snapshot_visit_t;
+
+typedef struct {
+    fobject_t **order;        /* post-order; the reverse of the file order */
+    size_t count;
+    snapshot_slot_t *slots;
+    size_t num_slots;
+    snapshot_visit_t *stack;
+    size_t depth;
+    size_t capacity;
+} snapshot_writer_t;
+
+static size_t snapshot_align(size_t off)
+{
+    return (off + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+#define SNAPSHOT_OBJECTS               snapshot_align(sizeof(snapshot_header_t))
+
+static snapshot_slot_t *snapshot_slot(snapshot_writer_t *w, fobject_t *obj)
+{
+    size_t i = ((uint64_t)(uintptr_t)obj * 0x9E3779B97F4A7C15ULL >> 32) &
+               (w->num_slots - 1);
+
+    while (w->slots[i].obj != NULL && w->slots[i].obj != obj)
+        i = (i + 1) & (w->num_slots - 1);
+    return &w->slots[i];
+}
+
+static void snapshot_grow(snapshot_writer_t *w)
+{
+    snapshot_slot_t *old = w->slots;
+    size_t i, num_old = w->num_slots;
+
+    w->num_slots = num_old ? num_old * 2 : 64;
+    w->slots = safe_calloc(w->num_slots, sizeof(snapshot_slot_t));
+    w->order = safe_realloc(w->order, w->num_slots / 2 * sizeof(fobject_t *));
+    for (i = 0; i < num_old; i++) {
+        if (old[i].obj != NULL)
+            *snapshot_slot(w, old[i].obj) = old[i];
+    }
+    safe_free(old);
+}
+
+static int snapshot_push(snapshot_writer_t *w, fobject_t *obj)
+{
+    snapshot_slot_t *slot;
+
+    if (obj->type == FTYPE_DICT && obj->dict.parent != NULL) {
+        LOG_ERR("snapshot: can't save a layered dict");
+        return -1;
+    }
+
+    /* one slot per object, and at most half of them used */
+    if (w->count + w->depth + 1 > w->num_slots / 2)
+        snapshot_grow(w);
+    slot = snapshot_slot(w, obj);
+    slot->obj = obj;
+    slot->pos = SNAPSHOT_UNDONE;
+
+    if (w->depth == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 64;
+        w->stack = safe_realloc(w->stack,
+                                w->capacity * sizeof(snapshot_visit_t));
+    }
+    w->stack[w->depth].obj = obj;
+    w->stack[w->depth].next = 0;
+    w->depth++;
+    return 0;
+}
+
+static fobject_t *snapshot_child(snapshot_visit_t *v)
+{
+    fobject_t *obj = v->obj, *child;
+
+    if (obj->type == FTYPE_LIST) {
+        while (v->next < obj->list.length) {
+            child = obj->list.items[v->next++];
+            if (child != NULL)
+                return child;
+        }
+    }
+    else if (obj->type == FTYPE_DICT) {
+        while (v->next < obj->dict.num_entries) {
+            child = obj->dict.entries[v->next++].value;
+            if (child != NULL)
+                return child;
+        }
+    }
+    return NULL;
+}
+
+/* Post-order walk; w->order ends with the root */
+static int snapshot_order(snapshot_writer_t *w, fobject_t *root)
+{
+    snapshot_slot_t *slot;
+    fobject_t *child;
+
+    if (snapshot_push(w, root) != 0)
+        return -1;
+    while (w->depth > 0) {
+        child = snapshot_child(&w->stack[w->depth - 1]);
+        if (child == NULL) {
+            w->depth--;
+            slot = snapshot_slot(w, w->stack[w->depth].obj);
+            slot->pos = w->count;
+            w->order[w->count++] = slot->obj;
+            continue;
+        }
+        slot = snapshot_slot(w, child);
+        if (slot->obj == NULL) {
+            if (snapshot_push(w, child) != 0)
+                return -1;
+        }
+        else if (slot->pos == SNAPSHOT_UNDONE) {
+            LOG_ERR("snapshot: config contains itself");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* File offset of an object that has been ordered */
+static uintptr_t snapshot_obj_off(snapshot_writer_t *w, fobject_t *obj)
+{
+    if (obj == NULL)
+        return 0;
+    return SNAPSHOT_OBJECTS +
+           (w->count - 1 - snapshot_slot(w, obj)->pos) * sizeof(fobject_t);
+}
+
+static uintptr_t snapshot_put_str(char *buf, size_t *off, const char *str,
+                                  size_t len)
+{
+    uintptr_t start = *off;
+
+    memcpy(buf + start, str, len);
+    buf[start + len] = '\0';
+    *off += len + 1;
+    return start;
+}
+
+static void snapshot_sizes(snapshot_writer_t *w, size_t *arrays,
+                           size_t *strings)
+{
+    size_t i, k;
+    fobject_t *obj;
+
+    *arrays = *strings = 0;
+    for (i = 0; i < w->count; i++) {
+        obj = w->order[i];
+        switch (obj->type) {
+        case FTYPE_STRING:
+            *strings += obj->string.length + 1;
+            break;
+        case FTYPE_LIST:
+            *arrays += snapshot_align(obj->list.length * sizeof(fobject_t *));
+            break;
+        case FTYPE_DICT:
+            *arrays += snapshot_align(obj->dict.num_entries *
+                                      sizeof(ftype_dict_entry_t));
+            *arrays += snapshot_align(obj->dict.num_slots * sizeof(uint32_t));
+            for (k = 0; k < obj->dict.num_entries; k++) {
+                if (obj->dict.entries[k].value != NULL)
+                    *strings += obj->dict.entries[k].key_len + 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* Copy objects[i] and everything it owns into buf */
+static void snapshot_put(snapshot_writer_t *w, char *buf, size_t i,
+                         size_t *arr, size_t *str)
+{
+    size_t k;
+    fobject_t *src = w->order[w->count - 1 - i];
+    fobject_t *dst = (fobject_t *)(buf + SNAPSHOT_OBJECTS) + i;
+    ftype_dict_entry_t *from, *to;
+    uintptr_t *items;
+
+    *dst = *src;
+    dst->ref_count = 0;
+    dst->flags = 0;
+
+    switch (src->type) {
+    case FTYPE_STRING:
+        dst->string.data = (char *)snapshot_put_str(buf, str, src->string.data,
+                                                    src->string.length);
+        break;
+    case FTYPE_LIST:
+        dst->list.capacity = src->list.length;
+        dst->list.items = NULL;
+        if (src->list.length == 0)
+            break;
+        dst->list.items = (void **)*arr;
+        items = (uintptr_t *)(buf + *arr);
+        for (k = 0; k < src->list.length; k++)
+            items[k] = snapshot_obj_off(w, src->list.items[k]);
+        *arr += snapshot_align(src->list.length * sizeof(fobject_t *));
+        break;
+    case FTYPE_DICT:
+        dst->dict.capacity = src->dict.num_entries;
+        dst->dict.entries = NULL;
+        dst->dict.slots = NULL;
+        if (src->dict.num_entries != 0) {
+            dst->dict.entries = (ftype_dict_entry_t *)*arr;
+            to = (ftype_dict_entry_t *)(buf + *arr);
+            for (k = 0; k < src->dict.num_entries; k++) {
+                from = &src->dict.entries[k];
+                to[k].hash = from->hash;
+                if (from->value == NULL)
+                    continue; /* deleted; key and value stay 0 */
+                to[k].key_len = from->key_len;
+                to[k].key = (char *)snapshot_put_str(buf, str, from->key,
+                                                     from->key_len);
+                to[k].value = (fobject_t *)snapshot_obj_off(w, from->value);
+            }
+            *arr += snapshot_align(src->dict.num_entries *
+                                   sizeof(ftype_dict_entry_t));
+        }
+        if (src->dict.num_slots != 0) {
+            dst->dict.slots = (uint32_t *)*arr;
+            memcpy(buf + *arr, src->dict.slots,
+                   src->dict.num_slots * sizeof(uint32_t));
+            *arr += snapshot_align(src->dict.num_slots * sizeof(uint32_t));
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int snapshot_write(const char *path, const char *buf, size_t size)
+{
+    int fd, ret;
+    sink_t out;
+    char *tmp;
+    size_t len = strlen(path) + sizeof(".XXXXXX");
+
+    tmp = safe_malloc(len);
+    snprintf(tmp, len, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        LOG_ERR("snapshot: failed to create %s", tmp);
+        safe_free(tmp);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    sink_open_fd(&out, fd);
+    ret = sink_write(&out, buf, size);
+    if (sink_close(&out) != 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -1;
+    if (ret != 0) {
+        LOG_ERR("snapshot: failed to write %s", path);
+        unlink(tmp);
+    }
+    safe_free(tmp);
+    return ret;
+}
+
+int snapshot_save(fobject_t *root, uint64_t key, const char *path)
+{
+    int ret = -1;
+    char *buf = NULL;
+    size_t i, arrays, strings, arr, str, size;
+    snapshot_header_t *hdr;
+    snapshot_writer_t w;
+
+    memset(&w, 0, sizeof(snapshot_writer_t));
+    if (snapshot_order(&w, root) != 0)
+        goto out;
+
+    snapshot_sizes(&w, &arrays, &strings);
+    arr = SNAPSHOT_OBJECTS + w.count * sizeof(fobject_t);
+    str = arr + arrays;
+    size = str + strings;
+    buf = safe_calloc(1, size);
+
+    hdr = (snapshot_header_t *)buf;
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->byte_order = SNAPSHOT_BYTE_ORDER;
+    hdr->obj_size = sizeof(fobject_t);
+    hdr->entry_size = sizeof(ftype_dict_entry_t);
+    hdr->key = key;
+    hdr->size = size;
+    hdr->num_objects = w.count;
+    hdr->strings_off = str;
+
+    for (i = 0; i < w.count; i++)
+        snapshot_put(&w, buf, i, &arr, &str);
+
+    ret = snapshot_write(path, buf, size);
+out:
+    safe_free(buf);
+    safe_free(w.order);
+    safe_free(w.slots);
+    safe_free(w.stack);
+    return ret;
+}
+
+/**
+ * The checks below make sure that a damaged file can't send any pointer
+ * out of the mapping. Arrays are relocated in place, so they must come in
+ * file order and never overlap (`*cursor`), and must end before the
+ * strings, which are only ever read.
+ */
+
+static int snapshot_array(snapshot_header_t *hdr, size_t *cursor,
+                          uintptr_t off, size_t count, size_t elem_size,
+                          void **out)
+{
+    if (count == 0) {
+        *out = NULL;
+        return off == 0 ? 0 : -1;
+    }
+    if (off < *cursor || off % SNAPSHOT_ALIGN != 0 ||
+        off > hdr->strings_off ||
+        count > (hdr->strings_off - off) / elem_size)
+        return -1;
+    *cursor = off + count * elem_size;
+    *out = (char *)hdr + off;
+    return 0;
+}
+
+static int snapshot_string(snapshot_header_t *hdr, uintptr_t off,
+                           size_t len, char **out)
+{
+    if (off < hdr->strings_off || off >= hdr->size ||
+        len >= hdr->size - off || ((char *)hdr)[off + len] != '\0')
+        return -1;
+    *out = (char *)hdr + off;
+    return 0;
+}
+
+/* A reference from objects[parent]; must point to a later object */
+static int snapshot_ref(snapshot_header_t *hdr, size_t parent,
+                        uintptr_t off, fobject_t **out)
+{
+    size_t i;
+
+    if (off == 0) {
+        *out = NULL;
+        return 0;
+    }
+    if (off < SNAPSHOT_OBJECTS ||
+        (off - SNAPSHOT_OBJECTS) % sizeof(fobject_t) != 0)
+        return -1;
+    i = (off - SNAPSHOT_OBJECTS) / sizeof(fobject_t);
+    if (i <= parent || i >= hdr->num_objects)
+        return -1;
+    *out = (fobject_t *)((char *)hdr + off);
+    return 0;
+}
+
+static int snapshot_relocate_dict(snapshot_header_t *hdr, size_t i,
+                                  fobject_t *obj, size_t *cursor)
+{
+    size_t k, live = 0;
+    ftype_dict_entry_t *e;
+    void *p;
+
+    if (obj->dict.parent != NULL)
+        return -1;
+    if (snapshot_array(hdr, cursor, (uintptr_t)obj->dict.entries,
+                       obj->dict.num_entries, sizeof(ftype_dict_entry_t), &p))
+        return -1;
+    obj->dict.entries = p;
+    obj->dict.capacity = obj->dict.num_entries;
+
+    /* a power of 2 with at least one empty slot, unless the dict is empty */
+    if (obj->dict.num_slots & (obj->dict.num_slots - 1) ||
+        (obj->dict.num_slots != 0 &&
+         obj->dict.num_slots <= obj->dict.num_entries) ||
+        (obj->dict.num_slots == 0 && obj->dict.num_entries != 0))
+        return -1;
+    if (snapshot_array(hdr, cursor, (uintptr_t)obj->dict.slots,
+                       obj->dict.num_slots, sizeof(uint32_t), &p))
+        return -1;
+    obj->dict.slots = p;
+    for (k = 0; k < obj->dict.num_slots; k++) {
+        if (obj->dict.slots[k] != FDICT_SLOT_EMPTY &&
+            obj->dict.slots[k] >= obj->dict.num_entries)
+            return -1;
+    }
+
+    for (k = 0; k < obj->dict.num_entries; k++) {
+        e = &obj->dict.entries[k];
+        if (e->value == NULL) {
+            e->key = NULL;
+            e->key_len = 0;
+            continue;
+        }
+        if (snapshot_ref(hdr, i, (uintptr_t)e->value, &e->value) ||
+            snapshot_string(hdr, (uintptr_t)e->key, e->key_len, &e->key))
+            return -1;
+        live++;
+    }
+    return live == obj->dict.count ? 0 : -1;
+}
+
+static int snapshot_relocate(snapshot_header_t *hdr)
+{
+    size_t i, k, cursor;
+    fobject_t *obj, **items;
+    char *data;
+    void *p;
+
+    cursor = SNAPSHOT_OBJECTS + hdr->num_objects * sizeof(fobject_t);
+    for (i = 0; i < hdr->num_objects; i++) {
+        obj = (fobject_t *)((char *)hdr + SNAPSHOT_OBJECTS) + i;
+        obj->ref_count = SNAPSHOT_PINNED;
+        obj->flags = FOBJ_F_SNAPSHOT;
+        switch (obj->type) {
+        case FTYPE_NIL:
+        case FTYPE_NUMBER:
+        case FTYPE_BOOLEAN:
+            break;
+        case FTYPE_STRING:
+            if (snapshot_string(hdr, (uintptr_t)obj->string.data,
+                                obj->string.length, &data))
+                return -1;
+            obj->string.data = data;
+            break;
+        case FTYPE_LIST:
+            if (snapshot_array(hdr, &cursor, (uintptr_t)obj->list.items,
+                               obj->list.length, sizeof(fobject_t *), &p))
+                return -1;
+            items = p;
+            for (k = 0; k < obj->list.length; k++) {
+                if (snapshot_ref(hdr, i, (uintptr_t)items[k], &items[k]))
+                    return -1;
+            }
+            obj->list.items = (void **)items;
+            obj->list.capacity = obj->list.length;
+            break;
+        case FTYPE_DICT:
+            if (snapshot_relocate_dict(hdr, i, obj, &cursor))
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+fobject_t *snapshot_load(const char *path, uint64_t key)
+{
+    source_t src;
+    snapshot_header_t *hdr;
+    fobject_t *root;
+
+    if (access(path, F_OK) != 0 || source_load_private(&src, path) != 0)
+        return NULL; /* not saved yet */
+
+    hdr = (snapshot_header_t *)src.buf;
+    if (src.size < SNAPSHOT_OBJECTS + sizeof(fobject_t) ||
+        memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SNAPSHOT_VERSION ||
+        hdr->byte_order != SNAPSHOT_BYTE_ORDER ||
+        hdr->obj_size != sizeof(fobject_t) ||
+        hdr->entry_size != sizeof(ftype_dict_entry_t) ||
+        hdr->size != src.size)
+        goto error;
+    if (hdr->key != key) {
+        source_unload(&src);
+        return NULL; /* stale */
+    }
+    if (hdr->num_objects == 0 ||
+        hdr->num_objects > (src.size - SNAPSHOT_OBJECTS) / sizeof(fobject_t) ||
+        hdr->strings_off > src.size ||
+        hdr->strings_off < SNAPSHOT_OBJECTS +
+                           hdr->num_objects * sizeof(fobject_t) ||
+        snapshot_relocate(hdr) != 0)
+        goto error;
+
+    root = (fobject_t *)(src.buf + SNAPSHOT_OBJECTS);
+    if (root->type != FTYPE_DICT)
+        goto error;
+    root->ref_count = 1;
+    hdr->map.src = src;
+    return root;
+error:
+    LOG_ERR("snapshot: ignoring damaged snapshot %s", path);
+    source_unload(&src);
+    return NULL;
+}
+
+void snapshot_release(fobject_t *root)
+{
+    snapshot_header_t *hdr;
+    source_t src;
+
+    hdr = (snapshot_header_t *)((char *)root - SNAPSHOT_OBJECTS);
+    src = hdr->map.src;
+    source_unload(&src);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "fobjects.h"
+
+/**
+ * @brief Save the tree under `root` to `path`, tagged with `key` (the
+ * hash of whatever it was built from). The file is replaced atomically.
+ */
+int snapshot_save(fobject_t *root, uint64_t key, const char *path);
+
+/**
+ * @brief Map a snapshot saved with `key` and return its root, or NULL if
+ * there is none, it was saved with another key, or it is damaged. The
+ * objects are used in place and are read-only; dropping the last
+ * reference to the root unmaps all of them.
+ */
+fobject_t *snapshot_load(const char *path, uint64_t key);
+
+/* Called by __fobj_delete() for the root of a snapshot */
+void snapshot_release(fobject_t *root);
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utils/utils.h>
+
+#include "source.h"
+
+#define SOURCE_READ_CHUNK              (64 * 1024)
+
+static int source_read_fd(source_t *src, int fd)
+{
+    char *buf = NULL;
+    ssize_t ret;
+    size_t len = 0, cap = 0;
+
+    while (1) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : SOURCE_READ_CHUNK;
+            buf = safe_realloc(buf, cap);
+        }
+        ret = read(fd, buf + len, cap - len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            safe_free(buf);
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        len += ret;
+    }
+    src->buf = buf;
+    src->size = len;
+    src->mapped = false;
+    return 0;
+}
+
+static int source_map(source_t *src, const char *path, bool writable)
+{
+    int fd, ret = -1;
+    void *addr;
+    struct stat st;
+
+    memset(src, 0, sizeof(source_t));
+
+    if (strcmp(path, "-") == 0)
+        return source_read_fd(src, STDIN_FILENO);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0)
+        goto out;
+
+    if (!S_ISREG(st.st_mode)) {
+        ret = source_read_fd(src, fd);
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        /* can't mmap zero bytes; an empty source is still valid */
+        ret = 0;
+        goto out;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        ret = source_read_fd(src, fd);
+        goto out;
+    }
+    /* the lexer makes a single front to back pass over templates */
+    if (!writable)
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    src->buf = addr;
+    src->size = st.st_size;
+    src->mapped = true;
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+int source_load(source_t *src, const char *path)
+{
+    return source_map(src, path, false);
+}
+
+int source_load_private(source_t *src, const char *path)
+{
+    return source_map(src, path, true);
+}
+
+void source_unload(source_t *src)
+{
+    if (src->mapped)
+        munmap((void *)src->buf, src->size);
+    else
+        safe_free((void *)src->buf);
+    memset(src, 0, sizeof(source_t));
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SOURCE_H_
+#define _SOURCE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Read-only contents of a file. Regular files are mmap-ed; pipes,
+ * character devices and stdin (path "-") are read into a heap buffer.
+ */
+typedef struct {
+    const char *buf;
+    size_t size;
+    bool mapped;
+} source_t;
+
+int source_load(source_t *src, const char *path);
+/* Like source_load(), but buf may be written to; changes stay private */
+int source_load_private(source_t *src, const char *path);
+void source_unload(source_t *src);
+
+#endif /* _SOURCE_H_ */
@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <utils/logger.h>
+
+#include "vm.h"
+
+LOGGER_MODULE_EXTERN(fluid, vm);
+
+#define VM_INT_MAX                     9007199254740992.0 /* 2^53 */
+
+/* A running for loop; items first..stop of a list or a range */
+typedef struct {
+    fobject_t *coll;          /* NULL for ranges */
+    long long base;           /* range start */
+    long long k;
+    long long stop;
+    int step;
+} vm_iter_t;
+
+typedef struct {
+    vm_program_t *prog;
+    fobject_t *globals;
+    fobject_t **regs;
+    fobject_t **locals;
+    vm_iter_t *loops;
+    long long *counters;
+    sink_t *caps;
+    uint32_t num_caps;
+    sink_t *root;
+    sink_t *out;              /* root, or the innermost capture */
+    fobject_t *bools[2];
+} vm_t;
+
+static inline void vm_set(fobject_t **slot, fobject_t *val)
+{
+    DEC_REF(*slot);
+    *slot = val;
+}
+
+bool vm_truthy(fobject_t *v)
+{
+    if (v == NULL || v->type == FTYPE_NIL)
+        return false;
+    if (v->type == FTYPE_BOOLEAN)
+        return v->boolean.data;
+    return true;
+}
+
+static int vm_to_ll(fobject_t *v, long long *val)
+{
+    double d;
+
+    if (v == NULL || v->type != FTYPE_NUMBER)
+        return -1;
+    /* keep range and limit arithmetic well clear of overflow */
+    d = v->number.data;
+    if (d != d)
+        return -1;
+    d = d < -VM_INT_MAX ? -VM_INT_MAX : (d > VM_INT_MAX ? VM_INT_MAX : d);
+    *val = (long long)d;
+    return 0;
+}
+
+static int vm_format_number(double d, char *buf, size_t size)
+{
+    if (d >= -1e15 && d <= 1e15 && d == (double)(long long)d)
+        return snprintf(buf, size, "%lld", (long long)d);
+    return snprintf(buf, size, "%.15g", d);
+}
+
+int vm_write_value(sink_t *out, fobject_t *v)
+{
+    int len;
+    size_t i;
+    char buf[32];
+
+    if (v == NULL)
+        return 0;
+
+    switch (v->type) {
+    case FTYPE_NUMBER:
+        len = vm_format_number(v->number.data, buf, sizeof(buf));
+        return sink_write(out, buf, len);
+    case FTYPE_STRING:
+        /* the object may be gone by the time the sink is flushed */
+        return sink_write(out, v->string.data, v->string.length);
+    case FTYPE_BOOLEAN:
+        return v->boolean.data ? sink_write(out, "true", 4) :
+                                 sink_write(out, "false", 5);
+    case FTYPE_LIST:
+        for (i = 0; i < v->list.length; i++) {
+            if (vm_write_value(out, v->list.items[i]))
+                return -1;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+fobject_t *vm_apply_filter(liq_filter_t *f, fobject_t *v)
+{
+    size_t len;
+    sink_t tmp;
+    char *data;
+    fobject_t *res = NULL;
+
+    sink_open_mem(&tmp);
+    vm_write_value(&tmp, v);
+    sink_write(&tmp, "", 1);
+    data = (char *)sink_mem_data(&tmp, &len);
+    if (filter_execute(f, data) == 0)
+        res = fobj_from_cstring(data);
+    else
+        LOG_ERR("filter %d failed", f->id);
+    sink_close(&tmp);
+    return res;
+}
+
+static bool vm_equal(fobject_t *l, fobject_t *r)
+{
+    bool l_nil = (l == NULL || l->type == FTYPE_NIL);
+    bool r_nil = (r == NULL || r->type == FTYPE_NIL);
+
+    if (l_nil || r_nil)
+        return l_nil && r_nil;
+    if (l->type != r->type)
+        return false;
+    switch (l->type) {
+    case FTYPE_NUMBER:
+        return l->number.data == r->number.data;
+    case FTYPE_STRING:
+        return l->string.length == r->string.length &&
+               memcmp(l->string.data, r->string.data, l->string.length) == 0;
+    case FTYPE_BOOLEAN:
+        return l->boolean.data == r->boolean.data;
+    default:
+        return l == r;
+    }
+}
+
+static bool vm_contains(fobject_t *l, fobject_t *r)
+{
+    size_t i;
+
+    if (l == NULL || r == NULL)
+        return false;
+    if (l->type == FTYPE_LIST) {
+        for (i = 0; i < l->list.length; i++) {
+            if (vm_equal(l->list.items[i], r))
+                return true;
+        }
+        return false;
+    }
+    if (l->type != FTYPE_STRING || r->type != FTYPE_STRING)
+        return false;
+    if (r->string.length > l->string.length)
+        return false;
+    for (i = 0; i + r->string.length <= l->string.length; i++) {
+        if (memcmp(l->string.data + i, r->string.data,
+                   r->string.length) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool vm_order(enum liq_operators op, int cmp)
+{
+    switch (op) {
+    case LIQ_OP_LESS:        return cmp < 0;
+    case LIQ_OP_GREAT:       return cmp > 0;
+    case LIQ_OP_LESS_EQUAL:  return cmp <= 0;
+    case LIQ_OP_GREAT_EQUAL: return cmp >= 0;
+    default:                 return false;
+    }
+}
+
+static int vm_number_cmp(double l, double r)
+{
+    return (l > r) - (l < r);
+}
+
+bool vm_compare(enum liq_operators op, fobject_t *l, fobject_t *r)
+{
+    int cmp;
+
+    switch (op) {
+    case LIQ_OP_EQUAlS:
+        return vm_equal(l, r);
+    case LIQ_OP_NOT_EQUAL:
+        return !vm_equal(l, r);
+    case LIQ_OP_CONTAINS:
+        return vm_contains(l, r);
+    default:
+        break;
+    }
+
+    /* ordering is only defined between two numbers or two strings */
+    if (l == NULL || r == NULL || l->type != r->type)
+        return false;
+    if (l->type == FTYPE_NUMBER)
+        cmp = vm_number_cmp(l->number.data, r->number.data);
+    else if (l->type == FTYPE_STRING)
+        cmp = strcmp(l->string.data, r->string.data);
+    else
+        return false;
+    return vm_order(op, cmp);
+}
+
+/**
+ * CMP_CONST; the type of the constant is known, so a value of the same
+ * type is compared directly against it, without going through objects.
+ */
+static bool vm_compare_const(vm_program_t *prog, enum liq_operators op,
+                             fobject_t *l, uint32_t idx)
+{
+    vm_const_t *k = &prog->consts[idx];
+    const char *str;
+    bool eq;
+
+    if (l == NULL || op == LIQ_OP_CONTAINS)
+        return vm_compare(op, l, prog->const_objs[idx]);
+
+    if (l->type == FTYPE_NUMBER && k->type == VM_CONST_NUMBER) {
+        if (op == LIQ_OP_EQUAlS || op == LIQ_OP_NOT_EQUAL)
+            return (l->number.data == k->number) == (op == LIQ_OP_EQUAlS);
+        return vm_order(op, vm_number_cmp(l->number.data, k->number));
+    }
+    if (l->type == FTYPE_STRING && k->type == VM_CONST_STRING) {
+        str = prog->strtab + k->string.off;
+        if (op == LIQ_OP_EQUAlS || op == LIQ_OP_NOT_EQUAL) {
+            eq = l->string.length == k->string.len &&
+                 memcmp(l->string.data, str, k->string.len) == 0;
+            return eq == (op == LIQ_OP_EQUAlS);
+        }
+        return vm_order(op, strcmp(l->string.data, str));
+    }
+    return vm_compare(op, l, prog->const_objs[idx]);
+}
+
+fobject_t *vm_path_step(fobject_t *cur, vm_seg_t *seg, const char *key,
+                        bool last)
+{
+    fobject_t *next = NULL;
+
+    if (cur == NULL)
+        return NULL;
+    if (seg->kind == VM_SEG_INDEX) {
+        if (flist_get_item(cur, seg->index, &next) != 0)
+            next = NULL;
+        return INC_REF(next);
+    }
+    if (cur->type == FTYPE_DICT)
+        next = fdict_lookup(cur, key, seg->key.len, seg->hash);
+    if (next == NULL && cur->type == FTYPE_LIST && cur->list.length) {
+        if (seg->kind == VM_SEG_FIRST)
+            next = cur->list.items[0];
+        else if (seg->kind == VM_SEG_LAST)
+            next = cur->list.items[cur->list.length - 1];
+    }
+    if (next == NULL && last && seg->kind == VM_SEG_SIZE) {
+        if (cur->type == FTYPE_LIST)
+            return fobj_from_double(cur->list.length);
+        if (cur->type == FTYPE_STRING)
+            return fobj_from_double(cur->string.length);
+        if (cur->type == FTYPE_DICT)
+            return fobj_from_double(fdict_length(cur));
+    }
+    return INC_REF(next);
+}
+
+/* Returns a new reference to the value at `path`, or NULL */
+static fobject_t *vm_load_path(vm_t *vm, vm_path_t *path)
+{
+    uint32_t i = 0;
+    vm_seg_t *seg;
+    fobject_t *cur = vm->globals, *next;
+
+    if (path->local != VM_NONE && vm->locals[path->local]) {
+        cur = vm->locals[path->local];
+        i = 1;
+    }
+    cur = INC_REF(cur);
+    for (; cur && i < path->num_segs; i++) {
+        seg = &vm->prog->segs[path->first_seg + i];
+        next = vm_path_step(cur, seg, vm->prog->strtab + seg->key.off,
+                            i + 1 == path->num_segs);
+        DEC_REF(cur);
+        cur = next;
+    }
+    return cur;
+}
+
+void vm_loop_bounds(fobject_t **regs, uint8_t flags, long long *start,
+                    long long *first, long long *last)
+{
+    long long n = 0, end, val;
+
+    *start = 0;
+    if (flags & VM_FOR_RANGE) {
+        if (vm_to_ll(regs[0], start) == 0 &&
+            vm_to_ll(regs[1], &end) == 0 && end >= *start)
+            n = end - *start + 1;
+    }
+    else if (regs[0] && regs[0]->type == FTYPE_LIST) {
+        n = regs[0]->list.length;
+    }
+    *first = 0;
+    *last = n;
+    if ((flags & VM_FOR_OFFSET) && vm_to_ll(regs[3], &val) == 0)
+        *first = val < 0 ? 0 : (val > n ? n : val);
+    if ((flags & VM_FOR_LIMIT) && vm_to_ll(regs[2], &val) == 0)
+        *last = val < 0 ? *first : (*first + val > n ? n : *first + val);
+}
+
+static void vm_iter_init(vm_iter_t *it, fobject_t **regs, uint8_t flags)
+{
+    long long first, last;
+
+    DEC_REF(it->coll);
+    it->coll = NULL;
+    vm_loop_bounds(regs, flags, &it->base, &first, &last);
+    if (!(flags & VM_FOR_RANGE) && first < last)
+        it->coll = INC_REF(regs[0]);
+    if (flags & VM_FOR_REVERSED) {
+        it->k = last - 1;
+        it->stop = first - 1;
+        it->step = -1;
+    } else {
+        it->k = first;
+        it->stop = last;
+        it->step = 1;
+    }
+}
+
+static fobject_t *vm_iter_next(vm_iter_t *it)
+{
+    fobject_t *item;
+
+    if (it->k == it->stop) {
+        DEC_REF(it->coll);
+        it->coll = NULL;
+        return NULL;
+    }
+    if (it->coll) {
+        item = INC_REF(it->coll->list.items[it->k]);
+        if (item == NULL)
+            item = __fobj_new(FTYPE_NIL);
+    }
+    else {
+        item = fobj_from_double(it->base + it->k);
+    }
+    it->k += it->step;
+    return item;
+}
+
+static void vm_load_consts(vm_program_t *prog)
+{
+    uint32_t i;
+    vm_const_t *k;
+
+    if (prog->const_objs || prog->num_consts == 0)
+        return;
+    prog->const_objs = safe_calloc(prog->num_consts, sizeof(fobject_t *));
+    for (i = 0; i < prog->num_consts; i++) {
+        k = &prog->consts[i];
+        switch (k->type) {
+        case VM_CONST_NUMBER:
+            prog->const_objs[i] = fobj_from_double(k->number);
+            break;
+        case VM_CONST_STRING:
+            prog->const_objs[i] = fobj_from_string(prog->strtab +
+                                                   k->string.off,
+                                                   k->string.len);
+            break;
+        case VM_CONST_BOOLEAN:
+            prog->const_objs[i] = fobj_from_bool(k->boolean);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void vm_setup(vm_t *vm, vm_program_t *prog, fobject_t *globals,
+                     sink_t *out)
+{
+    memset(vm, 0, sizeof(vm_t));
+    vm->prog = prog;
+    vm->globals = globals;
+    vm->regs = safe_calloc((size_t)prog->num_regs + 1, sizeof(fobject_t *));
+    vm->locals = safe_calloc((size_t)prog->num_locals + 1,
+                             sizeof(fobject_t *));
+    vm->loops = safe_calloc((size_t)prog->num_loops + 1, sizeof(vm_iter_t));
+    vm->counters = safe_calloc((size_t)prog->num_counters + 1,
+                               sizeof(long long));
+    vm->caps = safe_calloc((size_t)prog->max_captures + 1, sizeof(sink_t));
+    vm->root = out;
+    vm->out = out;
+    vm->bools[0] = fobj_from_bool(false);
+    vm->bools[1] = fobj_from_bool(true);
+    vm_load_consts(prog);
+}
+
+static void vm_teardown(vm_t *vm)
+{
+    uint32_t i;
+    vm_program_t *prog = vm->prog;
+
+    for (i = 0; i < prog->num_regs; i++)
+        DEC_REF(vm->regs[i]);
+    for (i = 0; i < prog->num_locals; i++)
+        DEC_REF(vm->locals[i]);
+    for (i = 0; i < prog->num_loops; i++)
+        DEC_REF(vm->loops[i].coll);
+    for (i = 0; i < vm->num_caps; i++)
+        sink_close(&vm->caps[i]);
+    DEC_REF(vm->bools[0]);
+    DEC_REF(vm->bools[1]);
+    safe_free(vm->regs);
+    safe_free(vm->locals);
+    safe_free(vm->loops);
+    safe_free(vm->counters);
+    safe_free(vm->caps);
+}
+
+/**
+ * Dispatch is a computed goto (one indirect jump per instruction, which
+ * predicts far better than a switch) where the compiler supports it.
+ */
+#if defined(__GNUC__)
+#define VM_LABEL_ADDR(op)              &&vm_op_##op,
+#define VM_CASE(op)                    vm_op_##op
+#define VM_NEXT()                      goto *dispatch[(insn = &code[pc++])->op]
+#define VM_DISPATCH()                  VM_NEXT();
+#else
+#define VM_CASE(op)                    case VM_OP_##op
+#define VM_NEXT()                      continue
+#define VM_DISPATCH()                  for (;;) switch ((insn = &code[pc++])->op)
+#endif
+
+fobject_t *vm_globals(fobject_t *config)
+{
+    fobject_t *globals;
+
+    if (config == NULL)
+        return NULL;
+    globals = fdict_new();
+    fdict_insert_item(globals, "config", config);
+    if (config->type == FTYPE_DICT)
+        fdict_set_parent(globals, config);
+    return globals;
+}
+
+int vm_render(vm_program_t *prog, fobject_t *globals, sink_t *out)
+{
+#if defined(__GNUC__)
+    static const void *dispatch[] = { VM_OPCODES(VM_LABEL_ADDR) };
+#endif
+    vm_t vm;
+    int ret = 0;
+    size_t len;
+    char buf[32];
+    const char *data;
+    uint32_t pc = 0;
+    vm_insn_t *insn, *code = prog->code;
+    fobject_t **regs, *val;
+
+    vm_setup(&vm, prog, globals, out);
+    regs = vm.regs;
+
+    VM_DISPATCH() {
+    VM_CASE(HALT):
+        goto done;
+    VM_CASE(EMIT_SPAN):
+        sink_write_ref(vm.out, prog->strtab + prog->spans[insn->imm].off,
+                       prog->spans[insn->imm].len);
+        VM_NEXT();
+    VM_CASE(EMIT):
+        vm_write_value(vm.out, regs[insn->a]);
+        VM_NEXT();
+    VM_CASE(LOAD_CONST):
+        val = prog->const_objs[insn->imm];
+        vm_set(&regs[insn->a], INC_REF(val));
+        VM_NEXT();
+    VM_CASE(LOAD_PATH):
+        vm_set(&regs[insn->a], vm_load_path(&vm, &prog->paths[insn->imm]));
+        VM_NEXT();
+    VM_CASE(FILTER):
+        val = vm_apply_filter(&prog->filters[insn->imm], regs[insn->a]);
+        if (val == NULL) {
+            ret = -1;
+            goto done;
+        }
+        vm_set(&regs[insn->a], val);
+        VM_NEXT();
+    VM_CASE(STORE):
+        vm_set(&vm.locals[insn->imm], regs[insn->a]);
+        regs[insn->a] = NULL;
+        VM_NEXT();
+    VM_CASE(CMP):
+        val = vm.bools[vm_compare(insn->imm, regs[insn->b], regs[insn->c])];
+        vm_set(&regs[insn->a], INC_REF(val));
+        VM_NEXT();
+    VM_CASE(CMP_CONST):
+        val = vm.bools[vm_compare_const(prog, insn->c, regs[insn->b],
+                                        insn->imm)];
+        vm_set(&regs[insn->a], INC_REF(val));
+        VM_NEXT();
+    VM_CASE(JUMP):
+        pc = insn->imm;
+        VM_NEXT();
+    VM_CASE(JUMP_IF):
+        if (vm_truthy(regs[insn->a]))
+            pc = insn->imm;
+        VM_NEXT();
+    VM_CASE(JUMP_IFNOT):
+        if (!vm_truthy(regs[insn->a]))
+            pc = insn->imm;
+        VM_NEXT();
+    VM_CASE(FOR_INIT):
+        vm_iter_init(&vm.loops[insn->a], &regs[insn->b], insn->c);
+        if (vm.loops[insn->a].k == vm.loops[insn->a].stop)
+            pc = insn->imm;
+        VM_NEXT();
+    VM_CASE(FOR_ITER):
+        val = vm_iter_next(&vm.loops[insn->a]);
+        if (val == NULL)
+            pc = insn->imm;
+        vm_set(&regs[insn->b], val);
+        VM_NEXT();
+    VM_CASE(CAPTURE_BEGIN):
+        if (vm.num_caps == prog->max_captures) {
+            LOG_ERR("capture nesting overflow at %u", pc - 1);
+            ret = -1;
+            goto done;
+        }
+        vm.out = &vm.caps[vm.num_caps++];
+        sink_open_mem(vm.out);
+        VM_NEXT();
+    VM_CASE(CAPTURE_END):
+        if (vm.num_caps == 0) {
+            LOG_ERR("capture underflow at %u", pc - 1);
+            ret = -1;
+            goto done;
+        }
+        data = sink_mem_data(vm.out, &len);
+        vm_set(&vm.locals[insn->imm], fobj_from_string(data ? data : "", len));
+        sink_close(vm.out);
+        vm.num_caps--;
+        vm.out = vm.num_caps ? &vm.caps[vm.num_caps - 1] : vm.root;
+        VM_NEXT();
+    VM_CASE(INCREMENT):
+        len = snprintf(buf, sizeof(buf), "%lld", vm.counters[insn->imm]++);
+        sink_write(vm.out, buf, len);
+        VM_NEXT();
+    VM_CASE(DECREMENT):
+        len = snprintf(buf, sizeof(buf), "%lld", --vm.counters[insn->imm]);
+        sink_write(vm.out, buf, len);
+        VM_NEXT();
+#if !defined(__GNUC__)
+    default:
+        LOG_ERR("bad opcode %d at %u", insn->op, pc - 1);
+        ret = -1;
+        goto done;
+#endif
+    }
+done:
+    vm_teardown(&vm);
+    if (ret == 0 && out->error)
+        ret = -1;
+    return ret;
+}
+
+void vm_program_free(vm_program_t *prog)
+{
+    uint32_t i;
+
+    if (prog == NULL)
+        return;
+    if (prog->const_objs) {
+        for (i = 0; i < prog->num_consts; i++)
+            DEC_REF(prog->const_objs[i]);
+        safe_free(prog->const_objs);
+    }
+    if (prog->image.buf) {
+        source_unload(&prog->image);
+        safe_free(prog);
+        return;
+    }
+    safe_free(prog->code);
+    safe_free(prog->strtab);
+    safe_free(prog->spans);
+    safe_free(prog->consts);
+    safe_free(prog->paths);
+    safe_free(prog->segs);
+    safe_free(prog->filters);
+    safe_free(prog);
+}
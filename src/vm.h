@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _VM_H_
+#define _VM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "filter.h"
+#include "fobjects.h"
+#include "parser.h"
+#include "sink.h"
+#include "source.h"
+
+#define VM_NONE                        UINT32_MAX
+#define VM_MAX_REGS                    256
+#define VM_MAX_SLOTS                   65536 /* locals, counters, captures */
+
+/**
+ * Opcodes. Operands are in the a/b/c (registers, small values) and imm
+ * (jump targets and pool indices) fields of vm_insn_t.
+ */
+#define VM_OPCODES(X)                                                        \
+    X(HALT)          /* stop */                                             \
+    X(EMIT_SPAN)     /* write prog->spans[imm] */                           \
+    X(EMIT)          /* write the value in reg a */                         \
+    X(LOAD_CONST)    /* reg a = prog->consts[imm] */                        \
+    X(LOAD_PATH)     /* reg a = value at prog->paths[imm] */                \
+    X(FILTER)        /* reg a = prog->filters[imm] applied to reg a */      \
+    X(STORE)         /* local imm = reg a */                                \
+    X(CMP)           /* reg a = reg b <operator imm> reg c */               \
+    X(CMP_CONST)     /* reg a = reg b <operator c> prog->consts[imm] */     \
+    X(JUMP)          /* pc = imm */                                         \
+    X(JUMP_IF)       /* if reg a is truthy, pc = imm */                     \
+    X(JUMP_IFNOT)    /* if reg a is falsy, pc = imm */                      \
+    X(FOR_INIT)      /* start loop a over regs b..b+3 (flags c); empty: pc = imm */ \
+    X(FOR_ITER)      /* reg b = next item of loop a; done: pc = imm */      \
+    X(CAPTURE_BEGIN) /* send output to a new capture buffer */              \
+    X(CAPTURE_END)   /* local imm = captured output */                      \
+    X(INCREMENT)     /* write counter imm, then add 1 */                    \
+    X(DECREMENT)     /* subtract 1 from counter imm, then write it */
+
+#define VM_OPCODE_ENUM(op)             VM_OP_##op,
+
+enum vm_opcode {
+    VM_OPCODES(VM_OPCODE_ENUM)
+    VM_OP_SENTINEL
+};
+
+/* FOR_INIT flags; regs b+1, b+2, b+3 hold range end, limit and offset */
+#define VM_FOR_RANGE                   0x01
+#define VM_FOR_REVERSED                0x02
+#define VM_FOR_LIMIT                   0x04
+#define VM_FOR_OFFSET                  0x08
+
+typedef struct {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t imm;
+} vm_insn_t;
+
+/* A string in prog->strtab; strtab[off + len] is always '\0' */
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} vm_str_t;
+
+enum vm_const_type {
+    VM_CONST_NIL,
+    VM_CONST_NUMBER,
+    VM_CONST_STRING,
+    VM_CONST_BOOLEAN,
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t boolean;
+    double number;
+    vm_str_t string;
+} vm_const_t;
+
+/* `.first`, `.last` and `.size` are keys that lists (and strings) answer */
+enum vm_seg_kind {
+    VM_SEG_KEY,
+    VM_SEG_INDEX,
+    VM_SEG_FIRST,
+    VM_SEG_LAST,
+    VM_SEG_SIZE,
+    VM_SEG_SENTINEL
+};
+
+/**
+ * One step of a path; a key (`.name`) or a list index (`[n]`). Keys are
+ * interned in strtab and hashed with fdict_hash() at compile time.
+ */
+typedef struct {
+    vm_str_t key;
+    uint32_t hash;
+    uint32_t kind;
+    uint32_t index;
+} vm_seg_t;
+
+/**
+ * `a.b[2].c` is segs[first_seg .. first_seg + num_segs). If `local` is
+ * not VM_NONE, the first segment names that local (an assign, capture or
+ * loop variable) which shadows the globals once it is set.
+ */
+typedef struct {
+    uint32_t local;
+    uint32_t first_seg;
+    uint32_t num_segs;
+} vm_path_t;
+
+/**
+ * @brief A compiled template.
+ *
+ * Everything is stored in flat arrays and refers to other parts of the
+ * program by index, and all text (template data, string literals, path
+ * keys) is copied into one string table. A program does not depend on the
+ * lexer, parser or the template source after vm_compile() returns and can
+ * be rendered any number of times, or saved and mapped back in later.
+ */
+typedef struct {
+    vm_insn_t *code;
+    uint32_t code_len;
+    char *strtab;
+    uint32_t strtab_len;
+    vm_str_t *spans;
+    uint32_t num_spans;
+    vm_const_t *consts;
+    uint32_t num_consts;
+    vm_path_t *paths;
+    uint32_t num_paths;
+    vm_seg_t *segs;
+    uint32_t num_segs;
+    liq_filter_t *filters;
+    uint32_t num_filters;
+    uint32_t num_regs;
+    uint32_t num_locals;
+    uint32_t num_loops;
+    uint32_t num_counters;
+    uint32_t max_captures;
+
+    /**
+     * Hash of the config files the program was specialized against, as
+     * set by the caller of vm_compile(); 0 if it was compiled without one.
+     * It holds values from them, so must not be rendered with others.
+     */
+    uint64_t config_hash;
+
+    /* runtime; constants as objects, created on first render */
+    fobject_t **const_objs;
+
+    /* set if loaded by vm_program_load(); the arrays point into it */
+    source_t image;
+} vm_program_t;
+
+/* compiler.c */
+vm_program_t *vm_compile(parser_t *p, fobject_t *config);
+
+/**
+ * Config keys the template can read, as a tree of dicts: each key maps
+ * to a dict of the keys wanted below it, or to nil if all of its value is
+ * wanted. Local variables are included, as they may read globals before
+ * they are set. NULL if the template reads all of the config.
+ */
+fobject_t *vm_config_paths(parser_t *p);
+
+/* vm.c */
+void vm_program_free(vm_program_t *prog);
+int vm_render(vm_program_t *prog, fobject_t *globals, sink_t *out);
+
+/**
+ * The globals a template is compiled and rendered with: `config` is the
+ * config, and its top level keys are visible by name as well. Returns a
+ * new reference; NULL if config is NULL.
+ */
+fobject_t *vm_globals(fobject_t *config);
+
+/* value semantics shared by the VM and compile time evaluation */
+bool vm_truthy(fobject_t *v);
+bool vm_compare(enum liq_operators op, fobject_t *l, fobject_t *r);
+int vm_write_value(sink_t *out, fobject_t *v);
+fobject_t *vm_apply_filter(liq_filter_t *f, fobject_t *v);
+
+/**
+ * Items [first, last) of a loop over regs[0] (or the range regs[0]..regs[1]
+ * that starts at `start`) after the offset in regs[3] and limit in regs[2].
+ */
+void vm_loop_bounds(fobject_t **regs, uint8_t flags, long long *start,
+                    long long *first, long long *last);
+
+/* New reference to `key` (or seg->index) of cur, or NULL */
+fobject_t *vm_path_step(fobject_t *cur, vm_seg_t *seg, const char *key,
+                        bool last);
+
+/* image.c; programs saved to and loaded from .fluidc files */
+int vm_program_save(vm_program_t *prog, sink_t *out);
+vm_program_t *vm_program_load(const char *path);
+
+#endif /* _VM_H_ */
@@ -0,0 +1,19 @@
+# Comparisons against constants, with either side constant, of each type
+
+printf 'n: 3\ns: "3"\nb: true\nz: null\nf: 2.5\nl: [1, 2]\nstr: hello\n' > k.yml
+
+# check <expected> <template>: folded, and by the VM from an image
+check()
+{
+    printf '%s' "$2" > t.html
+    expect_out "$1" -c k.yml t.html
+    "$FLUID" --compile -o t.fluidc t.html || { fail "compile $2"; return; }
+    expect_out "$1" -c k.yml t.fluidc
+}
+
+# numbers, and numbers against strings (never equal, never ordered)
+check "acdef" '{% if n == 3 %}a{% endif %}{% if s == 3 %}b{% endif %}{% if s == "3" %}c{% endif %}{% if n != 4 %}d{% endif %}{% if n < 3.5 %}e{% endif %}{% if n >= 3 %}f{% endif %}{% if n <= 2 %}g{% endif %}{% if n > "2" %}h{% endif %}'
+check "ace" '{% if 3 == n %}a{% endif %}{% if 4 == n %}b{% endif %}{% if 2 < n %}c{% endif %}{% if 3 > n %}d{% endif %}{% if "3" == s %}e{% endif %}'
+# booleans, nil, missing keys, and contains
+check "abcdefgh" '{% if b == true %}a{% endif %}{% if b != false %}b{% endif %}{% if z == nil %}c{% endif %}{% if missing == nil %}d{% endif %}{% if f > 2 %}e{% endif %}{% if str contains "ell" %}f{% endif %}{% if l contains 2 %}g{% endif %}{% if "a" < "b" %}h{% endif %}'
+check "ab" '{% if b %}a{% endif %}{% if z %}x{% endif %}{% unless missing %}b{% endunless %}'
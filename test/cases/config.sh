@@ -0,0 +1,26 @@
+# Config values reach templates as config.<key>, and by <key> alone
+
+cat > c.yml <<'END'
+title: Hello
+nav:
+  items: [a, b]
+  size: 2
+other: x
+END
+
+printf '{{ config.title }}|{{ title }}' > title.html
+expect_out "Hello|Hello" -c c.yml title.html
+printf '{{ config.nav.items.first }}{%% for i in config.nav.items %%}[{{ i }}]{%% endfor %%}' > nav.html
+expect_out "a[a][b]" -c c.yml nav.html
+expect_out "" nav.html
+printf '{%% if config.other == "x" %%}yes{%% endif %%}{{ config.nav.size }}' > cmp.html
+expect_out "yes2" -c c.yml cmp.html
+
+# config by itself is the whole config
+printf '{{ config.size }}' > size.html
+expect_out "3" -c c.yml size.html
+
+# a top level key named config is still there, below the root
+printf 'config: inner\n' > shadow.yml
+printf '{{ config.config }}' > shadow.html
+expect_out "inner" -c shadow.yml shadow.html
@@ -0,0 +1,45 @@
+# Compile time evaluation against the config: the output must be what
+# the VM alone renders, with the config only known at render time
+
+cat > c.yml <<'END'
+title: Site
+x: cfg
+flag: true
+n: 3
+items: [a, b, c]
+nav:
+  - { name: home, on: true }
+  - { name: about, on: false }
+END
+
+# check <expected> <template>: folded, from a folded image, and unfolded
+check()
+{
+    printf '%s' "$2" > t.html
+    expect_out "$1" -c c.yml t.html
+    "$FLUID" --compile -c c.yml -o folded.fluidc t.html || fail "compile $2"
+    expect_out "$1" -c c.yml folded.fluidc
+    "$FLUID" --compile -o plain.fluidc t.html || fail "compile $2"
+    expect_out "$1" -c c.yml plain.fluidc
+}
+
+check "Site|local" '{{ config.title }}|{% assign title = "local" %}{{ title }}'
+check "cfg12" '{% for i in (1..2) %}{{ x }}{% assign x = i %}{% endfor %}{{ x }}'
+check "yes" '{% if flag %}yes{% else %}no{% endif %}'
+check "ab" '{% for i in items %}{% if i == "c" %}{% break %}{% endif %}{{ i }}{% endfor %}'
+check "home" '{% for p in nav %}{% if p.on %}{{ p.name }}{% endif %}{% endfor %}'
+check "[Site3]" '{% capture s %}{{ title }}{{ n }}{% endcapture %}[{{ s }}]'
+check "3bc" '{{ items.size }}{{ items[1] }}{{ items.last }}'
+check "x3" '{% case n %}{% when 3 %}x{% endcase %}{{ n }}'
+check "0" '{% for i in items limit:1 %}{% increment k %}{% endfor %}'
+
+# constants, static captures and stores the compiler drops
+check "y" '{% assign a = "x" %}{% if flag %}{% assign a = "y" %}{% endif %}{{ a }}'
+check "z" '{% assign a = 1 %}{% capture a %}z{% endcapture %}{{ a }}'
+check "[b][b][b]" '{% capture s %}b{% endcapture %}{% for i in items %}[{{ s }}]{% endfor %}'
+check "abcd" 'a{{ "b" }}c{% if true %}d{% endif %}{% if false %}e{% endif %}'
+check "a-a" '{{ " a " | strip }}-{% assign t = " a " | strip %}{{ t }}'
+check "12" '{% assign u = 1 %}{{ u }}{% assign u = 2 %}{{ u }}{% assign u = 3 %}'
+
+# a folded span must not swallow text that a jump lands on
+check "ab|b|" '{% for i in (1..2) %}{% if i == 1 %}a{% endif %}b|{% endfor %}'
@@ -0,0 +1,12 @@
+# The fixtures in test/html, rendered with test/html/config.yml
+
+for t in "$TEST_DIR"/html/*.html; do
+    name=$(basename "$t" .html)
+    want=$(cat "$TEST_DIR/html/$name.out"; printf x)
+    want=${want%x}
+    expect_out "$want" -c "$TEST_DIR/html/config.yml" "$t"
+
+    "$FLUID" --compile -c "$TEST_DIR/html/config.yml" -o "$name.fluidc" "$t" ||
+        fail "compile $name"
+    expect_out "$want" -c "$TEST_DIR/html/config.yml" "$name.fluidc"
+done
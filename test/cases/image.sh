@@ -0,0 +1,64 @@
+# Compiled templates (.fluidc): round trip, and damaged images refused
+
+# patch_u32 <file> <offset> <hex bytes>: overwrite 4 bytes in place
+patch_u32()
+{
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# byte offset of section $2 in image $1; see vm_image_header_t
+section_off()
+{
+    od -A n -t u4 -j $((48 + 16 * $2)) -N 4 "$1" | tr -d ' '
+}
+
+printf '{%% assign x = 1 %%}{%% increment c %%}{{ x }}' > t.html
+printf '{%% capture y %%}a{%% endcapture %%}[{{ y }}]' >> t.html
+printf '{%% for i in (1..3) %%}{{ i }}{%% endfor %%}' >> t.html
+"$FLUID" --compile -o t.fluidc t.html || fail "compile t.html"
+expect_out "01[a]123" t.html
+expect_out "01[a]123" t.fluidc
+
+# a capture folded into an assign leaves as many spans as instructions
+printf 'a{%% capture y %%}a{%% endcapture %%}' > capture.html
+"$FLUID" --compile -o capture.fluidc capture.html || fail "compile capture"
+expect_out "a" capture.fluidc
+
+# no text or strings at all
+printf '{%% increment a %%}{%% increment a %%}' > counters.html
+"$FLUID" --compile -o counters.fluidc counters.html || fail "compile counters"
+expect_out "01" counters.fluidc
+
+cp t.fluidc bad.fluidc
+patch_u32 bad.fluidc 0 'XXXX'
+expect_fail "not a compiled template" bad.fluidc
+
+cp t.fluidc bad.fluidc
+patch_u32 bad.fluidc 8 '\143\0\0\0'
+expect_fail "incompatible" bad.fluidc
+
+head -c $(($(wc -c < t.fluidc) - 8)) t.fluidc > bad.fluidc
+expect_fail "corrupt or incompatible" bad.fluidc
+
+# header counts are sized on load; a huge one must not wrap around
+for off in 20 28 32; do
+    cp t.fluidc bad.fluidc
+    patch_u32 bad.fluidc $off '\377\377\377\377'
+    expect_fail "failed verification" bad.fluidc
+done
+
+# an unknown opcode in the first instruction
+cp t.fluidc bad.fluidc
+patch_u32 bad.fluidc "$(section_off t.fluidc 0)" '\377\377\377\377'
+expect_fail "failed verification" bad.fluidc
+
+# values folded from the config at compile time hold for that config only
+printf 'title: Hello\nitems: [a, b, c]\n' > c.yml
+printf 'title: Other\nitems: [z]\n' > other.yml
+printf '{{ title }}{%% for i in items %%}[{{ i }}]{%% endfor %%}' > c.html
+"$FLUID" --compile -c c.yml -o c.fluidc c.html || fail "compile c.html"
+expect_out "Hello[a][b][c]" -c c.yml c.fluidc
+expect_fail "compiled with other config" -c other.yml c.fluidc
+expect_fail "compiled with other config" c.fluidc
+"$FLUID" --compile -o plain.fluidc c.html || fail "compile without config"
+expect_out "Other[z]" -c other.yml plain.fluidc
@@ -0,0 +1,81 @@
+# Includes: resolved against the including file, cached, in parallel
+
+mkdir -p a b
+printf 'A' > a/p.html
+printf 'B' > b/p.html
+printf '{%% include p.html %%}' > a/x.html
+printf '{%% include p.html %%}' > b/y.html
+
+# the same name in two directories is two files, however often included
+printf '{%% include a/x.html %%}{%% include b/y.html %%}' > top.html
+printf '{%% include a/x.html %%}{%% include a/p.html %%}{%% include b/p.html %%}' >> top.html
+expect_out "ABAAB" top.html
+expect_out "ABAAB" --stream top.html
+
+# a partial included many times over, with objects in it
+printf '[{{ config.n }}]' > item.html
+printf 'n: 7\n' > c.yml
+i=0
+while [ $i -lt 500 ]; do
+    printf '{%% include item.html %%}'
+    i=$((i + 1))
+done > many.html
+expect_out "$(printf '%500s' '' | sed 's/ /[7]/g')" -c c.yml many.html
+
+# many distinct partials, nested, read by any number of threads
+mkdir -p parts
+i=0
+while [ $i -lt 64 ]; do
+    printf '<%d{%% include leaf%d.html %%}>' $i $((i % 8)) > parts/p$i.html
+    i=$((i + 1))
+done
+i=0
+while [ $i -lt 8 ]; do
+    printf '(leaf %d{%% raw %%}{{ x }}{%% endraw %%})' $i > parts/leaf$i.html
+    i=$((i + 1))
+done
+i=0
+while [ $i -lt 64 ]; do
+    printf '{%% include parts/p%d.html %%}' $i
+    i=$((i + 1))
+done > wide.html
+for jobs in 1 2 8 32; do
+    expect_same -j1 wide.html -- -j$jobs wide.html
+done
+expect_same -j1 wide.html -- --stream wide.html
+
+# a missing partial fails the render, whichever thread looked for it
+printf '{%% include parts/p1.html %%}{%% include parts/nope.html %%}' > missing.html
+expect_fail "nope.html" -j8 missing.html
+
+# a partial that fails to lex is reported once, whichever thread lexed it
+printf 'x{{ y' > parts/broken.html
+printf '{%% include parts/p1.html %%}{%% include parts/broken.html %%}' > broken.html
+for jobs in 1 2 8; do
+    expect_fail "failed to load include 'parts/broken.html'" -j$jobs broken.html
+    n=$(grep -o "unterminated '{{'" err.txt | wc -l)
+    [ $n -eq 1 ] || fail "-j$jobs broken.html: lex error logged $n times"
+done
+
+# cycles, direct or not, and the depth limit
+printf 'x{%% include self.html %%}' > self.html
+printf '{%% include cb.html %%}' > ca.html
+printf '{%% include ca.html %%}' > cb.html
+for t in self.html ca.html; do
+    expect_fail "include cycle" $t
+    expect_fail "include cycle" --stream $t
+done
+i=1
+while [ $i -le 4 ]; do
+    printf "$i{%% include d$((i + 1)).html %%}" > d$i.html
+    i=$((i + 1))
+done
+printf 'end' > d5.html
+expect_out "1234end" --max-include-depth 4 d1.html
+expect_out "1234end" --stream --max-include-depth 4 d1.html
+expect_fail "include depth exceeds 3" --max-include-depth 3 d1.html
+expect_fail "include depth exceeds 3" --stream --max-include-depth 3 d1.html
+
+# a partial included twice on one path is not a cycle
+printf '{%% include d5.html %%}{%% include d5.html %%}' > twice.html
+expect_out "endend" twice.html
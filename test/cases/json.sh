@@ -0,0 +1,59 @@
+# JSON configs: values, escapes and numbers, and every kind of bad input
+# refused with a message. \134 is a backslash, kept out of printf's way.
+
+printf '{{ config.size }}' > size.html
+printf '{{ a }}' > a.html
+printf 'text' > none.html
+
+# bad <message> <json>: refused, with <message>, whatever the template reads
+bad()
+{
+    printf '%s' "$2" > bad.json
+    for t in size.html a.html none.html; do
+        expect_fail "$1" -c bad.json $t
+    done
+}
+
+printf '{"s": "q\134"b\134\134s\134/n\134nt\134t", ' > v.json
+printf '"u": "\134u00e9\134ud83d\134ude00\134u0041", ' >> v.json
+printf '"n": [-0.5, 1e3, 1E-2, 0, -7, 2.50, 12345678901234567], ' >> v.json
+printf '"b": [true, false, null], "e": {}, "l": [], "w" :  { "x" : [ ] } }' >> v.json
+printf '{{ s }}|{{ u }}|{%% for x in n %%}{{ x }},{%% endfor %%}' > v.html
+printf '|{%% for x in b %%}[{{ x }}]{%% endfor %%}' >> v.html
+printf '|{{ e.size }}{{ l.size }}{{ w.x.size }}{{ config.size }}' >> v.html
+expect_out "$(printf 'q"b\134s/n\nt\t|\303\251\360\237\230\200A|-0.5,1000,0.01,0,-7,2.5,1.23456789012346e+16,|[true][false][]|0007')" \
+    -c v.json v.html
+
+bad "unexpected character" '{"a": [1, 2,]}'
+bad "unexpected character" '{"a": tru}'
+bad "expected a key" '{"a": 1,}'
+bad "expected a key" '{'
+bad "expected ':'" '{"a" 1}'
+bad "expected ',' or '}'" '{"a": 01}'
+bad "bad number" '{"a": -}'
+bad "bad number" '{"a": 1e}'
+bad "trailing characters" '{"a": 1} x'
+bad "trailing characters" '{"a": 1}{}'
+bad "unterminated string" '{"a": "abc'
+bad "control character" "$(printf '{"a": "a\tb"}')"
+bad "bad escape" "$(printf '{"a": "\134x"}')"
+bad "bad escape" "$(printf '{"a": "\134u12"}')"
+bad "lone surrogate" "$(printf '{"a": "\134ud800"}')"
+bad "lone surrogate" "$(printf '{"a": "\134udc00x"}')"
+bad "invalid object type" '[1]'
+
+# the whole input is checked, also past the last key a template reads
+bad "unexpected character" '{"a": 1, "b": tru}'
+bad "unexpected character" '{"a": 1, "b": [1, 2,}'
+bad "lone surrogate" "$(printf '{"a": 1, "b": "\134ud800"}')"
+bad "bad escape" "$(printf '{"a": 1, "b": {"\134u12": 1}}')"
+
+# the last of duplicate keys wins, read whole or not
+printf '{"a": 1, "b": 2, "a": 3}' > dup.json
+expect_out "3" -c dup.json a.html
+printf '{{ config.size }}{{ a }}' > dupall.html
+expect_out "23" -c dup.json dupall.html
+
+# errors point at their line
+printf '{\n"a": 1,\n"b": [1,\n2,]\n}' > lines.json
+expect_fail "at line 4" -c lines.json size.html
@@ -0,0 +1,47 @@
+# Several -c files: each is a layer over the ones before it
+
+cat > a.yml <<'END'
+title: Base
+site:
+  name: base
+  lang: en
+  meta: {a: 1, b: 2}
+list: [1, 2, 3]
+only_base: yes
+shape: {x: 1}
+END
+printf '{"title": "Mid", "site": {"name": "mid", "meta": {"b": 20}},' > b.json
+printf ' "list": [9], "shape": "flat", "only_mid": "m"}' >> b.json
+cat > c.yml <<'END'
+site:
+  meta:
+    c: 300
+shape: {y: 2}
+list: x
+END
+
+printf '{{ title }}|{{ site.name }}|{{ site.lang }}' > t.html
+printf '|{{ site.meta.a }}{{ site.meta.b }}{{ site.meta.c }}' >> t.html
+printf '|{{ list.first }}{{ list.last }}|{{ only_base }}{{ only_mid }}' >> t.html
+printf '|{{ shape.x }}{{ shape.y }}{{ shape }}' >> t.html
+printf '{{ config.size }}{{ site.size }}{{ site.meta.size }}' > sizes.html
+
+# later files win; nested dicts merge key by key, anything else is replaced
+expect_out "Base|base|en|12|13|yes|1" -c a.yml t.html
+expect_out "Mid|mid|en|120|99|yesm|flat" -c a.yml -c b.json t.html
+expect_out "Mid|mid|en|120300||yesm|2" -c a.yml -c b.json -c c.yml t.html
+expect_out "633" -c a.yml -c b.json -c c.yml sizes.html
+expect_out "Base|base|en|12|13|yesm|1" -c b.json -c a.yml t.html
+
+# a template that reads a few keys reads them from every layer
+printf '{{ site.meta.a }}{{ site.meta.c }}{{ title }}' > few.html
+expect_out "1300Mid" -c a.yml -c b.json -c c.yml few.html
+expect_out "1300Mid" -S -c a.yml -c b.json -c c.yml few.html
+expect_out "1300Mid" -S -c a.yml -c b.json -c c.yml few.html
+expect_same -c a.yml -c b.json -c c.yml t.html -- -S -c a.yml -c b.json -c c.yml t.html
+
+# an image compiled over layers wants the same files, in the same order
+"$FLUID" --compile -c a.yml -c b.json -o t.fluidc t.html || fail "compile t.html"
+expect_out "Mid|mid|en|120|99|yesm|flat" -c a.yml -c b.json t.fluidc
+expect_fail "compiled with other config" -c b.json -c a.yml t.fluidc
+expect_fail "compiled with other config" -c a.yml t.fluidc
@@ -0,0 +1,65 @@
+# Configs are built only as far as a template needs; what it sees must be
+# the same as after reading all of it
+
+# lazy <template>: renders the same as when the whole config is read
+lazy()
+{
+    printf '%s' "$1" > lazy.html
+    printf '%s{%% if config %%}{%% endif %%}' "$1" > whole.html
+    for c in c.yml c.json; do
+        expect_same -c $c lazy.html -- -c $c whole.html
+    done
+}
+
+cat > c.yml <<'END'
+skipped: &s
+  deep: { a: [1, 2, {b: 3}] }
+  name: anchored
+site:
+  title: Fluid
+  nav: [{name: home, url: /}, {name: docs, url: /docs}]
+  meta: { lang: en, tags: [x, y] }
+ref: *s
+merged:
+  <<: *s
+  own: 1
+last: end
+END
+cat > c.json <<'END'
+{"skipped": {"deep": {"a": [1, 2, {"b": 3}]}, "name": "anchored"},
+ "site": {"title": "Fluid",
+          "nav": [{"name": "home", "url": "/"}, {"name": "docs", "url": "/docs"}],
+          "meta": {"lang": "en", "tags": ["x", "y"]}},
+ "ref": {"deep": {"a": [1, 2, {"b": 3}]}, "name": "anchored"},
+ "merged": {"own": 1, "deep": {"a": [1, 2, {"b": 3}]}, "name": "anchored"},
+ "last": "end"}
+END
+
+lazy '{{ site.title }}'
+lazy '{{ site.meta.lang }}|{{ site.meta.size }}|{{ site.meta.tags.last }}'
+lazy '{% for n in site.nav %}{{ n.name }}={{ n.url }};{% endfor %}'
+lazy '{{ ref.name }}|{{ ref.deep.a.last.b }}|{{ ref.deep.a.size }}'
+lazy '{{ merged.own }}{{ merged.name }}{{ merged.size }}'
+lazy '{{ last }}'
+lazy '{{ config.site.title }}{{ site.nav.first.name }}{{ missing.key }}'
+lazy '{{ site }}'
+printf '{{ site.title }}|{{ last }}' > t.html
+expect_out "Fluid|end" -c c.yml t.html
+expect_out "Fluid|end" -c c.json t.html
+
+# the file is parsed to its end whatever a template reads, so a bad tail
+# is refused even after every wanted key is in
+printf '{{ a }}' > a.html
+printf 'text' > none.html
+printf '{{ config.size }}' > size.html
+# bad_tail <message> <yaml after a: 1>
+bad_tail()
+{
+    printf 'a: 1\n%s\n' "$2" > tail.yml
+    for t in a.html none.html size.html; do
+        expect_fail "$1" -c tail.yml $t
+    done
+}
+bad_tail "config parser error" 'b: [1, 2'
+bad_tail "undefined yaml alias" 'b: *nope'
+bad_tail "undefined yaml alias" 'b: {c: [x, *nope]}'
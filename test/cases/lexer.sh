@@ -0,0 +1,78 @@
+# Lexer: markup delimiters wherever they fall in the input
+
+# "{{" and "{%" at every offset across a few 16 and 32 byte SIMD blocks,
+# with lone '{', '%' and '}' around them
+want=""
+i=0
+while [ $i -lt 70 ]; do
+    pad=$(printf "%${i}s" '' | tr ' ' '.')
+    printf '%s{{ "x" }}%%{ }%% {%% if true %%}y{%% endif %%}{\n' "$pad" > t.html
+    expect_out "${pad}x%{ }% y{
+" t.html
+    i=$((i + 1))
+done
+
+# a delimiter split over the end of the input is text
+printf 'abc{' > open.html
+expect_out "abc{" open.html
+s=$(printf '%40s' '' | sed 's/ /{a/g')
+printf '%s{{ "z" }}' "$s" > braces.html
+expect_out "${s}z" braces.html
+
+# text is passed through byte for byte: NULs, CRs and UTF-8 included
+printf 'a\0b\r\n\303\251{{ "x" }}\0{%% comment %%}\0{%% endcomment %%}\n' > bytes.html
+printf 'a\0b\r\n\303\251x\0\n' > bytes.want
+"$FLUID" bytes.html > bytes.out || fail "fluid bytes.html"
+cmp -s bytes.want bytes.out || fail "bytes.html: text changed"
+
+# tokens larger than an arena chunk, between many small ones
+s=$(printf '%100000s' '' | tr ' ' q)
+{
+    printf '{%% assign v = "%s" %%}' "$s"
+    printf '{%% assign w = "%s" %%}{{ w }}' "$s$s$s"
+    printf '{%% if v != w %%}{{ v | strip }}{%% endif %%}'
+} > arena.html
+expect_out "$s$s$s$s" arena.html
+
+# enough blocks to grow the block vector many times over
+i=0
+while [ $i -lt 50000 ]; do
+    printf 'a{{ %d }}' $i
+    i=$((i + 1))
+done > blocks.html
+i=0
+while [ $i -lt 50000 ]; do
+    printf 'a%d' $i
+    i=$((i + 1))
+done > blocks.want
+"$FLUID" blocks.html > blocks.out || fail "fluid blocks.html"
+cmp -s blocks.want blocks.out || fail "blocks.html: wrong output"
+
+# tags and objects far over 256 bytes, with many tokens each
+cond=$(i=0; while [ $i -lt 60 ]; do printf 'x == %d or ' $i; i=$((i + 1)); done)
+filters=$(printf '%200s' '' | sed 's/ / | strip/g')
+printf '{%% assign x = 59 %%}{%% if %s false %%}yes{%% endif %%}' "$cond" > long.html
+printf '{{ "  y  " %s }}{{%500s"z"%500s}}' "$filters" '' '' >> long.html
+expect_out "yesyz" long.html
+
+# text split by comments, raw blocks and includes (empty ones too) is
+# joined back into one run, in order
+printf 'P{%% comment %%}q{%% endcomment %%}' > p.html
+: > e.html
+printf '{%% for i in (1..2) %%}a{%% comment %%}x{%% endcomment %%}b' > rope.html
+printf '{%% include p.html %%}c{%% include e.html %%}' >> rope.html
+printf '{%% raw %%}{{r}}{%% endraw %%}d|{%% endfor %%}' >> rope.html
+expect_out "abPc{{r}}d|abPc{{r}}d|" rope.html
+"$FLUID" --compile -o rope.fluidc rope.html || fail "compile rope.html"
+expect_out "abPc{{r}}d|abPc{{r}}d|" rope.fluidc
+
+# comment and raw bodies are never run, whatever markup they hold
+printf 'a{%% comment %%}{%% endraw %%}{{ "{%% endcomment %%}" }}b{%% endcomment %%}c' > comment.html
+expect_out "ac" comment.html
+printf 'a{%% raw %%}{%% comment %%}x{%% endcomment %%}{%% endraw %%}c' > raw.html
+expect_out "a{% comment %}x{% endcomment %}c" raw.html
+printf 'a{%%comment%%}x{%%endcomment%%}b{%%  raw  %%}y{%%endraw   %%}' > spaces.html
+expect_out "aby" spaces.html
+printf 'a{%% comment %%}{%% include missing.html %%}{%% endcomment %%}b' > inc.html
+printf '{%% raw %%}{%% include missing.html %%}{%% endraw %%}' >> inc.html
+expect_out "ab{% include missing.html %}" inc.html
@@ -0,0 +1,15 @@
+# Loading templates: mapped files, stdin, and files that can't be read
+
+: > empty.html
+expect_out "" empty.html
+printf 'x{{ 1 }}' > stdin.txt
+expect_out "x1" - < stdin.txt
+expect_fail "failed to read" missing.html
+mkdir dir.html
+expect_fail "failed to read" dir.html
+
+# markup ending on the last byte of a page, and a '{' just before it
+{ printf '%4089s' '' | tr ' ' a; printf '{{ 1 }}'; } > page.html
+expect_out "$(printf '%4089s' '' | tr ' ' a)1" page.html
+{ printf '%4095s' '' | tr ' ' a; printf '{'; } > brace.html
+expect_out "$(printf '%4095s' '' | tr ' ' a){" brace.html
@@ -0,0 +1,19 @@
+# Parse tree: nesting rules, and deep nesting
+
+printf '{%% if true %%}x{%% endfor %%}' > t1.html
+expect_fail "tag not allowed here" t1.html
+printf '{%% for i in (1..2) %%}{%% if true %%}x{%% endfor %%}{%% endif %%}' > t2.html
+expect_fail "tag not allowed here" t2.html
+printf '{%% break %%}' > t3.html
+expect_fail "tag not allowed here" t3.html
+printf '{%% when 1 %%}' > t4.html
+expect_fail "tag not allowed here" t4.html
+printf '{%% if true %%}x{%% else %%}y{%% elsif false %%}z{%% endif %%}' > t5.html
+expect_fail "tag after else" t5.html
+printf '{%% if true %%}x' > t6.html
+expect_fail "missing end tag" t6.html
+
+d=$(printf '%1000s' '' | sed 's/ /{% if true %}/g')
+e=$(printf '%1000s' '' | sed 's/ /{% endif %}/g')
+printf '%sdeep%s' "$d" "$e" > deep.html
+expect_out "deep" deep.html
@@ -0,0 +1,36 @@
+# Object paths: keys, indices, first/last/size, and locals over globals
+
+cat > p.yml <<'END'
+a:
+  b:
+    c: deep
+list:
+  - { key: k0 }
+  - { key: k1 }
+str: hello
+d: { x: 1, y: 2 }
+s: { size: 9 }
+END
+
+# check <expected> <template>: folded, and by the VM from an image
+check()
+{
+    printf '%s' "$2" > t.html
+    expect_out "$1" -c p.yml t.html
+    "$FLUID" --compile -o t.fluidc t.html || { fail "compile $2"; return; }
+    expect_out "$1" -c p.yml t.fluidc
+}
+
+check "deep|deep" '{{ a.b.c }}|{{ config.a.b.c }}'
+check "k1|k0|k1" '{{ list[1].key }}|{{ list.first.key }}|{{ list.last.key }}'
+check "5|2|2|9" '{{ str.size }}|{{ list.size }}|{{ d.size }}|{{ s.size }}'
+check "[][][]" '[{{ a.x.y }}][{{ list[5].key }}][{{ str.b }}]'
+check "1deep" '{% assign a = d %}{{ a.x }}{{ config.a.b.c }}'
+check "k0k1" '{% for l in list %}{{ l.key }}{% endfor %}'
+
+# an index is plain digits that fit one
+for bad in '[+1]' '[-1]' '[1x]' '[]' '[4294967296]' '[99999999999999999999]'; do
+    printf '{{ list%s.key }}' "$bad" > bad.html
+    expect_fail "bad variable" -c p.yml bad.html
+done
+check "[]" '[{{ list[4294967295].key }}]'
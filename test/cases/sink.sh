@@ -0,0 +1,27 @@
+# Output sink: staged (copied) and by-reference writes past SINK_IOV_MAX
+
+# 300 loop passes, each a short staged write and a 600 byte text span that
+# is written by reference; several times more iovecs than one batch holds
+printf '{"items": [' > items.json
+i=0
+while [ $i -lt 300 ]; do
+    [ $i -gt 0 ] && printf ',' >> items.json
+    printf '%d' $i >> items.json
+    i=$((i + 1))
+done
+printf ']}' >> items.json
+
+B=$(printf '%600s' '' | tr ' ' B)
+printf '{%% for i in items %%}{{ i }}%s{%% endfor %%}' "$B" > loop.html
+
+want=""
+i=0
+while [ $i -lt 300 ]; do
+    want="$want$i$B"
+    i=$((i + 1))
+done
+expect_out "$want" -c items.json loop.html
+
+# same, through -o
+"$FLUID" -c items.json -o file.txt loop.html || fail "fluid -o"
+cmp -s file.txt want.txt || fail "fluid -o file.txt: wrong output"
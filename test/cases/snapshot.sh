@@ -0,0 +1,49 @@
+# Config snapshots (-S): reused while the config is unchanged, and never
+# trusted when damaged
+
+# patch <file> <offset> <bytes>: overwrite bytes in place
+patch()
+{
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+printf 'title: Hello\nnav:\n  items: [a, b]\n  size: 2\nzz: tail\n' > c.yml
+printf '{{ title }}|{{ nav.items.last }}|{{ nav.size }}|{{ zz }}' > t.html
+expect_out "Hello|b|2|tail" -S -c c.yml t.html
+[ -f c.yml.fluidcfg ] || fail "no snapshot written"
+cp c.yml.fluidcfg good.fluidcfg
+
+# strings come last and are used in place: "Hello" is the last one
+size=$(wc -c < good.fluidcfg)
+patch c.yml.fluidcfg $((size - 6)) 'J'
+expect_out "Jello|b|2|tail" -S -c c.yml t.html
+expect_out "Hello|b|2|tail" -c c.yml t.html
+
+# an edited config makes a new snapshot
+printf 'title: Changed\nnav:\n  items: [x]\n  size: 1\nzz: tail\n' > c.yml
+expect_out "Changed|x|1|tail" -S -c c.yml t.html
+expect_out "Changed|x|1|tail" -S -c c.yml t.html
+cmp -s c.yml.fluidcfg good.fluidcfg && fail "snapshot not refreshed"
+
+printf 'title: Hello\nnav:\n  items: [a, b]\n  size: 2\nzz: tail\n' > c.yml
+expect_out "Hello|b|2|tail" -S -c c.yml t.html
+cmp -s c.yml.fluidcfg good.fluidcfg || fail "snapshot not reproducible"
+
+# a bad magic, or a truncated file, is parsed again and replaced
+patch c.yml.fluidcfg 0 'XXXX'
+expect_out "Hello|b|2|tail" -S -c c.yml t.html
+cmp -s c.yml.fluidcfg good.fluidcfg || fail "bad magic not replaced"
+head -c $((size / 2)) good.fluidcfg > c.yml.fluidcfg
+expect_out "Hello|b|2|tail" -S -c c.yml t.html
+: > c.yml.fluidcfg
+expect_out "Hello|b|2|tail" -S -c c.yml t.html
+
+# damage anywhere before the strings is refused or harmless, never a crash
+off=8
+while [ $off -lt $((size - 32)) ]; do
+    cp good.fluidcfg c.yml.fluidcfg
+    patch c.yml.fluidcfg $off '\377\377\377\377'
+    "$FLUID" -S -c c.yml t.html > out.txt 2> err.txt ||
+        fail "damaged at $off: $(cat err.txt)"
+    off=$((off + 4))
+done
@@ -0,0 +1,58 @@
+# --stream renders what the normal path does, or refuses the template
+
+for name in 001_raw_head_partial 003_include_raw_html; do
+    expect_same "$TEST_DIR/html/$name.html" -- --stream "$TEST_DIR/html/$name.html"
+done
+
+# comments, raw blocks and includes across many 64K chunks
+printf 'part {%% raw %%}{{ in part }}{%% endraw %%}\n' > part.html
+i=0
+while [ $i -lt 2000 ]; do
+    printf 'line %d {%% comment %%} {{ gone }} {%% endcomment %%}' $i
+    printf '{%% raw %%}{%% if %%}{{ kept }}{%% endraw %%}'
+    printf '{%% include part.html %%}'
+    printf '%80s\n' ''
+    i=$((i + 1))
+done > big.html
+expect_same big.html -- --stream big.html
+expect_same big.html -- --stream - < big.html
+
+printf '{%% if false %%}HIDDEN{%% endif %%}' > if.html
+expect_fail "needs a full render" --stream if.html
+printf 'a{{ title }}' > object.html
+expect_fail "needs a full render" --stream object.html
+printf 'a{%% include object.html %%}' > inc.html
+expect_fail "needs a full render" --stream inc.html
+expect_fail "needs a full render" --stream "$TEST_DIR/html/005_tag_nesting_check.html"
+printf 'title: x\n' > c.yml
+expect_fail "does not read config" --stream -c c.yml part.html
+
+# delimiters on either side of a chunk boundary, and a tag over a chunk
+for off in 65534 65535 65536; do
+    { printf "%${off}s" '' | tr ' ' a; printf '{%% comment %%}x{%% endcomment %%}b'; } > s$off.html
+    expect_same s$off.html -- --stream s$off.html
+done
+{ printf '{%% include '; printf '%70000s' ''; printf 'part.html %%}'; } > bigtag.html
+expect_same bigtag.html -- --stream bigtag.html
+
+# a chunk boundary at every offset of some markup; a close is only looked
+# for after its opener, so "{%}" is never a tag of its own
+tpl='a{% raw %}{%}{% endraw %}b{% endraw %}c{% comment %}{{ x }}{%}%}'
+tpl="$tpl{% endcomment %}d{% raw %}{{}}{%%}{% endraw %}e"
+off=0
+while [ $off -le ${#tpl} ]; do
+    { printf "%$((65536 - off))s" '' | tr ' ' a; printf '%s' "$tpl"; } > split.html
+    expect_same split.html -- --stream split.html
+    off=$((off + 1))
+done
+
+# both fail on an unterminated comment or raw block
+printf 'a{%% comment %%}b' > comment.html
+expect_fail "unterminated" comment.html
+expect_fail "unterminated" --stream comment.html
+printf 'a{%% raw %%}b' > raw.html
+expect_fail "unterminated" raw.html
+expect_fail "unterminated" --stream raw.html
+printf 'a{{ b' > object_open.html
+expect_fail "unterminated '{{'" object_open.html
+expect_fail "unterminated '{{'" --stream object_open.html
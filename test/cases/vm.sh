@@ -0,0 +1,34 @@
+# VM: control flow, captures, counters and filters. Each template is also
+# compiled without a config, so nothing is folded and the VM does it all.
+
+cat > c.yml <<'END'
+n: 5
+two: 2
+items: [a, b, c, d]
+name: "  x  "
+flag: false
+END
+
+# check <expected> <template>
+check()
+{
+    printf '%s' "$2" > t.html
+    expect_out "$1" -c c.yml t.html
+    "$FLUID" --compile -o t.fluidc t.html || { fail "compile $2"; return; }
+    expect_out "$1" -c c.yml t.fluidc
+}
+
+check "23" '{% for i in (1..n) limit:2 offset:1 %}{{ i }}{% endfor %}'
+check "543" '{% for i in (1..n) reversed %}{{ i }}{% if i == 3 %}{% break %}{% endif %}{% endfor %}'
+check "acd" '{% for i in items %}{% if i == "b" %}{% continue %}{% endif %}{{ i }}{% endfor %}'
+check "b|c" '{% for i in items offset:1 limit:two %}{{ i }}{% unless i == "c" %}|{% endunless %}{% endfor %}'
+check "two" '{% case two %}{% when 1 %}one{% when 2 %}two{% else %}other{% endcase %}'
+check "other" '{% case n %}{% when 1 %}one{% else %}other{% endcase %}'
+check "e" '{% if flag %}f{% elsif n > 4 and two < 3 %}e{% else %}g{% endif %}'
+check "u" '{% unless flag or n < 0 %}u{% endunless %}'
+check "[a,b,c,d,]" '{% capture s %}{% for i in items %}{{ i }},{% endfor %}{% endcapture %}[{{ s }}]'
+check "<<a>>" '{% capture o %}<{% capture i %}a{% endcapture %}<{{ i }}>{% endcapture %}{{ o }}>'
+check "01-1" '{% increment a %}{% increment a %}{% decrement b %}'
+check "[x][x  ][  x]" '[{{ name | strip }}][{{ name | lstrip }}][{{ name | rstrip }}]'
+check "5bx" '{% assign k = n %}{{ k }}{% assign k = items[1] %}{{ k }}{% assign k = name | strip %}{{ k }}'
+check "ad" '{% for i in items %}{% for j in (1..2) %}{% if j == 2 %}{% break %}{% endif %}{% if forloop %}{% endif %}{% endfor %}{% endfor %}{{ items.first }}{{ items.last }}'
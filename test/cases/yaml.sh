@@ -0,0 +1,64 @@
+# YAML configs: scalars, block styles, anchors, merge keys and bad input
+
+cat > y.yml <<'END'
+base: &b
+  name: base
+  n: 1
+derived:
+  n: 2
+  <<: *b
+  m: 3
+alias: *b
+t: true
+q: "true"
+nul: ~
+i: 42
+fl: 1.5
+hex: 0x10
+esc: "a\tbé"
+single: 'it''s'
+lit: |
+  line1
+  line2
+fold: >
+  w1
+  w2
+list:
+  - *b
+  - plain
+END
+
+# plain scalars are typed, quoted ones are strings
+printf '{%% if t == true %%}T{%% endif %%}{%% if q == "true" %%}Q{%% endif %%}' > types.html
+printf '{%% if nul == nil %%}N{%% endif %%}|{{ i }}|{{ fl }}|{{ hex }}' >> types.html
+expect_out "TQN|42|1.5|16" -c y.yml types.html
+
+printf '{{ lit }}|{{ fold }}|{{ esc }}|{{ single }}' > strings.html
+expect_out "$(printf 'line1\nline2\n|w1 w2\n|a\tbé|it'"'"'s')" -c y.yml strings.html
+
+# merged keys never override own keys, before or after the `<<`
+printf '{{ derived.name }}{{ derived.n }}{{ derived.m }}|{{ alias.name }}' > anchors.html
+printf '|{{ list.first.name }}{{ list.last }}' >> anchors.html
+expect_out "base23|base|baseplain" -c y.yml anchors.html
+printf '{{ config.size }}{{ derived.size }}' > whole.html
+expect_out "143" -c y.yml whole.html
+
+
+# the last of duplicate keys wins, read whole or not
+printf 'a: 1\nb: 2\na: 3\n' > dup.yml
+printf '{{ a }}' > dup.html
+expect_out "3" -c dup.yml dup.html
+printf '{{ config.size }}{{ a }}' > dupall.html
+expect_out "23" -c dup.yml dupall.html
+
+# an empty file is an empty config
+: > empty.yml
+printf '{{ config.size }}' > size.html
+expect_out "0" -c empty.yml size.html
+
+printf 'a: [1, 2\n' > syntax.yml
+expect_fail "config parser error" -c syntax.yml size.html
+printf 'a: *nope\n' > alias.yml
+expect_fail "undefined yaml alias" -c alias.yml size.html
+printf -- '- a\n- b\n' > list.yml
+expect_fail "invalid object type" -c list.yml size.html
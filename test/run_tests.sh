@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+#  Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+#
+#  SPDX-License-Identifier: Apache-2.0
+#
+#  Usage: run_tests.sh <fluid-binary> <case.sh>...
+#
+#  Each case is a shell script sourced in its own temporary directory, with
+#  the helpers below. A case fails if any of its checks does.
+#
+
+FLUID=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+shift
+
+failed=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# expect_out <expected-output> <fluid args>...
+expect_out()
+{
+    want=$1
+    shift
+    "$FLUID" "$@" > out.txt 2> err.txt || {
+        fail "fluid $* exited with $?"; cat err.txt; return
+    }
+    printf '%s' "$want" > want.txt
+    cmp -s out.txt want.txt || {
+        fail "fluid $*"; cmp want.txt out.txt
+    }
+}
+
+# expect_same <fluid args> -- <fluid args>: both render the same output
+expect_same()
+{
+    a=""
+    while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+        a="$a '$1'"; shift
+    done
+    shift
+    eval "\"\$FLUID\" $a" > a.txt 2> err.txt || { fail "fluid $a"; return; }
+    "$FLUID" "$@" > b.txt 2> err.txt || { fail "fluid $*"; return; }
+    cmp -s a.txt b.txt || { fail "fluid $a != fluid $*"; cmp a.txt b.txt; }
+}
+
+# expect_fail <message> <fluid args>...: non-zero exit, message on stderr
+expect_fail()
+{
+    msg=$1
+    shift
+    if "$FLUID" "$@" > out.txt 2> err.txt; then
+        fail "fluid $* succeeded"
+    elif ! grep -q -- "$msg" err.txt; then
+        fail "fluid $*: no '$msg' in:"; cat err.txt
+    fi
+}
+
+for case in "$@"; do
+    case=$(cd "$(dirname "$case")" && pwd)/$(basename "$case")
+    dir=$(mktemp -d)
+    (failed=0; cd "$dir" || exit 1; . "$case"; exit $failed)
+    [ $? -eq 0 ] || { echo "FAIL: $(basename "$case")"; failed=1; }
+    rm -rf "$dir"
+done
+
+exit $failed